@@ -1,46 +1,210 @@
 #include <algorithm>
+#include <array>
 #include <atomic>
+#include <cerrno>
 #include <chrono>
+#include <climits>
+#include <condition_variable>
 #include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <ctime>
+#include <deque>
+#include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <random>
+#include <sstream>
+#include <stdexcept>
 #include <string>
 #include <thread>
 #include <vector>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h> // Before anything that pulls in windows.h
+#include <ws2tcpip.h>
+#include <fcntl.h>
+#include <intrin.h>
+#include <io.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "ws2_32.lib")
+#endif
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#endif
 
 // --- Logging System ---
-std::mutex g_log_mutex;
-void log_to_file(const std::string &message) {
-  std::lock_guard<std::mutex> lock(g_log_mutex);
-  std::ofstream log_file("backend.log", std::ios_base::app);
-  if (log_file.is_open()) {
-    auto now = std::chrono::system_clock::now();
-    auto in_time_t = std::chrono::system_clock::to_time_t(now);
-    std::tm buf;
-    localtime_s(&buf, &in_time_t);
-    log_file << "[" << std::put_time(&buf, "%Y-%m-%d %H:%M:%S") << "] "
-             << message << std::endl;
+// Producers copy a record into a bounded lock-free ring (one slot per record,
+// sequence numbers as in Vyukov's bounded queue); a background thread formats
+// the timestamps and writes whole batches to one open backend.log, flushing
+// once per batch. Nothing on the calling thread touches the file.
+enum LogLevel { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR };
+
+// Records below this level are compiled out, arguments included. Build with
+// -DLOG_MIN_LEVEL=0 to get LOG_DEBUG records.
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 1
+#endif
+
+// What a producer does when the ring is full. LOG_ERROR records always
+// block so the reason for a crash reaches the file.
+enum LogOverflow { LOG_DROP, LOG_BLOCK };
+
+class AsyncLogger {
+public:
+  static const int CAPACITY = 1024; // Power of two
+  static const int TEXT_BYTES = 240;
+
+  explicit AsyncLogger(const char *path)
+      : file(path, std::ios_base::app), head(0), tail(0), dropped(0),
+        overflow(LOG_DROP), stopping(false) {
+    for (int i = 0; i < CAPACITY; ++i)
+      slots[i].seq.store(i, std::memory_order_relaxed);
+    worker = std::thread(&AsyncLogger::drain_loop, this);
+  }
+
+  ~AsyncLogger() { stop(); }
+
+  void set_overflow(LogOverflow policy) { overflow = policy; }
+
+  void write(int level, const std::string &message) {
+    const bool block = overflow == LOG_BLOCK || level >= LOG_ERROR;
+    uint64_t pos = head.load(std::memory_order_relaxed);
+    Slot *slot;
+    for (;;) {
+      slot = &slots[pos & (CAPACITY - 1)];
+      uint64_t seq = slot->seq.load(std::memory_order_acquire);
+      if (seq == pos) {
+        if (head.compare_exchange_weak(pos, pos + 1,
+                                       std::memory_order_relaxed))
+          break;
+      } else if (seq < pos) {
+        // Full: the consumer has not freed this slot yet
+        if (!block || stopping) {
+          dropped.fetch_add(1, std::memory_order_relaxed);
+          return;
+        }
+        std::this_thread::yield();
+        pos = head.load(std::memory_order_relaxed);
+      } else {
+        pos = head.load(std::memory_order_relaxed);
+      }
+    }
+    slot->level = level;
+    slot->time = std::chrono::system_clock::to_time_t(
+        std::chrono::system_clock::now());
+    slot->len = static_cast<int>(
+        std::min<size_t>(message.size(), TEXT_BYTES));
+    message.copy(slot->text, slot->len);
+    slot->seq.store(pos + 1, std::memory_order_release);
+  }
+
+  // Drains what is queued and joins the writer; later records are dropped
+  void stop() {
+    if (stopping.exchange(true))
+      return;
+    if (worker.joinable())
+      worker.join();
+  }
+
+private:
+  struct Slot {
+    std::atomic<uint64_t> seq;
+    int level;
+    std::time_t time;
+    int len;
+    char text[TEXT_BYTES];
+  };
+
+  // Writes every committed record; returns how many
+  int drain() {
+    static const char *const names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+    int n = 0;
+    for (;; ++n) {
+      Slot &slot = slots[tail & (CAPACITY - 1)];
+      if (slot.seq.load(std::memory_order_acquire) != tail + 1)
+        break;
+      std::tm buf;
+#ifdef _WIN32
+      localtime_s(&buf, &slot.time);
+#else
+      localtime_r(&slot.time, &buf);
+#endif
+      file << "[" << std::put_time(&buf, "%Y-%m-%d %H:%M:%S") << "] ";
+      if (slot.level != LOG_INFO)
+        file << names[slot.level] << ": ";
+      file.write(slot.text, slot.len);
+      file << '\n';
+      slot.seq.store(tail + CAPACITY, std::memory_order_release);
+      ++tail;
+    }
+    uint64_t lost = dropped.exchange(0, std::memory_order_relaxed);
+    if (lost > 0)
+      file << "(" << lost << " log records dropped)\n";
+    if (n > 0 || lost > 0)
+      file.flush();
+    return n;
+  }
+
+  void drain_loop() {
+    while (!stopping.load(std::memory_order_acquire))
+      if (drain() == 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    drain();
   }
+
+  std::ofstream file;
+  Slot slots[CAPACITY];
+  std::atomic<uint64_t> head; // Next slot to claim (producers)
+  uint64_t tail;              // Next slot to write (writer thread only)
+  std::atomic<uint64_t> dropped;
+  std::atomic<int> overflow;
+  std::atomic<bool> stopping;
+  std::thread worker;
+};
+
+AsyncLogger g_logger("backend.log");
+
+#define LOG_AT(level, message)                                              \
+  do {                                                                      \
+    if ((level) >= LOG_MIN_LEVEL)                                           \
+      g_logger.write((level), (message));                                   \
+  } while (0)
+
+inline void log_to_file(const std::string &message) {
+  LOG_AT(LOG_INFO, message);
 }
 
 // --- Neuron parameters ---
-const int V_THRESH = 2;
 const int V_REST = 0;
 const int REFRACTORY_PERIOD = 1;
-const int MEMBRANE_DECAY_PERIOD = 750;
 
 // --- Synapse / R-STDP parameters ---
 const int CONFIDENCE_MAX = 5;
 const int CONFIDENCE_THR = 1;
-const int SPIKE_TRACE_WINDOW = 10;
-const int ELIGIBILITY_TRACE_WINDOW = 100;
-const int CONFIDENCE_LEAK_PERIOD = 5300;
-const int REINFORCEMENT_INERTIA_PERIOD = 10;
-const int PRUNING_PERIOD = 150;
 
 // Simulation Constants
 const int WORLD_SIZE = 60;
@@ -50,7 +214,174 @@ const double CONNECTION_DENSITY = 0.1;
 const int CONFIDENCE_INIT_LOW = CONFIDENCE_THR;
 const int CONFIDENCE_INIT_HIGH = CONFIDENCE_MAX;
 const int RANDOM_ACTIVITY_COUNT = 1;
-const int RANDOM_ACTIVITY_PERIOD = 5;
+
+// --- Rule parameters ---
+// Threshold, windows and periods of the neuron and learning rules, one
+// Params value per rule set. SpikingNet, Simulation and AgentBatch read them
+// through a rules policy, as they read sizes through a topology:
+// PresetRules<P> makes a constexpr Params compile-time constants, so every
+// window and period folds (% pruning_period becomes a multiply and shift, a
+// mask for a power of two); RuntimeRules holds values read at run time
+// (--params, --param) for exploratory sweeps.
+struct Params {
+  int v_thresh;
+  int membrane_decay_period;
+  int spike_trace_window;
+  int eligibility_trace_window;
+  int confidence_leak_period;
+  int reinforcement_inertia_period;
+  int pruning_period;
+  int random_activity_period; // 0: no random input
+};
+
+inline constexpr Params DEFAULT_PARAMS = {2, 750, 10, 100, 5300, 10, 150, 5};
+// The defaults with the two checked periods rounded to powers of two
+inline constexpr Params POW2_PARAMS = {2, 750, 10, 100, 5300, 10, 128, 4};
+
+constexpr bool operator==(const Params &a, const Params &b) {
+  return a.v_thresh == b.v_thresh &&
+         a.membrane_decay_period == b.membrane_decay_period &&
+         a.spike_trace_window == b.spike_trace_window &&
+         a.eligibility_trace_window == b.eligibility_trace_window &&
+         a.confidence_leak_period == b.confidence_leak_period &&
+         a.reinforcement_inertia_period == b.reinforcement_inertia_period &&
+         a.pruning_period == b.pruning_period &&
+         a.random_activity_period == b.random_activity_period;
+}
+constexpr bool operator!=(const Params &a, const Params &b) {
+  return !(a == b);
+}
+
+// What the rule code supports: positive windows and periods, trace and
+// inertia timers that fit 8 bits and leak timers that fit 16 (see
+// DigitalSynapse), a threshold below which voltages fit 16 (NeuronStore)
+constexpr bool params_valid(const Params &p) {
+  return p.v_thresh > 0 && p.v_thresh <= INT16_MAX &&
+         p.membrane_decay_period > 0 &&
+         p.membrane_decay_period <= UINT16_MAX &&
+         p.spike_trace_window > 0 && p.spike_trace_window <= UINT8_MAX &&
+         p.eligibility_trace_window > 0 &&
+         p.eligibility_trace_window <= UINT8_MAX &&
+         p.confidence_leak_period > 0 &&
+         p.confidence_leak_period <= UINT16_MAX &&
+         p.reinforcement_inertia_period > 0 &&
+         p.reinforcement_inertia_period <= UINT8_MAX &&
+         p.pruning_period > 0 && p.random_activity_period >= 0;
+}
+
+// Names in --params files and --param, in Params order
+struct ParamField {
+  const char *name;
+  int Params::*field;
+};
+const ParamField PARAM_FIELDS[] = {
+    {"v_thresh", &Params::v_thresh},
+    {"membrane_decay_period", &Params::membrane_decay_period},
+    {"spike_trace_window", &Params::spike_trace_window},
+    {"eligibility_trace_window", &Params::eligibility_trace_window},
+    {"confidence_leak_period", &Params::confidence_leak_period},
+    {"reinforcement_inertia_period", &Params::reinforcement_inertia_period},
+    {"pruning_period", &Params::pruning_period},
+    {"random_activity_period", &Params::random_activity_period}};
+
+struct ParamsPreset {
+  const char *name;
+  const Params *params;
+};
+const ParamsPreset PARAMS_PRESETS[] = {{"default", &DEFAULT_PARAMS},
+                                       {"pow2", &POW2_PARAMS}};
+
+// Sets one field by name; returns false if there is no such field
+inline bool set_param(Params &p, const std::string &name, int value) {
+  for (const ParamField &f : PARAM_FIELDS) {
+    if (name == f.name) {
+      p.*f.field = value;
+      return true;
+    }
+  }
+  return false;
+}
+
+// A preset name, or a file of "name value" lines ('#' starts a comment)
+// applied over the defaults. Throws std::runtime_error on a bad file.
+inline Params read_params(const std::string &source) {
+  for (const ParamsPreset &preset : PARAMS_PRESETS)
+    if (source == preset.name)
+      return *preset.params;
+  std::ifstream in(source);
+  if (!in)
+    throw std::runtime_error("cannot open " + source);
+  Params p = DEFAULT_PARAMS;
+  std::string line;
+  for (int n = 1; std::getline(in, line); ++n) {
+    std::istringstream fields(line.substr(0, line.find('#')));
+    std::string name;
+    int value;
+    if (!(fields >> name))
+      continue;
+    if (!(fields >> value) || !set_param(p, name, value))
+      throw std::runtime_error(source + ":" + std::to_string(n) +
+                               ": expected <parameter> <integer>");
+  }
+  return p;
+}
+
+// JSON object of every field
+inline void print_params(std::ostream &out, const Params &p) {
+  out << "{";
+  for (const ParamField &f : PARAM_FIELDS)
+    out << (&f == PARAM_FIELDS ? "" : ",") << "\"" << f.name
+        << "\":" << p.*f.field;
+  out << "}";
+}
+
+template <const Params &P> struct PresetRules {
+  static_assert(params_valid(P), "preset outside the rule limits");
+  static constexpr const Params &params() { return P; }
+  static constexpr int v_thresh() { return P.v_thresh; }
+  static constexpr int membrane_decay_period() {
+    return P.membrane_decay_period;
+  }
+  static constexpr int spike_trace_window() { return P.spike_trace_window; }
+  static constexpr int eligibility_trace_window() {
+    return P.eligibility_trace_window;
+  }
+  static constexpr int confidence_leak_period() {
+    return P.confidence_leak_period;
+  }
+  static constexpr int reinforcement_inertia_period() {
+    return P.reinforcement_inertia_period;
+  }
+  static constexpr int pruning_period() { return P.pruning_period; }
+  static constexpr int random_activity_period() {
+    return P.random_activity_period;
+  }
+};
+
+struct RuntimeRules {
+  Params values;
+
+  explicit RuntimeRules(const Params &p = DEFAULT_PARAMS) : values(p) {
+    if (!params_valid(p))
+      throw std::invalid_argument("rule parameters outside their limits");
+  }
+
+  const Params &params() const { return values; }
+  int v_thresh() const { return values.v_thresh; }
+  int membrane_decay_period() const { return values.membrane_decay_period; }
+  int spike_trace_window() const { return values.spike_trace_window; }
+  int eligibility_trace_window() const {
+    return values.eligibility_trace_window;
+  }
+  int confidence_leak_period() const { return values.confidence_leak_period; }
+  int reinforcement_inertia_period() const {
+    return values.reinforcement_inertia_period;
+  }
+  int pruning_period() const { return values.pruning_period; }
+  int random_activity_period() const { return values.random_activity_period; }
+};
+
+typedef PresetRules<DEFAULT_PARAMS> DefaultRules;
 
 // --- SIMULATION CONTROL (Globals) ---
 std::atomic<bool> g_paused(true); // Start paused
@@ -58,810 +389,7654 @@ std::atomic<bool> g_reset(false);
 std::atomic<int> g_delay_ms(500);
 std::atomic<bool> g_running(true);
 std::atomic<int>
-    g_reward_mode(0); // 0: Normal, 1: Inverse, 2: All Danger, 3: All Reward
+    g_reward_mode(0); // 'mode' command, copied into World::reward_mode
+std::atomic<int> g_engine(0); // 0: Dense, 1: Event-driven (see Engine)
+std::atomic<bool> g_keyframe_request(false); // Next delta frame is full
+std::atomic<int> g_fps(30); // Publisher frame rate, 0: as fast as it can
+std::atomic<bool> g_trace(true); // Causal highlights, off while unwatched
+std::atomic<bool> g_checkpoint_request(false); // 'save'/'load' pending
+std::mutex g_checkpoint_mutex;                  // Guards the two paths below
+std::string g_save_path;
+std::string g_load_path;
+std::atomic<bool> g_stats_request(false); // 'stats': report with next frame
+std::atomic<uint64_t> g_serialize_ns(0);   // Publisher time encoding and
+std::atomic<uint64_t> g_serialized(0);     // writing frames, and their count
+std::atomic<long long> g_step_ticks(0); // 'step N': ticks to run, then pause
 
-// --- Data structures ---
+// Wakes the simulation thread for commands and snapshot requests, so a
+// paused or pacing loop blocks instead of polling. A waiter passes the
+// generation it read before checking the flags; no notify() after that
+// read is missed.
+class ControlEvents {
+public:
+  ControlEvents() : gen(0) {}
 
-struct DigitalSynapse {
-  int target_neuron_idx;
-  int confidence;
-  bool active;
-
-  int ltp_timer;
-  int ltd_timer;
-
-  bool eligible_for_LTP;
-  bool eligible_for_LTD;
-  int eligibility_ltp_timer;
-  int eligibility_ltd_timer;
-  int confidence_leak_timer;
-  bool highlighted;
-
-  bool reward_acceptor;
-  bool penalty_acceptor;
-  int reward_inertia_counter;
-  int penalty_inertia_counter;
-
-  int ticks_since_ltp;
-  bool plastic;
-
-  DigitalSynapse(int target, int init_conf = 1, bool _plastic = true)
-      : target_neuron_idx(target), confidence(init_conf),
-        active(init_conf >= CONFIDENCE_THR), ltp_timer(0), ltd_timer(0),
-        eligible_for_LTP(false), eligible_for_LTD(false),
-        eligibility_ltp_timer(0), eligibility_ltd_timer(0),
-        confidence_leak_timer(CONFIDENCE_LEAK_PERIOD), highlighted(false),
-        reward_acceptor(true), penalty_acceptor(true),
-        reward_inertia_counter(0), penalty_inertia_counter(0),
-        ticks_since_ltp(0), plastic(_plastic) {}
+  uint64_t generation() const { return gen.load(std::memory_order_acquire); }
+
+  void notify() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      gen.fetch_add(1, std::memory_order_release);
+    }
+    cv.notify_all();
+  }
+
+  void wait(uint64_t seen) {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&] { return generation() != seen; });
+  }
+
+  void wait_until(uint64_t seen,
+                  std::chrono::steady_clock::time_point deadline) {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait_until(lock, deadline, [&] { return generation() != seen; });
+  }
+
+private:
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::atomic<uint64_t> gen;
 };
 
-struct DigitalNeuron {
-  int id;
-  int voltage;
-  int refractory_timer;
-  bool spiked_this_step;
-  int input_buffer;
-  int leak_timer;
+ControlEvents g_control; // Notified after every command and frame request
 
-  // History for causal tracing
-  struct Contribution {
-    int from_row;
-    int syn_idx;
-  };
-  std::vector<Contribution> next_contributors;
-  std::vector<std::vector<Contribution>> contrib_history;
-  std::vector<bool> spike_history;
-  static const int MAX_HIST = 32;
+// --- Tick Statistics ---
+// Event counters, steady-clock time per phase of a tick and a histogram of
+// whole-tick latency. Reading the clock costs about as much as a small
+// brain's phase, so only every STATS_SAMPLE_PERIOD-th tick is timed; counters
+// see every tick. Everything is compiled out with -DENABLE_STATS=0. A net's
+// TickStats is touched by the simulation thread alone: parallel lanes count
+// into their own StatCounts, summed after the step.
+#ifndef ENABLE_STATS
+#define ENABLE_STATS 1
+#endif
+#ifndef STATS_SAMPLE_PERIOD
+#define STATS_SAMPLE_PERIOD 8
+#endif
+
+enum StatPhase {
+  PHASE_NEURONS,
+  PHASE_PLASTICITY, // Propagation and the learning rule
+  PHASE_PRUNING,
+  PHASE_TRACE,   // trace_causal_chain and clearing the last highlights
+  PHASE_HISTORY, // Recording spikes and contributions for the trace
+  PHASE_WORLD,
+  PHASE_COUNT
+};
+const char *const STAT_PHASE_NAMES[PHASE_COUNT] = {
+    "neurons", "plasticity", "pruning", "trace", "history", "world"};
+
+enum StatCounter {
+  STAT_SPIKES,
+  STAT_LTP,   // Confidence raised by reward
+  STAT_LTD,   // Confidence lowered by reward or penalty
+  STAT_LEAKS, // Confidence halved by the leak
+  STAT_REWIRES,
+  STAT_COUNT
+};
+const char *const STAT_COUNTER_NAMES[STAT_COUNT] = {"spikes", "ltp", "ltd",
+                                                    "leaks", "rewires"};
+
+inline uint64_t stats_now_ns() {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count());
+}
+
+// Index of the highest set bit; v must not be 0
+inline int floor_log2(uint64_t v) {
+#if defined(_MSC_VER) && defined(_WIN64)
+  unsigned long bit;
+  _BitScanReverse64(&bit, v);
+  return static_cast<int>(bit);
+#elif defined(_MSC_VER)
+  unsigned long bit;
+  if (_BitScanReverse(&bit, static_cast<unsigned long>(v >> 32)))
+    return static_cast<int>(bit) + 32;
+  _BitScanReverse(&bit, static_cast<unsigned long>(v));
+  return static_cast<int>(bit);
+#else
+  return 63 - __builtin_clzll(v);
+#endif
+}
+
+struct StatCounts {
+  uint64_t n[STAT_COUNT];
 
-  DigitalNeuron(int _id)
-      : id(_id), voltage(0), refractory_timer(0), spiked_this_step(false),
-        input_buffer(0), leak_timer(MEMBRANE_DECAY_PERIOD) {
-    contrib_history.resize(MAX_HIST);
-    spike_history.resize(MAX_HIST, false);
+  StatCounts() { clear(); }
+  void clear() { std::fill(n, n + STAT_COUNT, 0); }
+  void add(StatCounter c, uint64_t k = 1) {
+    if (ENABLE_STATS)
+      n[c] += k;
+  }
+  void add(const StatCounts &o) {
+    for (int c = 0; c < STAT_COUNT; ++c)
+      add(static_cast<StatCounter>(c), o.n[c]);
   }
 };
 
-class SpikingNet {
+// Log-linear buckets: values below 8 exactly, then 8 per power of two, so a
+// percentile is reported within 1/8 of the true value
+class LatencyHistogram {
 public:
-  std::vector<DigitalNeuron> neurons;
-  std::vector<std::vector<DigitalSynapse>> connections;
-  int global_tick;
+  static const int SUB = 8;
+  static const int BUCKETS = 64 * SUB;
 
-  SpikingNet(int num_neurons) : global_tick(0) {
-    for (int i = 0; i < num_neurons; ++i) {
-      neurons.emplace_back(i);
-      connections.push_back({});
+  LatencyHistogram() { clear(); }
+  void clear() {
+    std::fill(counts, counts + BUCKETS, 0);
+    total = 0;
+    sum = 0;
+    largest = 0;
+  }
+  void add(uint64_t v) {
+    counts[bucket(v)]++;
+    total++;
+    sum += v;
+    largest = std::max(largest, v);
+  }
+  uint64_t count() const { return total; }
+  uint64_t max() const { return largest; }
+  double mean() const { return total ? static_cast<double>(sum) / total : 0; }
+  // Upper bound of the bucket holding the p-th fraction of the values
+  uint64_t percentile(double p) const {
+    if (total == 0)
+      return 0;
+    uint64_t rank = static_cast<uint64_t>(std::ceil(p * total));
+    uint64_t seen = 0;
+    for (int b = 0; b < BUCKETS; ++b) {
+      seen += counts[b];
+      if (seen >= std::max<uint64_t>(rank, 1))
+        return std::min(largest, upper_bound(b));
     }
+    return largest;
   }
 
-  void connect_randomly(double density, std::mt19937 &rng) {
-    std::uniform_real_distribution<double> dist(0.0, 1.0);
-    std::uniform_int_distribution<int> conf_dist(CONFIDENCE_INIT_LOW,
-                                                 CONFIDENCE_INIT_HIGH);
+private:
+  static int bucket(uint64_t v) {
+    if (v < SUB)
+      return static_cast<int>(v);
+    const int e = floor_log2(v); // >= 3
+    return (e - 2) * SUB + static_cast<int>(v >> (e - 3)) - SUB;
+  }
+  static uint64_t upper_bound(int b) {
+    if (b < 2 * SUB)
+      return b;
+    const int e = b / SUB + 2;
+    const uint64_t m = SUB + b % SUB;
+    return ((m + 1) << (e - 3)) - 1;
+  }
 
-    // 1. Deterministic Connections (Sensors and Motors)
-    // Sensor 0 -> 6 (Food-L)
-    connections[0].emplace_back(6, CONFIDENCE_MAX, false);
-    // Sensor 1 -> 7 (Food-R)
-    connections[1].emplace_back(7, CONFIDENCE_MAX, false);
-    // Sensor 2 -> 8 (Danger-L)
-    connections[2].emplace_back(8, CONFIDENCE_MAX, false);
-    // Sensor 3 -> 9 (Danger-R)
-    connections[3].emplace_back(9, CONFIDENCE_MAX, false);
-    // 10 -> Motor 4
-    connections[10].emplace_back(4, CONFIDENCE_MAX, false);
-    // 11 -> Motor 5
-    connections[11].emplace_back(5, CONFIDENCE_MAX, false);
-
-    // 2. Random Hidden-to-Hidden Connections (Neurons 6 to 35)
-    std::vector<int> hidden_indices;
-    for (int i = 6; i < (int)neurons.size(); ++i)
-      hidden_indices.push_back(i);
-
-    for (int i : hidden_indices) {
-      for (int j : hidden_indices) {
-        if (i == j)
-          continue;
+  uint64_t counts[BUCKETS];
+  uint64_t total;
+  uint64_t sum;
+  uint64_t largest;
+};
 
-        // Constraint 1: First layer (6-11) can't connect to each other
-        if (i >= 6 && i <= 11 && j >= 6 && j <= 11)
-          continue;
+struct TickStats {
+  uint64_t ticks;
+  bool timing; // This tick is sampled (see begin_tick)
+  uint64_t phase_ns[PHASE_COUNT]; // Over the sampled ticks
+  LatencyHistogram tick_ns;       // Sampled ticks
+  StatCounts counts;
+  uint64_t snapshot_ns; // capture_snapshot, on the simulation thread
+  uint64_t snapshots;
+  uint64_t since_ns; // When the stats were last cleared
 
-        // Constraint 2: Neurons 6, 7, 8, 9 can only HAVE outgoing connections
-        // (no incoming besides sensor)
-        if (j == 6 || j == 7 || j == 8 || j == 9)
-          continue;
+  TickStats() { clear(); }
+  void clear() {
+    ticks = 0;
+    timing = false;
+    std::fill(phase_ns, phase_ns + PHASE_COUNT, 0);
+    tick_ns.clear();
+    counts.clear();
+    snapshot_ns = 0;
+    snapshots = 0;
+    since_ns = stats_now_ns();
+  }
+  // Called by Simulation::tick before the step; true if it is timed
+  bool begin_tick() {
+    ++ticks;
+    timing = ENABLE_STATS && ticks % STATS_SAMPLE_PERIOD == 0;
+    return timing;
+  }
+};
 
-        // Constraint 3: Neurons 10 and 11 can only HAVE incoming connections
-        // (no outgoing besides motor)
-        if (i == 10 || i == 11)
-          continue;
+// Charges the time between laps to phases on sampled ticks: construct, run
+// a phase, lap() it, run the next one, and so on
+class PhaseClock {
+public:
+  explicit PhaseClock(TickStats &_stats)
+      : stats(_stats), on(ENABLE_STATS && _stats.timing),
+        last(on ? stats_now_ns() : 0) {}
+  void lap(StatPhase phase) {
+    if (!on)
+      return;
+    const uint64_t now = stats_now_ns();
+    stats.phase_ns[phase] += now - last;
+    last = now;
+  }
 
-        if (dist(rng) < density) {
-          int init_conf = conf_dist(rng);
-          connections[i].emplace_back(j, init_conf);
-        }
-      }
-    }
+private:
+  TickStats &stats;
+  bool on;
+  uint64_t last;
+};
 
-    // Ensure neurons 10 and 11 always have at least one input
-    for (int target : {10, 11}) {
-      bool has_input = false;
-      for (const auto &row : connections) {
-        for (const auto &syn : row) {
-          if (syn.target_neuron_idx == target) {
-            has_input = true;
-            break;
-          }
-        }
-        if (has_input)
-          break;
-      }
-      if (!has_input) {
-        // Add one from a hidden neuron (12-29) to avoid constraints
-        std::uniform_int_distribution<int> src_dist(12, 29);
-        connections[src_dist(rng)].emplace_back(target, CONFIDENCE_THR);
-      }
-    }
+// One JSON object covering the time since stats were last cleared: tick
+// latency percentiles and mean ns per phase over the sampled ticks, event
+// totals over all ticks, and mean ns per frame for snapshots (simulation
+// thread) and serialization (publisher). Takes the publisher's counters.
+std::string format_stats(const TickStats &st) {
+  std::ostringstream j;
+  if (!ENABLE_STATS) {
+    j << "{\"enabled\":false}";
+    return j.str();
   }
+  const uint64_t serialize_ns = g_serialize_ns.exchange(0);
+  const uint64_t serialized = g_serialized.exchange(0);
+  const LatencyHistogram &h = st.tick_ns;
+  const double sampled = static_cast<double>(std::max<uint64_t>(1, h.count()));
+  j << std::fixed << std::setprecision(1);
+  j << "{\"enabled\":true,\"seconds\":"
+    << (stats_now_ns() - st.since_ns) * 1e-9 << ",\"ticks\":" << st.ticks
+    << ",\"sampled\":" << h.count() << ",\"tick_ns\":{\"mean\":" << h.mean()
+    << ",\"p50\":" << h.percentile(0.5) << ",\"p90\":" << h.percentile(0.9)
+    << ",\"p99\":" << h.percentile(0.99) << ",\"max\":" << h.max() << "}";
+  j << ",\"phase_ns\":{";
+  for (int p = 0; p < PHASE_COUNT; ++p)
+    j << (p ? "," : "") << "\"" << STAT_PHASE_NAMES[p]
+      << "\":" << st.phase_ns[p] / sampled;
+  j << "},\"events\":{";
+  for (int c = 0; c < STAT_COUNT; ++c)
+    j << (c ? "," : "") << "\"" << STAT_COUNTER_NAMES[c]
+      << "\":" << st.counts.n[c];
+  j << "},\"snapshots\":" << st.snapshots << ",\"snapshot_ns\":"
+    << (st.snapshots ? static_cast<double>(st.snapshot_ns) / st.snapshots : 0)
+    << ",\"frames\":" << serialized << ",\"serialize_ns\":"
+    << (serialized ? static_cast<double>(serialize_ns) / serialized : 0)
+    << "}";
+  return j.str();
+}
 
-  // sensory_input: number of input spikes per neuron at this timestep
-  // reward_active: true if global reward signal is present
-  // penalty_active: true if global penalty signal is present
-  void step(const std::vector<int> &sensory_input, bool reward_active,
-            bool penalty_active, std::mt19937 &rng) {
-    ++global_tick;
-    // 0. Update highlights and tick
-    for (auto &row : connections) {
-      for (auto &syn : row)
-        syn.highlighted = false;
-    }
+// --- Random Streams ---
+// Every random draw belongs to a stream and a tick: wiring, the wandering
+// activity, pruning targets and the world. AgentRng comes in two kinds.
+// RNG_MT19937 is one std::mt19937 that all streams share in call order,
+// through the std distributions: the sequence of existing experiments.
+// RNG_PHILOX is counter based (Philox4x32-10, Salmon et al., SC'11): a
+// draw is a pure function of (seed, stream, tick, index), so it does not
+// depend on what else was drawn, on threads or on scheduling. Such an
+// AgentRng holds a key and a position instead of 2.5 KB of state, and the
+// bounded integer draws are exact, identical on every platform.
+enum RngKind { RNG_MT19937, RNG_PHILOX };
 
-    // 1. Update neurons
-    for (auto &n : neurons) {
-      bool potential_changed = false;
-      n.spiked_this_step = false;
-
-      if (n.refractory_timer > 0) {
-        n.refractory_timer--;
-        n.voltage = V_REST;
-        n.input_buffer = 0;
-        n.leak_timer = MEMBRANE_DECAY_PERIOD;
-      } else {
-        // Check for inputs
-        if (n.input_buffer > 0)
-          potential_changed = true;
-        if (n.id < static_cast<int>(sensory_input.size()) &&
-            sensory_input[n.id] > 0)
-          potential_changed = true;
-
-        n.voltage += n.input_buffer;
-        if (n.id < static_cast<int>(sensory_input.size())) {
-          if (sensory_input[n.id] > 0)
-            n.voltage += V_THRESH;
-        }
-        n.input_buffer = 0;
-
-        if (n.voltage >= V_THRESH) {
-          n.voltage = V_REST;
-          n.spiked_this_step = true;
-          n.refractory_timer = REFRACTORY_PERIOD;
-          potential_changed = true;
-        }
-
-        if (potential_changed) {
-          n.leak_timer = MEMBRANE_DECAY_PERIOD;
-        } else if (n.voltage > V_REST) {
-          n.leak_timer--;
-          if (n.leak_timer <= 0) {
-            n.voltage--;
-            n.leak_timer = MEMBRANE_DECAY_PERIOD;
-          }
-        } else {
-          n.leak_timer = MEMBRANE_DECAY_PERIOD;
-        }
-      }
-    }
+enum RngStream {
+  STREAM_WIRING,   // connect_randomly, at tick 0
+  STREAM_ACTIVITY, // Random wandering input, at Simulation::t
+  STREAM_PRUNING,  // Rewire targets, at the brain's global_tick
+  STREAM_WORLD,    // Target spawns, at Simulation::t
+};
 
-    // 2. Propagate and evaluate plastic synapses
-    DigitalSynapse *worst_syn = nullptr;
-    int max_inactive = -1;
-    int worst_pre_idx = -1;
+// Philox4x32-10 on a 128-bit counter and 64-bit key. Branch free; loops
+// over lanes vectorize (one 32x32->64 multiply pair per round).
+inline void philox4x32_10(const uint32_t ctr[4], const uint32_t key[2],
+                          uint32_t out[4]) {
+  uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+  uint32_t k0 = key[0], k1 = key[1];
+  for (int round = 0; round < 10; ++round) {
+    const uint64_t p0 = uint64_t(0xD2511F53u) * c0;
+    const uint64_t p1 = uint64_t(0xCD9E8D57u) * c2;
+    c0 = uint32_t(p1 >> 32) ^ c1 ^ k0;
+    c2 = uint32_t(p0 >> 32) ^ c3 ^ k1;
+    c1 = uint32_t(p1);
+    c3 = uint32_t(p0);
+    k0 += 0x9E3779B9u;
+    k1 += 0xBB67AE85u;
+  }
+  out[0] = c0;
+  out[1] = c1;
+  out[2] = c2;
+  out[3] = c3;
+}
 
-    for (int i = 0; i < static_cast<int>(neurons.size()); ++i) {
-      auto &synapses = connections[i];
-      for (auto &syn : synapses) {
-        if (neurons[i].spiked_this_step && syn.active) {
-          neurons[syn.target_neuron_idx].input_buffer += 1;
-          neurons[syn.target_neuron_idx].next_contributors.push_back(
-              {i, (int)(&syn - &synapses[0])});
-        }
+// Call at(stream, tick) before the draws of a stream: RNG_PHILOX then
+// draws block by block from counter (tick, index); asking again for the
+// same position continues it. RNG_MT19937 ignores positions. Also a
+// UniformRandomBitGenerator, for callers that bring std distributions.
+class AgentRng {
+public:
+  typedef uint32_t result_type;
 
-        if (syn.plastic) {
-          syn.ticks_since_ltp++;
+  explicit AgentRng(unsigned int _seed = std::mt19937::default_seed,
+                    RngKind _kind = RNG_MT19937)
+      : kind(_kind), seed_value(_seed),
+        mt(_kind == RNG_MT19937 ? new std::mt19937(_seed) : nullptr) {
+    rewind();
+  }
+  AgentRng(const AgentRng &o)
+      : kind(o.kind), seed_value(o.seed_value),
+        mt(o.mt ? new std::mt19937(*o.mt) : nullptr) {
+    rewind();
+  }
+  AgentRng &operator=(const AgentRng &o) {
+    if (this != &o) {
+      kind = o.kind;
+      seed_value = o.seed_value;
+      mt.reset(o.mt ? new std::mt19937(*o.mt) : nullptr);
+      rewind();
+    }
+    return *this;
+  }
 
-          // Reset inactivity counter on LTP attempt (Reward + Eligible)
-          if (reward_active && syn.reward_acceptor && syn.eligible_for_LTP) {
-            syn.ticks_since_ltp = 0;
-          }
+  RngKind rng_kind() const { return kind; }
+  // What it was seeded with; for Philox the key. An mt19937 state read by
+  // set_state_text() keeps the seed it had before.
+  unsigned int seed_used() const { return seed_value; }
 
-          if (syn.ticks_since_ltp > max_inactive) {
-            max_inactive = syn.ticks_since_ltp;
-            worst_syn = &syn;
-            worst_pre_idx = i;
-          }
+  // Same kind, new seed (the Philox key)
+  void seed(unsigned int _seed) {
+    seed_value = _seed;
+    if (mt)
+      mt->seed(_seed);
+    rewind();
+  }
 
-          // Decay timers
-          if (syn.ltp_timer > 0)
-            syn.ltp_timer--;
-          if (syn.ltd_timer > 0)
-            syn.ltd_timer--;
-
-          // Reinforcement Inertia counters
-          if (syn.reward_inertia_counter > 0) {
-            syn.reward_inertia_counter--;
-            if (syn.reward_inertia_counter == 0)
-              syn.reward_acceptor = true;
-          }
-          if (syn.penalty_inertia_counter > 0) {
-            syn.penalty_inertia_counter--;
-            if (syn.penalty_inertia_counter == 0)
-              syn.penalty_acceptor = true;
-          }
+  void at(RngStream _stream, long long _tick) {
+    if (kind == RNG_MT19937 || (_stream == stream && _tick == tick))
+      return;
+    stream = _stream;
+    tick = _tick;
+    block = 0;
+    word = 4;
+  }
 
-          if (syn.eligibility_ltp_timer > 0) {
-            syn.eligibility_ltp_timer--;
-            if (syn.eligibility_ltp_timer == 0)
-              syn.eligible_for_LTP = false;
-          }
-          if (syn.eligibility_ltd_timer > 0) {
-            syn.eligibility_ltd_timer--;
-            if (syn.eligibility_ltd_timer == 0)
-              syn.eligible_for_LTD = false;
-          }
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return UINT32_MAX; }
+  result_type operator()() { return mt ? (*mt)() : next(); }
 
-          // Trace creation
-          if (neurons[i].spiked_this_step) {
-            syn.ltp_timer = SPIKE_TRACE_WINDOW;
-            if (syn.ltd_timer > 0) {
-              syn.eligible_for_LTD = true;
-              syn.eligibility_ltd_timer = ELIGIBILITY_TRACE_WINDOW;
-            }
-          }
+  // Uniform in [lo, hi]
+  int uniform_int(int lo, int hi) {
+    if (mt)
+      return std::uniform_int_distribution<int>(lo, hi)(*mt);
+    // Lemire's multiply-shift with rejection: exact and division-free in
+    // the common case
+    const uint32_t range = uint32_t(hi) - uint32_t(lo) + 1;
+    if (range == 0)
+      return int(uint32_t(lo) + next());
+    uint64_t m = uint64_t(next()) * range;
+    if (uint32_t(m) < range) {
+      const uint32_t floor = (0u - range) % range;
+      while (uint32_t(m) < floor)
+        m = uint64_t(next()) * range;
+    }
+    return int(uint32_t(lo) + uint32_t(m >> 32));
+  }
 
-          if (neurons[syn.target_neuron_idx].spiked_this_step) {
-            syn.ltd_timer = SPIKE_TRACE_WINDOW;
-            if (syn.ltp_timer > 0) {
-              syn.eligible_for_LTP = true;
-              syn.eligibility_ltp_timer = ELIGIBILITY_TRACE_WINDOW;
-            }
-          }
+  // Uniform in [0, 1)
+  double uniform01() {
+    if (mt)
+      return std::uniform_real_distribution<double>(0.0, 1.0)(*mt);
+    const uint32_t a = next() >> 5, b = next() >> 6; // 53 bits
+    return (a * 67108864.0 + b) * (1.0 / 9007199254740992.0);
+  }
 
-          // Learning
-          if (reward_active && syn.reward_acceptor) {
-            bool modified = false;
-            if (syn.eligible_for_LTP && syn.confidence < CONFIDENCE_MAX) {
-              syn.confidence++;
-              syn.active = (syn.confidence >= CONFIDENCE_THR);
-              syn.eligible_for_LTP = false;
-              syn.eligibility_ltp_timer = 0;
-              syn.confidence_leak_timer = CONFIDENCE_LEAK_PERIOD;
-              modified = true;
-            }
-            if (!modified && syn.eligible_for_LTD && syn.confidence > 0) {
-              syn.confidence--;
-              syn.active = (syn.confidence >= CONFIDENCE_THR);
-              syn.eligible_for_LTD = false;
-              syn.eligibility_ltd_timer = 0;
-              syn.confidence_leak_timer = CONFIDENCE_LEAK_PERIOD;
-              modified = true;
-            }
-            if (modified) {
-              // Block penalty for a while
-              syn.penalty_acceptor = false;
-              syn.penalty_inertia_counter = REINFORCEMENT_INERTIA_PERIOD;
-            }
-          } else if (penalty_active && syn.penalty_acceptor) {
-            bool modified = false;
-            if (syn.eligible_for_LTP && syn.confidence > 0) {
-              syn.confidence--;
-              syn.active = (syn.confidence >= CONFIDENCE_THR);
-              syn.eligible_for_LTP = false;
-              syn.eligibility_ltp_timer = 0;
-              syn.confidence_leak_timer = CONFIDENCE_LEAK_PERIOD;
-              modified = true;
-            }
-            if (modified) {
-              // Block reward for a while
-              syn.reward_acceptor = false;
-              syn.reward_inertia_counter = REINFORCEMENT_INERTIA_PERIOD;
-            }
-            // LTD + PENALTY is ignored per user request
-            if (syn.eligible_for_LTD) {
-              syn.eligible_for_LTD = false;
-              syn.eligibility_ltd_timer = 0;
-            }
-          }
+  // Failures before the first success, success probability p in (0, 1]
+  long long geometric(double p) {
+    if (mt)
+      return std::geometric_distribution<long long>(p)(*mt);
+    if (p >= 1.0)
+      return 0;
+    const double k = std::floor(std::log(1.0 - uniform01()) / std::log1p(-p));
+    return k < 9e18 ? static_cast<long long>(k) : LLONG_MAX;
+  }
 
-          // Leak
-          if (syn.confidence_leak_timer > 0)
-            syn.confidence_leak_timer--;
-          if (syn.confidence_leak_timer == 0) {
-            syn.confidence >>= 1;
-            syn.active = (syn.confidence >= CONFIDENCE_THR);
-            syn.confidence_leak_timer = CONFIDENCE_LEAK_PERIOD;
-          }
-        }
-      }
+  // Checkpoint form: the mt19937 text state, or "philox <seed>" (between
+  // ticks a Philox stream has no position worth keeping)
+  std::string state_text() const {
+    std::ostringstream os;
+    if (mt)
+      os << *mt;
+    else
+      os << "philox " << seed_value;
+    return os.str();
+  }
+  bool set_state_text(const std::string &text) {
+    std::istringstream is(text);
+    if (text.compare(0, 7, "philox ") == 0) {
+      std::string word_text;
+      unsigned int key = 0;
+      if (!(is >> word_text >> key))
+        return false;
+      *this = AgentRng(key, RNG_PHILOX);
+      return true;
     }
+    std::unique_ptr<std::mt19937> state(new std::mt19937());
+    if (!(is >> *state))
+      return false;
+    kind = RNG_MT19937;
+    mt = std::move(state);
+    rewind();
+    return true;
+  }
 
-    // 2.5 Pruning: Rewire the most inactive synapse periodically
-    if (worst_syn && (global_tick % PRUNING_PERIOD == 0)) {
-      std::vector<int> possible_targets;
-      // Potential targets: ONLY Hidden (6-35). Motors (4,5) are fixed.
-      for (int j = 6; j < static_cast<int>(neurons.size()); ++j) {
-        if (j == worst_pre_idx)
-          continue;
-        // Constraint 1: First layer (6-11) can't connect to each other
-        if (worst_pre_idx >= 6 && worst_pre_idx <= 11 && j >= 6 && j <= 11)
-          continue;
+private:
+  void rewind() {
+    stream = -1;
+    tick = -1;
+    block = 0;
+    word = 4;
+  }
 
-        // Constraint 2: Neurons 6, 7, 8, 9 can only HAVE outgoing connections
-        if (j == 6 || j == 7 || j == 8 || j == 9)
-          continue;
+  uint32_t next() {
+    if (word == 4) {
+      const uint32_t ctr[4] = {uint32_t(uint64_t(tick)),
+                               uint32_t(uint64_t(tick) >> 32), block++, 0};
+      const uint32_t key[2] = {seed_value, uint32_t(stream)};
+      philox4x32_10(ctr, key, buffer);
+      word = 0;
+    }
+    return buffer[word++];
+  }
 
-        // Ensure no duplicate
-        bool exists = false;
-        for (const auto &s : connections[worst_pre_idx]) {
-          if (s.target_neuron_idx == j) {
-            exists = true;
-            break;
-          }
-        }
-        if (!exists)
-          possible_targets.push_back(j);
-      }
+  RngKind kind;
+  uint32_t seed_value;
+  std::unique_ptr<std::mt19937> mt; // RNG_MT19937 only
+  int stream;
+  long long tick;
+  uint32_t block; // Philox blocks drawn at this position
+  int word;       // Next word of buffer, 4: empty
+  uint32_t buffer[4];
+};
 
-      if (!possible_targets.empty()) {
-        std::uniform_int_distribution<int> t_dist(0,
-                                                  possible_targets.size() - 1);
-        int new_target = possible_targets[t_dist(rng)];
+// --- Data structures ---
 
-        // Constraint: If current target is 10 or 11, check if this is the only
-        // connection
-        if (worst_syn->target_neuron_idx == 10 ||
-            worst_syn->target_neuron_idx == 11) {
-          int count = 0;
-          for (const auto &row : connections) {
-            for (const auto &s : row) {
-              if (s.target_neuron_idx == worst_syn->target_neuron_idx)
-                count++;
-            }
-          }
-          if (count <= 1) {
-            // Can't move it away. Effectively just reset it on current target.
-            new_target = worst_syn->target_neuron_idx;
-          }
-        }
+// Per-synapse plasticity state, packed to 16 bytes so multi-million synapse
+// brains stay cache resident: flags and confidence share one 16-bit word and
+// each timer uses the narrowest type its window fits in (checked below).
+// Target and the "active" bit live in SynapseStore's hot arrays.
+struct DigitalSynapse {
+  uint16_t confidence : 4;
+  uint16_t eligible_for_LTP : 1;
+  uint16_t eligible_for_LTD : 1;
+  uint16_t highlighted : 1;
+  uint16_t reward_acceptor : 1;
+  uint16_t penalty_acceptor : 1;
+  uint16_t plastic : 1;
 
-        // Prune and Rewire
-        worst_syn->target_neuron_idx = new_target;
-        worst_syn->confidence = 1; // Start fresh
-        worst_syn->active = (worst_syn->confidence >= CONFIDENCE_THR);
-        worst_syn->ticks_since_ltp = 0; // Reset timer
+  uint8_t ltp_timer;
+  uint8_t ltd_timer;
+  uint8_t eligibility_ltp_timer;
+  uint8_t eligibility_ltd_timer;
+  uint8_t reward_inertia_counter;
+  uint8_t penalty_inertia_counter;
+  uint16_t confidence_leak_timer;
 
-        // Reset plastic state
-        worst_syn->ltp_timer = 0;
-        worst_syn->ltd_timer = 0;
-        worst_syn->eligible_for_LTP = false;
-        worst_syn->eligible_for_LTD = false;
-        worst_syn->eligibility_ltp_timer = 0;
-        worst_syn->eligibility_ltd_timer = 0;
-        worst_syn->reward_acceptor = true;
-        worst_syn->penalty_acceptor = true;
-      }
-    }
+  // Not a window: grows until the next LTP attempt or rewire, and pruning
+  // needs its exact value.
+  int32_t ticks_since_ltp;
 
-    // 3. Causal Tracing from Motor Neurons
-    for (int m = 4; m <= 5; ++m) {
-      trace_causal_chain(m);
-    }
+  // leak_period: the rule set's confidence_leak_period
+  DigitalSynapse(int init_conf = 1, bool _plastic = true, int leak_period = 0)
+      : confidence(init_conf), eligible_for_LTP(false),
+        eligible_for_LTD(false), highlighted(false), reward_acceptor(true),
+        penalty_acceptor(true), plastic(_plastic), ltp_timer(0), ltd_timer(0),
+        eligibility_ltp_timer(0), eligibility_ltd_timer(0),
+        reward_inertia_counter(0), penalty_inertia_counter(0),
+        confidence_leak_timer(leak_period), ticks_since_ltp(0) {}
+};
 
-    // 4. Finally Shift history for next step
-    for (auto &n : neurons) {
-      for (int h = DigitalNeuron::MAX_HIST - 1; h > 0; --h) {
-        n.contrib_history[h] = std::move(n.contrib_history[h - 1]);
-        n.spike_history[h] = n.spike_history[h - 1];
-      }
-      n.contrib_history[0] = std::move(n.next_contributors);
-      n.spike_history[0] = n.spiked_this_step;
-      n.next_contributors.clear();
-    }
-  }
+// The timer widths are checked against each rule set by params_valid()
+static_assert(sizeof(DigitalSynapse) == 16, "DigitalSynapse must stay packed");
+static_assert(CONFIDENCE_MAX < 16, "confidence is a 4-bit field");
 
-  void trace_causal_chain(int motor_idx) {
-    if (!neurons[motor_idx].spiked_this_step)
-      return;
+// Event engine timers as absolute ticks. A window is open while
+// global_tick < *_until; an acceptor is blocked while
+// global_tick < *_block_until. Only allocated while the net runs
+// Engine::EVENT.
+struct SynapseDeadlines {
+  int ltp_until;
+  int ltd_until;
+  int eligibility_ltp_until;
+  int eligibility_ltd_until;
+  int reward_block_until;
+  int penalty_block_until;
+  int leak_due;
+  int last_ltp_tick;
+  int touch_tick;
+  int wheel_next; // Next synapse in its leak wheel slot, see schedule_leak
+  bool in_eligible_list;
+};
 
-    // We trace back to show what CAUSED the current motor spike.
-    // Limit depth to 12 for cleaner visualization (enough for direct paths).
-    const int MAX_TRACE = 12;
-    std::vector<std::vector<bool>> visited(
-        MAX_TRACE + 1, std::vector<bool>(neurons.size(), false));
+const int WHEEL_UNQUEUED = -2; // SynapseDeadlines::wheel_next, not queued
 
-    struct Pending {
-      int idx;
-      int depth;
-    };
-    std::vector<Pending> stack;
+// Compressed-sparse-row synapse storage. Row i (the outgoing synapses of
+// neuron i) owns ids [row_offsets[i], row_offsets[i + 1]); ids keep the
+// order in which connect_randomly() created them. The incoming (CSC)
+// index lists, per neuron, the ids that end on it. Rows never change
+// length after build(); pruning only retargets, which moves one id between
+// incoming columns in place.
+struct SynapseStore {
+  struct Edge {
+    int source;
+    int target;
+    int confidence;
+    bool plastic;
+  };
 
-    stack.push_back({motor_idx, 0});
-    visited[0][motor_idx] = true;
+  std::vector<int> row_offsets;
+  std::vector<int> targets;
+  std::vector<int> sources;
+  std::vector<unsigned char> active;
+  std::vector<DigitalSynapse> state;
+  std::vector<SynapseDeadlines> deadlines; // Event engine only
 
-    while (!stack.empty()) {
-      Pending p = stack.back();
-      stack.pop_back();
+  std::vector<int> in_offsets;
+  std::vector<int> in_syn;
 
-      if (p.depth >= MAX_TRACE)
-        continue;
+  int size() const { return static_cast<int>(targets.size()); }
+  int row_begin(int i) const { return row_offsets[i]; }
+  int row_end(int i) const { return row_offsets[i + 1]; }
+  int in_begin(int j) const { return in_offsets[j]; }
+  int in_end(int j) const { return in_offsets[j + 1]; }
+  int in_degree(int j) const { return in_offsets[j + 1] - in_offsets[j]; }
 
-      // Spike at depth 'p.depth' was caused by signals in
-      // contrib_history[p.depth] (these signals were sent at time T - p.depth -
-      // 1).
-      for (const auto &c : neurons[p.idx].contrib_history[p.depth]) {
-        if (c.from_row >= 0 && c.from_row < (int)connections.size()) {
-          connections[c.from_row][c.syn_idx].highlighted = true;
+  // Counting sort by source keeps the creation order inside each row.
+  // leak_period starts every confidence leak countdown.
+  void build(int num_neurons, const std::vector<Edge> &edges,
+             int leak_period) {
+    const int e = static_cast<int>(edges.size());
+    row_offsets.assign(num_neurons + 1, 0);
+    for (const auto &ed : edges)
+      row_offsets[ed.source + 1]++;
+    for (int i = 0; i < num_neurons; ++i)
+      row_offsets[i + 1] += row_offsets[i];
 
-          int next_depth = p.depth + 1;
-          // The sender must have spiked at T - next_depth.
-          // Before the end-of-step shift, spike_history[p.depth] contains T -
-          // (p.depth + 1).
-          if (next_depth <= MAX_TRACE) {
-            if (neurons[c.from_row].spike_history[p.depth] &&
-                !visited[next_depth][c.from_row]) {
-              visited[next_depth][c.from_row] = true;
-              stack.push_back({c.from_row, next_depth});
-            }
-          }
-        }
-      }
+    targets.assign(e, 0);
+    sources.assign(e, 0);
+    active.assign(e, 0);
+    state.assign(e, DigitalSynapse());
+    std::vector<int> fill(row_offsets.begin(), row_offsets.end() - 1);
+    for (const auto &ed : edges) {
+      int s = fill[ed.source]++;
+      targets[s] = ed.target;
+      sources[s] = ed.source;
+      state[s] = DigitalSynapse(ed.confidence, ed.plastic, leak_period);
+      active[s] = ed.confidence >= CONFIDENCE_THR;
+    }
+
+    in_offsets.assign(num_neurons + 1, 0);
+    for (int s = 0; s < e; ++s)
+      in_offsets[targets[s] + 1]++;
+    for (int j = 0; j < num_neurons; ++j)
+      in_offsets[j + 1] += in_offsets[j];
+    in_syn.assign(e, 0);
+    std::copy(in_offsets.begin(), in_offsets.end() - 1, fill.begin());
+    for (int s = 0; s < e; ++s)
+      in_syn[fill[targets[s]]++] = s;
+  }
+
+  // Move synapse s to new_target. Only the incoming entries between the
+  // old and new column shift by one slot.
+  void retarget(int s, int new_target) {
+    const int old_target = targets[s];
+    if (old_target == new_target)
+      return;
+    int p = in_begin(old_target);
+    while (in_syn[p] != s)
+      ++p;
+    if (old_target < new_target) {
+      int q = in_end(new_target) - 1;
+      std::move(in_syn.begin() + p + 1, in_syn.begin() + q + 1,
+                in_syn.begin() + p);
+      in_syn[q] = s;
+      for (int c = old_target + 1; c <= new_target; ++c)
+        in_offsets[c]--;
+    } else {
+      int q = in_begin(new_target);
+      std::move_backward(in_syn.begin() + q, in_syn.begin() + p,
+                         in_syn.begin() + p + 1);
+      in_syn[q] = s;
+      for (int c = new_target + 1; c <= old_target; ++c)
+        in_offsets[c]++;
     }
+    targets[s] = new_target;
   }
 };
 
-// --- World Simulation ---
-enum TargetType { NONE, FOOD, DANGER };
+// Neuron state as parallel arrays indexed by neuron id, so the neuron phase
+// runs as a vector kernel (see update_neuron_words). Between ticks voltages
+// stay in [V_REST, v_thresh) and timers below their periods, which
+// params_valid bounds to 16 bits; input sums any number of synapses. The
+// arrays are padded to whole 64-neuron words of idle neurons.
+struct NeuronStore {
+  std::vector<int16_t> voltage;
+  std::vector<uint8_t> refractory; // Ticks left
+  std::vector<uint16_t> leak;      // Ticks to the next leak step
+  std::vector<int32_t> input;      // Spikes delivered for the next tick
+  std::vector<uint64_t> fired;     // Bit i % 64 of word i / 64: spiked
 
-struct WorldUpdateResult {
-  bool reward;
-  bool penalty;
+  // decay_period: the rule set's membrane_decay_period
+  explicit NeuronStore(int n = 0, int decay_period = 0)
+      : voltage(padded(n), V_REST), refractory(padded(n), 0),
+        leak(padded(n), static_cast<uint16_t>(decay_period)),
+        input(padded(n), 0), fired(padded(n) / 64, 0), count(n) {}
+
+  int size() const { return count; }
+
+  bool spiked(size_t i) const { return (fired[i >> 6] >> (i & 63)) & 1; }
+  void set_spiked(size_t i, bool on) {
+    const uint64_t bit = uint64_t(1) << (i & 63);
+    fired[i >> 6] = on ? fired[i >> 6] | bit : fired[i >> 6] & ~bit;
+  }
+
+private:
+  static size_t padded(int n) {
+    return (static_cast<size_t>(n) + 63) / 64 * 64;
+  }
+
+  int count;
 };
 
-struct World {
-  int size;
-  int agent_pos;
-  int target_pos;
-  TargetType target_type;
-  int target_timer;
-  int food_eaten;
-  int danger_hit;
-  std::mt19937 rng;
+// One tick of neuron i: integrate last tick's input (plus v_thresh if its
+// sensor is driven), fire, refract and leak. Returns true if it fired. The
+// reference for the vector kernels below.
+inline bool dense_neuron_rule(NeuronStore &n, size_t i, bool sensed,
+                              int v_thresh, int decay_period) {
+  bool potential_changed = false;
+  n.set_spiked(i, false);
 
-  World()
-      : size(WORLD_SIZE), agent_pos(WORLD_SIZE / 2), target_type(NONE),
-        target_timer(0), food_eaten(0), danger_hit(0), rng(42) {}
+  if (n.refractory[i] > 0) {
+    n.refractory[i]--;
+    n.voltage[i] = V_REST;
+    n.input[i] = 0;
+    n.leak[i] = static_cast<uint16_t>(decay_period);
+    return false;
+  }
 
-  void spawn_target() {
-    std::uniform_int_distribution<int> type_dist(0, 2);
-    std::uniform_int_distribution<int> time_dist(3000, 5000);
+  // Check for inputs
+  if (n.input[i] > 0 || sensed)
+    potential_changed = true;
 
-    int choice = type_dist(rng);
-    target_timer = time_dist(rng);
+  int voltage = n.voltage[i] + n.input[i];
+  if (sensed)
+    voltage += v_thresh;
+  n.input[i] = 0;
 
-    // Reset agent to center on target change
-    agent_pos = size / 2;
+  bool fired = false;
+  if (voltage >= v_thresh) {
+    voltage = V_REST;
+    fired = true;
+    n.refractory[i] = REFRACTORY_PERIOD;
+    potential_changed = true;
+  }
 
-    if (choice == 2) {
-      target_type = NONE;
-      target_timer /= 3; // NONE phase is 3x shorter
+  if (potential_changed) {
+    n.leak[i] = static_cast<uint16_t>(decay_period);
+  } else if (voltage > V_REST) {
+    if (n.leak[i] <= 1) {
+      voltage--;
+      n.leak[i] = static_cast<uint16_t>(decay_period);
     } else {
-      target_type = (choice == 0) ? FOOD : DANGER;
-      // Randomly spawn at extreme left (0) or extreme right (size-1)
-      std::uniform_int_distribution<int> edge_dist(0, 1);
-      target_pos = (edge_dist(rng) == 0) ? 0 : size - 1;
+      n.leak[i]--;
     }
+  } else {
+    n.leak[i] = static_cast<uint16_t>(decay_period);
   }
+  n.voltage[i] = static_cast<int16_t>(voltage);
+  n.set_spiked(i, fired);
+  return fired;
+}
 
-  std::vector<int> get_sensors() {
-    std::vector<int> sensors(4, 0);
+// --- Neuron Kernels ---
+// The neuron phase one 64-neuron word at a time: dense_neuron_rule without
+// branches, the conditions as lane masks and the fired word straight from
+// them. drive[k] > 0 drives the sensor of neuron base + k. A kernel writes
+// the store's fired word and the word of neurons whose voltage or spike
+// changed (for change tracking). The AVX2 kernel is chosen at runtime when
+// the CPU has it. The NEON kernel only runs when asked for (--neuron-kernel
+// neon) until it has passed neuron_kernel_agrees() on AArch64 hardware.
+enum NeuronKernel { KERNEL_SCALAR, KERNEL_AVX2, KERNEL_NEON, KERNEL_COUNT };
+const char *const NEURON_KERNEL_NAMES[KERNEL_COUNT] = {"scalar", "avx2",
+                                                       "neon"};
+
+typedef void (*NeuronWordFn)(NeuronStore &n, int base, const int *drive,
+                             int v_thresh, int decay_period,
+                             uint64_t &changed);
+
+inline void neuron_word_scalar(NeuronStore &n, int base, const int *drive,
+                               int v_thresh, int decay_period,
+                               uint64_t &changed) {
+  const uint64_t old_fired = n.fired[base >> 6];
+  uint64_t moved = 0;
+  for (int k = 0; k < 64; ++k) {
+    const int16_t old_voltage = n.voltage[base + k];
+    dense_neuron_rule(n, base + k, drive[k] > 0, v_thresh, decay_period);
+    moved |= uint64_t(n.voltage[base + k] != old_voltage) << k;
+  }
+  changed = moved | (old_fired ^ n.fired[base >> 6]);
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2 // MSVC takes AVX2 intrinsics without /arch
+#endif
+
+inline bool cpu_has_avx2() {
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7)
+    return false;
+  __cpuid(info, 1);
+  // AVX enabled by the OS: OSXSAVE, AVX, and YMM state in XCR0
+  if (!((info[2] >> 27) & 1) || !((info[2] >> 28) & 1) ||
+      (_xgetbv(0) & 6) != 6)
+    return false;
+  __cpuidex(info, 7, 0);
+  return (info[1] >> 5) & 1;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+
+// 32-bit lanes to 16 bits, in order (the packs work per 128-bit half)
+TARGET_AVX2 inline __m128i avx2_narrow16(__m256i x) {
+  return _mm256_castsi256_si128(
+      _mm256_permute4x64_epi64(_mm256_packs_epi32(x, x), 0x08));
+}
+TARGET_AVX2 inline __m128i avx2_narrow16u(__m256i x) {
+  return _mm256_castsi256_si128(
+      _mm256_permute4x64_epi64(_mm256_packus_epi32(x, x), 0x08));
+}
+
+TARGET_AVX2 inline int avx2_bits(__m256i mask) {
+  return _mm256_movemask_ps(_mm256_castsi256_ps(mask));
+}
+
+TARGET_AVX2 void neuron_word_avx2(NeuronStore &n, int base, const int *drive,
+                                  int v_thresh, int decay_period,
+                                  uint64_t &changed) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i rest = _mm256_set1_epi32(V_REST);
+  const __m256i thresh = _mm256_set1_epi32(v_thresh);
+  const __m256i below = _mm256_set1_epi32(v_thresh - 1);
+  const __m256i period = _mm256_set1_epi32(decay_period);
+  const __m256i refractory = _mm256_set1_epi32(REFRACTORY_PERIOD);
+  const uint64_t old_fired = n.fired[base >> 6];
+  uint64_t fired = 0, moved = 0;
+  for (int k = 0; k < 64; k += 8) {
+    const size_t i = base + k;
+    __m128i *vp = reinterpret_cast<__m128i *>(&n.voltage[i]);
+    __m128i *rp = reinterpret_cast<__m128i *>(&n.refractory[i]);
+    __m128i *lp = reinterpret_cast<__m128i *>(&n.leak[i]);
+    __m256i *ip = reinterpret_cast<__m256i *>(&n.input[i]);
+    const __m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128(vp));
+    const __m256i r = _mm256_cvtepu8_epi32(_mm_loadl_epi64(rp));
+    const __m256i leak = _mm256_cvtepu16_epi32(_mm_loadu_si128(lp));
+    const __m256i in = _mm256_loadu_si256(ip);
+    const __m256i sensed = _mm256_cmpgt_epi32(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(drive + k)),
+        zero);
+
+    const __m256i resting = _mm256_cmpgt_epi32(r, zero);
+    const __m256i vin = _mm256_add_epi32(_mm256_add_epi32(v, in),
+                                         _mm256_and_si256(sensed, thresh));
+    const __m256i fire =
+        _mm256_andnot_si256(resting, _mm256_cmpgt_epi32(vin, below));
+    const __m256i stirred = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpgt_epi32(in, zero), sensed), fire);
+    const __m256i leaking = _mm256_andnot_si256(
+        _mm256_or_si256(resting, stirred), _mm256_cmpgt_epi32(vin, rest));
+    const __m256i leak_next = _mm256_sub_epi32(leak, one);
+    const __m256i expired =
+        _mm256_and_si256(leaking, _mm256_cmpgt_epi32(one, leak_next));
+
+    // An expired leak takes one off (the mask is -1); rest after a spike
+    // or while refractory
+    const __m256i v_new = _mm256_blendv_epi8(_mm256_add_epi32(vin, expired),
+                                             rest,
+                                             _mm256_or_si256(resting, fire));
+    const __m256i leak_new = _mm256_blendv_epi8(
+        period, leak_next, _mm256_andnot_si256(expired, leaking));
+    const __m256i r_new = _mm256_blendv_epi8(
+        _mm256_and_si256(fire, refractory), _mm256_sub_epi32(r, one), resting);
+
+    _mm_storeu_si128(vp, avx2_narrow16(v_new));
+    const __m128i r16 = avx2_narrow16u(r_new);
+    _mm_storel_epi64(rp, _mm_packus_epi16(r16, r16));
+    _mm_storeu_si128(lp, avx2_narrow16u(leak_new));
+    _mm256_storeu_si256(ip, zero);
+    fired |= uint64_t(avx2_bits(fire)) << k;
+    moved |= uint64_t(~avx2_bits(_mm256_cmpeq_epi32(v_new, v)) & 0xFF) << k;
+  }
+  n.fired[base >> 6] = fired;
+  changed = moved | (old_fired ^ fired);
+}
+#endif
+
+#if defined(__aarch64__) || defined(_M_ARM64)
+inline uint32_t neon_bits(uint32x4_t mask) {
+  static const uint32_t weights[4] = {1, 2, 4, 8};
+  return vaddvq_u32(vandq_u32(mask, vld1q_u32(weights)));
+}
+
+// Four neurons of neuron_word_neon; returns the fired and moved bits in
+// the low and high nibble
+inline uint32_t neon_neuron_quad(int32x4_t &v, int32x4_t &r, int32x4_t &leak,
+                                 int32x4_t in, int32x4_t drive,
+                                 int v_thresh, int decay_period) {
+  const int32x4_t zero = vdupq_n_s32(0), one = vdupq_n_s32(1);
+  const int32x4_t rest = vdupq_n_s32(V_REST);
+  const int32x4_t thresh = vdupq_n_s32(v_thresh);
+  const int32x4_t period = vdupq_n_s32(decay_period);
+  const uint32x4_t sensed = vcgtq_s32(drive, zero);
+
+  const uint32x4_t resting = vcgtq_s32(r, zero);
+  const int32x4_t vin = vaddq_s32(
+      vaddq_s32(v, in), vandq_s32(vreinterpretq_s32_u32(sensed), thresh));
+  const uint32x4_t fire = vbicq_u32(vcgeq_s32(vin, thresh), resting);
+  const uint32x4_t stirred =
+      vorrq_u32(vorrq_u32(vcgtq_s32(in, zero), sensed), fire);
+  const uint32x4_t leaking =
+      vbicq_u32(vcgtq_s32(vin, rest), vorrq_u32(resting, stirred));
+  const int32x4_t leak_next = vsubq_s32(leak, one);
+  const uint32x4_t expired = vandq_u32(leaking, vcleq_s32(leak_next, zero));
+
+  const int32x4_t v_new =
+      vbslq_s32(vorrq_u32(resting, fire), rest,
+                vaddq_s32(vin, vreinterpretq_s32_u32(expired)));
+  const uint32x4_t moved = vmvnq_u32(vceqq_s32(v_new, v));
+  v = v_new;
+  leak = vbslq_s32(vbicq_u32(leaking, expired), leak_next, period);
+  r = vbslq_s32(resting, vsubq_s32(r, one),
+                vandq_s32(vreinterpretq_s32_u32(fire),
+                          vdupq_n_s32(REFRACTORY_PERIOD)));
+  return neon_bits(fire) | neon_bits(moved) << 4;
+}
+
+inline void neuron_word_neon(NeuronStore &n, int base, const int *drive,
+                             int v_thresh, int decay_period,
+                             uint64_t &changed) {
+  const uint64_t old_fired = n.fired[base >> 6];
+  uint64_t fired = 0, moved = 0;
+  for (int k = 0; k < 64; k += 8) {
+    const size_t i = base + k;
+    const int16x8_t v16 = vld1q_s16(&n.voltage[i]);
+    const uint16x8_t r16 = vmovl_u8(vld1_u8(&n.refractory[i]));
+    const uint16x8_t l16 = vld1q_u16(&n.leak[i]);
+    int32x4_t v[2] = {vmovl_s16(vget_low_s16(v16)), vmovl_high_s16(v16)};
+    int32x4_t r[2] = {vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(r16))),
+                      vreinterpretq_s32_u32(vmovl_high_u16(r16))};
+    int32x4_t leak[2] = {
+        vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(l16))),
+        vreinterpretq_s32_u32(vmovl_high_u16(l16))};
+    uint64_t bits[2];
+    for (int h = 0; h < 2; ++h)
+      bits[h] = neon_neuron_quad(v[h], r[h], leak[h],
+                                 vld1q_s32(&n.input[i + 4 * h]),
+                                 vld1q_s32(drive + k + 4 * h), v_thresh,
+                                 decay_period);
+    vst1q_s16(&n.voltage[i], vcombine_s16(vmovn_s32(v[0]), vmovn_s32(v[1])));
+    const uint16x8_t r_new =
+        vcombine_u16(vmovn_u32(vreinterpretq_u32_s32(r[0])),
+                     vmovn_u32(vreinterpretq_u32_s32(r[1])));
+    vst1_u8(&n.refractory[i], vmovn_u16(r_new));
+    vst1q_u16(&n.leak[i],
+              vcombine_u16(vmovn_u32(vreinterpretq_u32_s32(leak[0])),
+                           vmovn_u32(vreinterpretq_u32_s32(leak[1]))));
+    vst1q_s32(&n.input[i], vdupq_n_s32(0));
+    vst1q_s32(&n.input[i + 4], vdupq_n_s32(0));
+    fired |= ((bits[0] & 15) | (bits[1] & 15) << 4) << k;
+    moved |= ((bits[0] >> 4) | (bits[1] >> 4) << 4) << k;
+  }
+  n.fired[base >> 6] = fired;
+  changed = moved | (old_fired ^ fired);
+}
+#endif
+
+inline bool neuron_kernel_supported(NeuronKernel k) {
+  switch (k) {
+  case KERNEL_SCALAR:
+    return true;
+#if defined(__x86_64__) || defined(_M_X64)
+  case KERNEL_AVX2:
+    return cpu_has_avx2();
+#endif
+#if defined(__aarch64__) || defined(_M_ARM64)
+  case KERNEL_NEON:
+    return true;
+#endif
+  default:
+    return false;
+  }
+}
+
+inline NeuronKernel best_neuron_kernel() {
+  if (neuron_kernel_supported(KERNEL_AVX2))
+    return KERNEL_AVX2;
+  return KERNEL_SCALAR;
+}
+
+inline NeuronWordFn neuron_word_fn(NeuronKernel k) {
+#if defined(__x86_64__) || defined(_M_X64)
+  if (k == KERNEL_AVX2)
+    return neuron_word_avx2;
+#endif
+#if defined(__aarch64__) || defined(_M_ARM64)
+  if (k == KERNEL_NEON)
+    return neuron_word_neon;
+#endif
+  return neuron_word_scalar;
+}
+
+// Chosen at startup (--neuron-kernel), before any net steps
+NeuronKernel g_neuron_kernel = best_neuron_kernel();
+NeuronWordFn g_neuron_word = neuron_word_fn(g_neuron_kernel);
+
+inline void set_neuron_kernel(NeuronKernel k) {
+  g_neuron_kernel = k;
+  g_neuron_word = neuron_word_fn(k);
+}
+
+// Runs random words, edge states included, through kernel k and the scalar
+// kernel and compares every field and changed word. For --conformance and
+// the bench; a kernel that fails must not be used.
+inline bool neuron_kernel_agrees(NeuronKernel k, int rounds = 20000) {
+  const NeuronWordFn word = neuron_word_fn(k);
+  std::mt19937 gen(5);
+  for (int round = 0; round < rounds; ++round) {
+    // Thresholds and leak periods from 1 up to their limits
+    const int v_thresh = 1 + gen() % (round % 3 == 0 ? 32766 : 12);
+    const int decay_period = 1 + gen() % (round % 5 == 0 ? 65534 : 10);
+    NeuronStore a(128, decay_period);
+    for (int i = 0; i < a.size(); ++i) {
+      const int mode = gen() % 4;
+      a.voltage[i] = static_cast<int16_t>(
+          mode == 0 ? gen() : gen() % (v_thresh + 2));
+      a.refractory[i] = static_cast<uint8_t>(gen() % 3 == 0 ? gen() : 0);
+      a.leak[i] = static_cast<uint16_t>(
+          mode == 1 ? gen() : gen() % (decay_period + 2));
+      a.input[i] = gen() % 3 == 0 ? gen() % 5 : mode == 2 ? gen() % 100000 : 0;
+      a.set_spiked(i, gen() & 1);
+    }
+    NeuronStore b = a;
+    int drive[128];
+    for (int &d : drive)
+      d = gen() % 4 == 0 ? static_cast<int>(gen() % 3) - 1 : 0;
+    for (int base = 0; base < a.size(); base += 64) {
+      uint64_t want, got;
+      neuron_word_scalar(a, base, drive + base, v_thresh, decay_period, want);
+      word(b, base, drive + base, v_thresh, decay_period, got);
+      if (want != got)
+        return false;
+    }
+    if (a.voltage != b.voltage || a.refractory != b.refractory ||
+        a.leak != b.leak || a.input != b.input || a.fired != b.fired)
+      return false;
+  }
+  return true;
+}
+
+// The neuron phase of neurons [begin, end) of n; begin is a multiple of 64
+// and end too or n.size(). Neuron i is driven if i < drive_size and
+// drive[i] > 0. If changed is set, it gets the words of neurons whose
+// voltage or spike changed.
+inline void update_neuron_words(NeuronStore &n, int begin, int end,
+                                const int *drive, int drive_size,
+                                int v_thresh, int decay_period,
+                                uint64_t *changed) {
+  const int driven = std::min(drive_size, n.size());
+  const NeuronWordFn word = g_neuron_word;
+  for (int base = begin; base < end; base += 64) {
+    const int *d = drive + base;
+    int local[64]; // Drive of a word that drive does not cover
+    if (base + 64 > driven) {
+      const int k = std::max(0, driven - base);
+      std::fill(std::copy(drive + base, drive + base + k, local), local + 64,
+                0);
+      d = local;
+    }
+    uint64_t moved;
+    word(n, base, d, v_thresh, decay_period, moved);
+    if (changed)
+      changed[base >> 6] = moved;
+  }
+}
+
+// One tick of the dense learning rule for a plastic synapse, in the order
+// of the original loop: pre_spiked and post_spiked say whether its source
+// and target fired this tick. Shared by SpikingNet and AgentBatch. Returns
+// true if the confidence changed.
+template <class Rules>
+inline bool dense_synapse_rule(DigitalSynapse &syn, unsigned char &active,
+                               bool pre_spiked, bool post_spiked,
+                               bool reward_active, bool penalty_active,
+                               StatCounts &counts, const Rules &rules) {
+  const int old_confidence = syn.confidence;
+  syn.ticks_since_ltp++;
+
+  // Reset inactivity counter on LTP attempt (Reward + Eligible)
+  if (reward_active && syn.reward_acceptor && syn.eligible_for_LTP) {
+    syn.ticks_since_ltp = 0;
+  }
+
+  // Decay timers
+  if (syn.ltp_timer > 0)
+    syn.ltp_timer--;
+  if (syn.ltd_timer > 0)
+    syn.ltd_timer--;
+
+  // Reinforcement Inertia counters
+  if (syn.reward_inertia_counter > 0) {
+    syn.reward_inertia_counter--;
+    if (syn.reward_inertia_counter == 0)
+      syn.reward_acceptor = true;
+  }
+  if (syn.penalty_inertia_counter > 0) {
+    syn.penalty_inertia_counter--;
+    if (syn.penalty_inertia_counter == 0)
+      syn.penalty_acceptor = true;
+  }
+
+  if (syn.eligibility_ltp_timer > 0) {
+    syn.eligibility_ltp_timer--;
+    if (syn.eligibility_ltp_timer == 0)
+      syn.eligible_for_LTP = false;
+  }
+  if (syn.eligibility_ltd_timer > 0) {
+    syn.eligibility_ltd_timer--;
+    if (syn.eligibility_ltd_timer == 0)
+      syn.eligible_for_LTD = false;
+  }
+
+  // Trace creation
+  if (pre_spiked) {
+    syn.ltp_timer = rules.spike_trace_window();
+    if (syn.ltd_timer > 0) {
+      syn.eligible_for_LTD = true;
+      syn.eligibility_ltd_timer = rules.eligibility_trace_window();
+    }
+  }
+
+  if (post_spiked) {
+    syn.ltd_timer = rules.spike_trace_window();
+    if (syn.ltp_timer > 0) {
+      syn.eligible_for_LTP = true;
+      syn.eligibility_ltp_timer = rules.eligibility_trace_window();
+    }
+  }
+
+  // Learning
+  if (reward_active && syn.reward_acceptor) {
+    bool modified = false;
+    if (syn.eligible_for_LTP && syn.confidence < CONFIDENCE_MAX) {
+      syn.confidence++;
+      active = (syn.confidence >= CONFIDENCE_THR);
+      syn.eligible_for_LTP = false;
+      syn.eligibility_ltp_timer = 0;
+      syn.confidence_leak_timer = rules.confidence_leak_period();
+      counts.add(STAT_LTP);
+      modified = true;
+    }
+    if (!modified && syn.eligible_for_LTD && syn.confidence > 0) {
+      syn.confidence--;
+      active = (syn.confidence >= CONFIDENCE_THR);
+      syn.eligible_for_LTD = false;
+      syn.eligibility_ltd_timer = 0;
+      syn.confidence_leak_timer = rules.confidence_leak_period();
+      counts.add(STAT_LTD);
+      modified = true;
+    }
+    if (modified) {
+      // Block penalty for a while
+      syn.penalty_acceptor = false;
+      syn.penalty_inertia_counter = rules.reinforcement_inertia_period();
+    }
+  } else if (penalty_active && syn.penalty_acceptor) {
+    bool modified = false;
+    if (syn.eligible_for_LTP && syn.confidence > 0) {
+      syn.confidence--;
+      active = (syn.confidence >= CONFIDENCE_THR);
+      syn.eligible_for_LTP = false;
+      syn.eligibility_ltp_timer = 0;
+      syn.confidence_leak_timer = rules.confidence_leak_period();
+      counts.add(STAT_LTD);
+      modified = true;
+    }
+    if (modified) {
+      // Block reward for a while
+      syn.reward_acceptor = false;
+      syn.reward_inertia_counter = rules.reinforcement_inertia_period();
+    }
+    // LTD + PENALTY is ignored per user request
+    if (syn.eligible_for_LTD) {
+      syn.eligible_for_LTD = false;
+      syn.eligibility_ltd_timer = 0;
+    }
+  }
+
+  // Leak
+  if (syn.confidence_leak_timer > 0)
+    syn.confidence_leak_timer--;
+  if (syn.confidence_leak_timer == 0) {
+    syn.confidence >>= 1;
+    active = (syn.confidence >= CONFIDENCE_THR);
+    syn.confidence_leak_timer = rules.confidence_leak_period();
+    counts.add(STAT_LEAKS);
+  }
+  return syn.confidence != old_confidence;
+}
+
+// Rewiring draws uniformly from [lo, size) minus the excluded targets (the
+// source and the row's current targets). excluded is sorted in place, so
+// the k-th candidate is found without listing the range. Returns -1 if
+// there is none (no draw is made then).
+inline int pick_rewire_target(int lo, int size, std::vector<int> &excluded,
+                              AgentRng &rng) {
+  std::sort(excluded.begin(), excluded.end());
+  excluded.erase(std::unique(excluded.begin(), excluded.end()),
+                 excluded.end());
+  const int candidates = size - lo - static_cast<int>(excluded.size());
+  if (candidates <= 0)
+    return -1;
+  int new_target = lo + rng.uniform_int(0, candidates - 1);
+  for (int e : excluded) {
+    if (e > new_target)
+      break;
+    ++new_target;
+  }
+  return new_target;
+}
+
+// Plastic state of a synapse that pruning just moved
+inline void reset_rewired_synapse(DigitalSynapse &syn) {
+  syn.confidence = 1; // Start fresh
+  syn.ticks_since_ltp = 0; // Reset timer
+
+  // Reset plastic state
+  syn.ltp_timer = 0;
+  syn.ltd_timer = 0;
+  syn.eligible_for_LTP = false;
+  syn.eligible_for_LTD = false;
+  syn.eligibility_ltp_timer = 0;
+  syn.eligibility_ltd_timer = 0;
+  syn.reward_acceptor = true;
+  syn.penalty_acceptor = true;
+}
+
+// --- Causal History ---
+const int MAX_HIST = 32; // Ticks of spike and contribution history
+
+struct Contribution {
+  int from_row;
+  int syn_idx; // Synapse id in SynapseStore
+};
+
+// The contributions sent in one tick u, listed per target in delivery
+// order (who fired at u is in the net's spike frames). The net
+// keeps MAX_HIST slots in a ring indexed by tick % MAX_HIST; reusing a slot
+// resets only what it held, and the links live in a bump arena whose
+// capacity survives the reset, so history costs O(spikes) per tick.
+struct HistorySlot {
+  struct Link {
+    Contribution c;
+    int next; // Next link to the same target, -1: last
+  };
+  std::vector<Link> arena;
+  std::vector<int> head; // Per target: first link, -1: none
+  std::vector<int> tail; // Per target: last link
+  std::vector<int> targets; // Targets with links (to reset head/tail)
+
+  void resize(int n) {
+    arena.clear();
+    head.assign(n, -1);
+    tail.assign(n, -1);
+    targets.clear();
+    targets.reserve(n);
+  }
+
+  void reset() {
+    for (int t : targets)
+      head[t] = tail[t] = -1;
+    arena.clear();
+    targets.clear();
+  }
+
+  void add(int target, int from_row, int syn_idx) {
+    const int k = static_cast<int>(arena.size());
+    arena.push_back({{from_row, syn_idx}, -1});
+    if (head[target] < 0) {
+      head[target] = k;
+      targets.push_back(target);
+    } else
+      arena[tail[target]].next = k;
+    tail[target] = k;
+  }
+};
+
+// --- Spike Frames ---
+// The neurons that fired in one tick as a packed bitset, bit i of word
+// i / 64; the default brain fits in one word. A net keeps the frames of the
+// last MAX_HIST ticks in a ring, so "did j fire at tick u" is one bit test
+// instead of a per-synapse flag scattered through the incoming index.
+inline int frame_words_for(int neurons) { return (neurons + 63) / 64; }
+
+inline bool frame_test(const uint64_t *frame, int i) {
+  return (frame[i >> 6] >> (i & 63)) & 1;
+}
+
+inline void frame_set(uint64_t *frame, int i) {
+  frame[i >> 6] |= uint64_t(1) << (i & 63);
+}
+
+// --- Topology ---
+// Neuron layout: [sensors][motors][sensor ports][motor ports][interior].
+// Sensor k feeds sensor port k and motor port m drives motor m; the ports
+// plus the interior form the plastic hidden layer. The default brain is
+// 0-3 sensors, 4-5 motors, 6-9 sensor ports, 10-11 motor ports, 12-35
+// interior. Both descriptors expose the same accessors, so SpikingNet
+// code is shared and FixedTopology folds every bound to a constant.
+
+// Interior neurons that may host the fallback input of an unconnected motor
+// port (12-29 in the default brain)
+const int FALLBACK_SOURCE_SPAN = 18;
+// Above this size connect_randomly() samples gaps instead of every pair
+const int PAIRWISE_WIRING_MAX = 1024;
+
+template <int N, int SENSORS = 4, int MOTORS = 2> struct FixedTopology {
+  static constexpr int size() { return N; }
+  static constexpr int sensors() { return SENSORS; }
+  static constexpr int motors() { return MOTORS; }
+  static constexpr double density() { return CONNECTION_DENSITY; }
+  static constexpr bool pairwise_wiring() { return N <= PAIRWISE_WIRING_MAX; }
+
+  static constexpr int motor_begin() { return SENSORS; }
+  static constexpr int hidden_begin() { return SENSORS + MOTORS; }
+  static constexpr int sensor_port_begin() { return hidden_begin(); }
+  static constexpr int motor_port_begin() { return hidden_begin() + SENSORS; }
+  static constexpr int interior_begin() { return motor_port_begin() + MOTORS; }
+  static constexpr bool is_sensor_port(int i) {
+    return i >= sensor_port_begin() && i < motor_port_begin();
+  }
+  static constexpr bool is_motor_port(int i) {
+    return i >= motor_port_begin() && i < interior_begin();
+  }
+  static constexpr bool is_port(int i) {
+    return i >= sensor_port_begin() && i < interior_begin();
+  }
+  static_assert(N > 2 * (SENSORS + MOTORS), "topology needs interior neurons");
+};
+
+// Same layout with sizes chosen at runtime (large or exploratory brains)
+struct DynamicTopology {
+  int neurons;
+  int num_sensors;
+  int num_motors;
+  double connection_density;
+  bool pairwise;
+
+  explicit DynamicTopology(int _neurons = BRAIN_SIZE,
+                           double _density = CONNECTION_DENSITY,
+                           int _sensors = 4, int _motors = 2)
+      : neurons(_neurons), num_sensors(_sensors), num_motors(_motors),
+        connection_density(_density),
+        pairwise(_neurons <= PAIRWISE_WIRING_MAX) {
+    if (neurons <= 2 * (num_sensors + num_motors))
+      throw std::invalid_argument("topology needs interior neurons");
+  }
+
+  int size() const { return neurons; }
+  int sensors() const { return num_sensors; }
+  int motors() const { return num_motors; }
+  double density() const { return connection_density; }
+  bool pairwise_wiring() const { return pairwise; }
+
+  int motor_begin() const { return num_sensors; }
+  int hidden_begin() const { return num_sensors + num_motors; }
+  int sensor_port_begin() const { return hidden_begin(); }
+  int motor_port_begin() const { return hidden_begin() + num_sensors; }
+  int interior_begin() const { return motor_port_begin() + num_motors; }
+  bool is_sensor_port(int i) const {
+    return i >= sensor_port_begin() && i < motor_port_begin();
+  }
+  bool is_motor_port(int i) const {
+    return i >= motor_port_begin() && i < interior_begin();
+  }
+  bool is_port(int i) const {
+    return i >= sensor_port_begin() && i < interior_begin();
+  }
+};
+
+// First legal target of a plastic synapse from hidden neuron i, under the
+// rules of SpikingNet::hidden_link_allowed()
+template <class Topology>
+int legal_target_begin(const Topology &topo, int i) {
+  if (topo.is_motor_port(i))
+    return topo.size();
+  // Sensor ports reach the interior; interior neurons also reach the
+  // motor ports
+  return topo.is_port(i) ? topo.interior_begin() : topo.motor_port_begin();
+}
+
+// --- Step Threads ---
+// Barrier between the phases of one parallel step. Phases are short, so
+// waiters yield instead of sleeping on a condition variable.
+class SpinBarrier {
+public:
+  explicit SpinBarrier(int _count) : count(_count), waiting(0), generation(0) {}
+
+  void wait() {
+    const int gen = generation.load(std::memory_order_acquire);
+    if (waiting.fetch_add(1, std::memory_order_acq_rel) == count - 1) {
+      waiting.store(0, std::memory_order_relaxed);
+      generation.fetch_add(1, std::memory_order_release);
+      return;
+    }
+    while (generation.load(std::memory_order_acquire) == gen)
+      std::this_thread::yield();
+  }
+
+private:
+  const int count;
+  std::atomic<int> waiting;
+  std::atomic<int> generation;
+};
+
+// Persistent helper threads running one job per run() call; the calling
+// thread is lane 0, so a team of n lanes starts n - 1 threads
+class StepTeam {
+public:
+  SpinBarrier barrier; // For phase boundaries inside a job
+
+  explicit StepTeam(int lanes)
+      : barrier(lanes), job(nullptr), job_id(0), remaining(0), quit(false) {
+    for (int l = 1; l < lanes; ++l)
+      threads.emplace_back(&StepTeam::lane_loop, this, l);
+  }
+
+  ~StepTeam() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      quit = true;
+    }
+    start_cv.notify_all();
+    for (auto &th : threads)
+      th.join();
+  }
+
+  int lanes() const { return (int)threads.size() + 1; }
+
+  // Calls f(lane) on every lane and returns when all have finished
+  void run(const std::function<void(int)> &f) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      job = &f;
+      remaining = lanes() - 1;
+      job_id++;
+    }
+    start_cv.notify_all();
+    f(0);
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cv.wait(lock, [this] { return remaining == 0; });
+    job = nullptr;
+  }
+
+private:
+  std::mutex mutex;
+  std::condition_variable start_cv;
+  std::condition_variable done_cv;
+  const std::function<void(int)> *job;
+  long long job_id;
+  int remaining;
+  bool quit;
+  std::vector<std::thread> threads;
+
+  void lane_loop(int lane) {
+    long long seen = 0;
+    for (;;) {
+      const std::function<void(int)> *f;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        start_cv.wait(lock, [&] { return quit || job_id != seen; });
+        if (quit)
+          return;
+        seen = job_id;
+        f = job;
+      }
+      (*f)(lane);
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--remaining == 0)
+        done_cv.notify_one();
+    }
+  }
+};
+
+enum Engine : int {
+  DENSE, // Visit every synapse every tick (reference implementation)
+  EVENT  // Touch only synapses with a spike, reward or leak deadline due
+};
+
+// Tracing policies for SpikingNet. CausalTrace keeps the spike and
+// contribution history and lights the synapses behind each motor spike
+// (while set_tracing() is on); NoTrace compiles all of that out, for runs
+// nobody watches.
+struct CausalTrace {
+  static const bool enabled = true;
+};
+struct NoTrace {
+  static const bool enabled = false;
+};
+
+template <class Topology, class Trace = CausalTrace,
+          class Rules = DefaultRules>
+class SpikingNet {
+public:
+  typedef Topology topology_type;
+  typedef Trace trace_type;
+  typedef Rules rules_type;
+
+  Topology topo;
+  Rules rules;
+  NeuronStore neurons;
+  SynapseStore synapses;
+  int global_tick;
+
+  Engine engine;
+  std::vector<int> spiked; // Neurons that fired this tick
+  std::vector<int> highlighted_syns;
+  std::vector<uint64_t> spike_frames; // MAX_HIST ticks, see spike_frame
+  std::vector<HistorySlot> history;   // MAX_HIST ticks, see history_at
+  bool tracing; // CausalTrace only: record history and trace (viewer)
+  TickStats stats; // Cleared by whoever reports them (see format_stats)
+  uint64_t rewires; // Since the net was built, whatever ENABLE_STATS says
+
+  // Causal tracing scratch: a visited mark per (depth, neuron), valid when
+  // equal to trace_generation, so no trace has to clear or allocate it
+  static const int MAX_TRACE = 12;
+  std::vector<unsigned> visited_stamp;
+  unsigned trace_generation;
+  struct TraceStep {
+    int idx;
+    int depth;
+  };
+  std::vector<TraceStep> trace_stack;
+
+  // Event engine indices (rebuilt lazily after topology or engine changes)
+  bool event_index_ready;
+  std::vector<int> eligible_syns; // Superset of synapses with open windows
+  std::vector<int> wheel_head; // Per slot (leak_due & mask), -1: empty
+  std::vector<int> wheel_tail;
+  int leak_wheel_mask;
+  std::vector<int> touched;
+
+  // Pruning order: one (last_ltp_tick, synapse) entry per LTP reset, in
+  // tick order because resets only ever move a synapse to the current tick.
+  // A past tick's entries are sorted by id when they reach the head. An
+  // entry is live while it matches the synapse's deadline; stale ones are
+  // skipped at the head and dropped when the queue is compacted.
+  struct PruneEntry {
+    int last_ltp_tick;
+    int syn;
+  };
+  std::vector<PruneEntry> prune_queue;
+  size_t prune_head;
+  size_t prune_sorted_end; // [prune_head, this) is sorted by (tick, id)
+  size_t prune_live; // Plastic synapses, each with exactly one live entry
+
+  std::vector<int> rewire_excluded; // rewire_synapse scratch
+
+  // Parallel dense step (see set_threads)
+  struct StepLane {
+    int neuron_begin, neuron_end; // Neurons updated and reduced by the lane
+    int row_begin, row_end;       // CSR rows, balanced by synapse count
+    std::vector<int> spiked;
+    std::vector<int> input_acc; // Spikes this lane delivered, per target
+    std::vector<int> delivered; // Synapses that delivered, in row order
+    std::vector<int> changed_neurons;
+    std::vector<int> changed_syns;
+    int worst_syn;
+    int max_inactive;
+    StatCounts counts;
+  };
+  std::unique_ptr<StepTeam> team;
+  std::vector<StepLane> lanes;
+
+  // Change tracking for delta frames (see set_change_tracking). Each id is
+  // listed once until clear_changes(); the flags dedupe.
+  struct ChangeSet {
+    std::vector<int> neurons;  // Voltage or spike flag changed
+    std::vector<int> synapses; // Confidence, active or highlight changed
+    std::vector<int> rewired;  // Retargeted by pruning
+  };
+  bool track_changes;
+  ChangeSet changes;
+  std::vector<unsigned char> neuron_dirty;
+  std::vector<uint64_t> neuron_changed; // update_neuron_range scratch
+  std::vector<unsigned char> syn_dirty; // SYN_DIRTY_* bits
+
+  enum { SYN_DIRTY_STATE = 1, SYN_DIRTY_REWIRED = 2 };
+
+  explicit SpikingNet(const Topology &_topo = Topology(),
+                      const Rules &_rules = Rules())
+      : topo(_topo), rules(_rules), global_tick(0), engine(DENSE),
+        tracing(Trace::enabled), rewires(0), trace_generation(0),
+        event_index_ready(false), leak_wheel_mask(0),
+        prune_head(0), prune_sorted_end(0), prune_live(0),
+        track_changes(false) {
+    neurons = NeuronStore(topo.size(), rules.membrane_decay_period());
+    neuron_changed.assign(frame_words(), 0);
+    synapses.build(topo.size(), {}, rules.confidence_leak_period());
+    spiked.reserve(topo.size());
+    rewire_excluded.reserve(topo.size() + 1); // Source and distinct targets
+    spike_frames.assign(static_cast<size_t>(MAX_HIST) * frame_words(), 0);
+    if (Trace::enabled) {
+      history.resize(MAX_HIST);
+      for (HistorySlot &slot : history)
+        slot.resize(topo.size());
+    }
+  }
+
+  // Constant false for NoTrace, so the tracing branches fold away
+  bool trace_on() const { return Trace::enabled && tracing; }
+
+  // Tracing costs a history record per delivered spike; turn it off while
+  // no viewer shows the highlights. Turning it back on starts with an empty
+  // history, so no stale ticks are traced.
+  void set_tracing(bool on) {
+    if (!Trace::enabled || on == tracing)
+      return;
+    tracing = on;
+    clear_highlights();
+    if (on)
+      for (HistorySlot &slot : history)
+        slot.resize(topo.size());
+  }
+
+  // Words per spike frame, a constant for FixedTopology
+  int frame_words() const { return frame_words_for(topo.size()); }
+
+  // Spike frame of tick u, valid for the last MAX_HIST ticks. The current
+  // tick's frame is written by the neuron update.
+  uint64_t *spike_frame(int u) {
+    return &spike_frames[static_cast<size_t>(((u % MAX_HIST) + MAX_HIST) %
+                                             MAX_HIST) *
+                         frame_words()];
+  }
+  const uint64_t *spike_frame(int u) const {
+    return const_cast<SpikingNet *>(this)->spike_frame(u);
+  }
+
+  // History of tick u, valid for the last MAX_HIST ticks
+  HistorySlot &history_at(int u) {
+    return history[((u % MAX_HIST) + MAX_HIST) % MAX_HIST];
+  }
+  const HistorySlot &history_at(int u) const {
+    return history[((u % MAX_HIST) + MAX_HIST) % MAX_HIST];
+  }
+
+  // Topology rules for a plastic hidden-to-hidden synapse i -> j
+  bool hidden_link_allowed(int i, int j) const {
+    if (i == j)
+      return false;
+    // Constraint 1: First layer (ports 6-11) can't connect to each other
+    if (topo.is_port(i) && topo.is_port(j))
+      return false;
+    // Constraint 2: Sensor ports (6-9) can only HAVE outgoing connections
+    // (no incoming besides sensor)
+    if (topo.is_sensor_port(j))
+      return false;
+    // Constraint 3: Motor ports (10-11) can only HAVE incoming connections
+    // (no outgoing besides motor)
+    if (topo.is_motor_port(i))
+      return false;
+    return true;
+  }
+
+  // Under the rules above the legal targets of a row are [begin, size)
+  // minus the source itself; a motor port has none (begin == size)
+  int legal_target_begin(int i) const {
+    return ::legal_target_begin(topo, i);
+  }
+
+  void connect_randomly(AgentRng &rng) {
+    connect_randomly(topo.density(), rng);
+  }
+
+  void connect_randomly(double density, AgentRng &rng) {
+    rng.at(STREAM_WIRING, 0);
+    std::vector<SynapseStore::Edge> edges;
+
+    // 1. Deterministic Connections (Sensors and Motors)
+    // Sensor k -> its port (0->6 Food-L, 1->7 Food-R, 2->8 Danger-L,
+    // 3->9 Danger-R)
+    for (int k = 0; k < topo.sensors(); ++k)
+      edges.push_back({k, topo.sensor_port_begin() + k, CONFIDENCE_MAX, false});
+    // Motor port m -> motor m (10->4, 11->5)
+    for (int m = 0; m < topo.motors(); ++m)
+      edges.push_back({topo.motor_port_begin() + m, topo.motor_begin() + m,
+                       CONFIDENCE_MAX, false});
+
+    // 2. Random Hidden-to-Hidden Connections
+    if (topo.pairwise_wiring())
+      wire_pairwise(density, rng, edges);
+    else
+      wire_by_gaps(density, rng, edges);
+
+    // Ensure motor ports always have at least one input
+    for (int m = 0; m < topo.motors(); ++m) {
+      const int target = topo.motor_port_begin() + m;
+      bool has_input = false;
+      for (const auto &ed : edges) {
+        if (ed.target == target) {
+          has_input = true;
+          break;
+        }
+      }
+      if (!has_input) {
+        // Add one from an interior neuron (12-29) to avoid constraints
+        const int src = rng.uniform_int(
+            topo.interior_begin(),
+            std::min(topo.interior_begin() + FALLBACK_SOURCE_SPAN,
+                     topo.size()) -
+                1);
+        edges.push_back({src, target, CONFIDENCE_THR, true});
+      }
+    }
+
+    synapses.build(topo.size(), edges, rules.confidence_leak_period());
+    reserve_for_synapses();
+    if (engine == EVENT)
+      sync_deadlines();
+    event_index_ready = false;
+    if (track_changes)
+      set_change_tracking(true);
+  }
+
+  // One draw per candidate pair: O(N^2), but keeps the rng sequence of
+  // existing experiments for the small default brain
+  void wire_pairwise(double density, AgentRng &rng,
+                     std::vector<SynapseStore::Edge> &edges) {
+    for (int i = topo.hidden_begin(); i < topo.size(); ++i) {
+      for (int j = topo.hidden_begin(); j < topo.size(); ++j) {
+        if (!hidden_link_allowed(i, j))
+          continue;
+        if (rng.uniform01() < density) {
+          int init_conf =
+              rng.uniform_int(CONFIDENCE_INIT_LOW, CONFIDENCE_INIT_HIGH);
+          edges.push_back({i, j, init_conf, true});
+        }
+      }
+    }
+  }
+
+  // Same distribution in O(N + E): the legal targets of a row are one
+  // contiguous range minus the source itself, so jump between hits with
+  // geometric gaps instead of testing every pair.
+  void wire_by_gaps(double density, AgentRng &rng,
+                    std::vector<SynapseStore::Edge> &edges) {
+    if (density <= 0.0)
+      return;
+    const double p = std::min(density, 1.0);
+    for (int i = topo.hidden_begin(); i < topo.size(); ++i) {
+      if (topo.is_motor_port(i))
+        continue;
+      const int lo = legal_target_begin(i);
+      const bool skip_self = i >= lo;
+      const long long count = topo.size() - lo - (skip_self ? 1 : 0);
+      for (long long k = rng.geometric(p); k < count;
+           k += 1 + rng.geometric(p)) {
+        int j = lo + static_cast<int>(k);
+        if (skip_self && j >= i)
+          ++j;
+        edges.push_back(
+            {i, j, rng.uniform_int(CONFIDENCE_INIT_LOW, CONFIDENCE_INIT_HIGH),
+             true});
+      }
+    }
+  }
+
+  // sensory_input: number of input spikes per neuron at this timestep
+  // reward_active: true if global reward signal is present
+  // penalty_active: true if global penalty signal is present
+  void step(const std::vector<int> &sensory_input, bool reward_active,
+            bool penalty_active, AgentRng &rng) {
+    if (engine == EVENT)
+      step_event(sensory_input, reward_active, penalty_active, rng);
+    else if (team)
+      step_dense_parallel(sensory_input, reward_active, penalty_active, rng);
+    else
+      step_dense(sensory_input, reward_active, penalty_active, rng);
+  }
+
+  // Run the dense engine on n threads (1: serial). Results are identical to
+  // the serial step; the event engine ignores this and stays serial.
+  void set_threads(int n) {
+    if (n == (team ? team->lanes() : 1))
+      return;
+    lanes.clear();
+    team.reset();
+    if (n > 1) {
+      team.reset(new StepTeam(n));
+      lanes.resize(n);
+    }
+  }
+
+  // Record what each step changes, so a viewer can be sent deltas
+  void set_change_tracking(bool on) {
+    track_changes = on;
+    changes = ChangeSet();
+    neuron_dirty.assign(on ? neurons.size() : 0, 0);
+    syn_dirty.assign(on ? synapses.size() : 0, 0);
+    if (on) {
+      // Each id is listed once per delta (see neuron_dirty, syn_dirty)
+      changes.neurons.reserve(neurons.size());
+      changes.synapses.reserve(synapses.size());
+      changes.rewired.reserve(synapses.size());
+    }
+  }
+
+  // Start a new delta after the current changes have been sent
+  void clear_changes() {
+    for (int i : changes.neurons)
+      neuron_dirty[i] = 0;
+    for (int s : changes.synapses)
+      syn_dirty[s] = 0;
+    for (int s : changes.rewired)
+      syn_dirty[s] = 0;
+    changes.neurons.clear();
+    changes.synapses.clear();
+    changes.rewired.clear();
+  }
+
+  void mark_synapse(int s, std::vector<int> &out) {
+    if (!(syn_dirty[s] & SYN_DIRTY_STATE)) {
+      syn_dirty[s] |= SYN_DIRTY_STATE;
+      out.push_back(s);
+    }
+  }
+
+  // 0. Only last tick's causal chain can be lit
+  void clear_highlights() {
+    for (int s : highlighted_syns) {
+      synapses.state[s].highlighted = false;
+      if (track_changes)
+        mark_synapse(s, changes.synapses);
+    }
+    highlighted_syns.clear();
+  }
+
+  // Switch engines between ticks. Timer state is converted at the current
+  // tick, so the run continues exactly as if it had never switched.
+  void set_engine(Engine e) {
+    if (e == engine)
+      return;
+    if (e == EVENT)
+      sync_deadlines();
+    else
+      sync_countdowns();
+    engine = e;
+    event_index_ready = false;
+  }
+
+  void step_dense(const std::vector<int> &sensory_input, bool reward_active,
+                  bool penalty_active, AgentRng &rng) {
+    ++global_tick;
+    PhaseClock clock(stats);
+    // 0. Update highlights and tick
+    clear_highlights();
+    clock.lap(PHASE_TRACE);
+    HistorySlot *sent = trace_on() ? &history_at(global_tick) : nullptr;
+    if (sent)
+      sent->reset(); // Last held tick - MAX_HIST
+    clock.lap(PHASE_HISTORY);
+
+    // 1. Update neurons
+    update_neurons(sensory_input);
+    const uint64_t *fired = spike_frame(global_tick);
+    clock.lap(PHASE_NEURONS);
+
+    // 2. Propagate and evaluate plastic synapses
+    int worst_syn = -1;
+    int max_inactive = -1;
+
+    for (int i = 0; i < static_cast<int>(neurons.size()); ++i) {
+      const bool pre_spiked = neurons.spiked(i);
+      for (int s = synapses.row_begin(i); s < synapses.row_end(i); ++s) {
+        if (pre_spiked && synapses.active[s]) {
+          neurons.input[synapses.targets[s]] += 1;
+          if (sent)
+            sent->add(synapses.targets[s], i, s);
+        }
+
+        if (synapses.state[s].plastic &&
+            update_synapse_dense(s, pre_spiked, fired, reward_active,
+                                 penalty_active, worst_syn, max_inactive,
+                                 stats.counts) &&
+            track_changes)
+          mark_synapse(s, changes.synapses);
+      }
+    }
+    clock.lap(PHASE_PLASTICITY);
+
+    // 2.5 Pruning: Rewire the most inactive synapse periodically
+    if (worst_syn >= 0 && (global_tick % rules.pruning_period() == 0))
+      rewire_synapse(worst_syn, rng);
+    clock.lap(PHASE_PRUNING);
+
+    finish_step(clock);
+  }
+
+  // One tick of the learning rule for plastic synapse s; fired is this
+  // tick's spike frame. Tracks the pruning candidate: the first synapse with
+  // the largest ticks_since_ltp. Returns true if the confidence changed.
+  bool update_synapse_dense(int s, bool pre_spiked, const uint64_t *fired,
+                            bool reward_active, bool penalty_active,
+                            int &worst_syn, int &max_inactive,
+                            StatCounts &counts) {
+    DigitalSynapse &syn = synapses.state[s];
+    const bool changed = dense_synapse_rule(
+        syn, synapses.active[s], pre_spiked,
+        frame_test(fired, synapses.targets[s]), reward_active, penalty_active,
+        counts, rules);
+    if (syn.ticks_since_ltp > max_inactive) {
+      max_inactive = syn.ticks_since_ltp;
+      worst_syn = s;
+    }
+    return changed;
+  }
+
+  // step_dense() split across the team. Each lane updates a slice of the
+  // neurons, then runs the rule over a slice of CSR rows, delivering spikes
+  // into its own accumulators; after a barrier each lane sums all lanes'
+  // accumulators for its neurons. Lane slices are in ascending order, so
+  // merging per-lane results in lane order matches the serial loop.
+  void step_dense_parallel(const std::vector<int> &sensory_input,
+                           bool reward_active, bool penalty_active,
+                           AgentRng &rng) {
+    ++global_tick;
+    PhaseClock clock(stats);
+    // 0. Only last tick's causal chain can be lit
+    clear_highlights();
+    clock.lap(PHASE_TRACE);
+    HistorySlot *sent = trace_on() ? &history_at(global_tick) : nullptr;
+    if (sent)
+      sent->reset();
+    clock.lap(PHASE_HISTORY);
+
+    // Lane 0 laps the neuron phase once every lane is past it
+    partition_lanes();
+    team->run([&](int l) {
+      dense_lane(l, sensory_input, reward_active, penalty_active,
+                 l == 0 ? &clock : nullptr);
+    });
+    clock.lap(PHASE_PLASTICITY);
+
+    spiked.clear();
+    int worst_syn = -1;
+    int max_inactive = -1;
+    for (const StepLane &lane : lanes) {
+      spiked.insert(spiked.end(), lane.spiked.begin(), lane.spiked.end());
+      changes.neurons.insert(changes.neurons.end(),
+                             lane.changed_neurons.begin(),
+                             lane.changed_neurons.end());
+      changes.synapses.insert(changes.synapses.end(),
+                              lane.changed_syns.begin(),
+                              lane.changed_syns.end());
+      if (sent)
+        for (int s : lane.delivered)
+          sent->add(synapses.targets[s], synapses.sources[s], s);
+      stats.counts.add(lane.counts);
+      // Strictly greater keeps the lowest id on ties, as the serial scan
+      if (lane.worst_syn >= 0 && lane.max_inactive > max_inactive) {
+        max_inactive = lane.max_inactive;
+        worst_syn = lane.worst_syn;
+      }
+    }
+
+    clock.lap(PHASE_HISTORY);
+
+    // 2.5 Pruning: Rewire the most inactive synapse periodically
+    if (worst_syn >= 0 && (global_tick % rules.pruning_period() == 0))
+      rewire_synapse(worst_syn, rng);
+    clock.lap(PHASE_PRUNING);
+
+    finish_step(clock);
+  }
+
+  // Start of lane l's neurons: an even share rounded down to a whole spike
+  // frame word, so lanes never write the same word
+  static int frame_cut(int n, long long l, long long num_lanes) {
+    if (l == num_lanes)
+      return n;
+    return static_cast<int>(n * l / num_lanes) & ~63;
+  }
+
+  // Even neuron slices (by frame word); row slices cut where the synapse
+  // count crosses each lane's share of the CSR arrays
+  void partition_lanes() {
+    const int n = static_cast<int>(neurons.size());
+    const long long num_lanes = static_cast<long long>(lanes.size());
+    const std::vector<int> &offsets = synapses.row_offsets;
+    int row = 0;
+    for (int l = 0; l < num_lanes; ++l) {
+      StepLane &lane = lanes[l];
+      lane.neuron_begin = frame_cut(n, l, num_lanes);
+      lane.neuron_end = frame_cut(n, l + 1, num_lanes);
+      lane.row_begin = row;
+      if (l + 1 == num_lanes) {
+        row = n;
+      } else {
+        const int share = static_cast<int>(synapses.size() * (l + 1) /
+                                           num_lanes);
+        auto cut = std::lower_bound(offsets.begin() + row, offsets.end() - 1,
+                                    share);
+        row = static_cast<int>(cut - offsets.begin());
+      }
+      lane.row_end = row;
+      if (static_cast<int>(lane.input_acc.size()) != n)
+        lane.input_acc.assign(n, 0);
+      const int rows_syns = offsets[lane.row_end] - offsets[lane.row_begin];
+      lane.spiked.reserve(lane.neuron_end - lane.neuron_begin);
+      lane.changed_neurons.reserve(lane.neuron_end - lane.neuron_begin);
+      lane.delivered.reserve(rows_syns);
+      lane.changed_syns.reserve(rows_syns);
+    }
+  }
+
+  void dense_lane(int l, const std::vector<int> &sensory_input,
+                  bool reward_active, bool penalty_active, PhaseClock *clock) {
+    StepLane &lane = lanes[l];
+
+    // 1. Update this lane's neurons and their words of the spike frame
+    lane.spiked.clear();
+    lane.changed_neurons.clear();
+    lane.changed_syns.clear();
+    lane.counts.clear();
+    update_neuron_range(lane.neuron_begin, lane.neuron_end, sensory_input,
+                        lane.spiked,
+                        track_changes ? &lane.changed_neurons : nullptr);
+    const uint64_t *fired = spike_frame(global_tick);
+    team->barrier.wait();
+    if (clock)
+      clock->lap(PHASE_NEURONS);
+
+    // 2. Propagate and evaluate this lane's rows
+    lane.delivered.clear();
+    lane.worst_syn = -1;
+    lane.max_inactive = -1;
+    for (int i = lane.row_begin; i < lane.row_end; ++i) {
+      const bool pre_spiked = neurons.spiked(i);
+      for (int s = synapses.row_begin(i); s < synapses.row_end(i); ++s) {
+        if (pre_spiked && synapses.active[s]) {
+          lane.input_acc[synapses.targets[s]]++;
+          lane.delivered.push_back(s);
+        }
+        if (synapses.state[s].plastic &&
+            update_synapse_dense(s, pre_spiked, fired, reward_active,
+                                 penalty_active, lane.worst_syn,
+                                 lane.max_inactive, lane.counts) &&
+            track_changes)
+          mark_synapse(s, lane.changed_syns);
+      }
+    }
+    team->barrier.wait();
+
+    // 3. Reduce deliveries into this lane's neurons
+    for (int j = lane.neuron_begin; j < lane.neuron_end; ++j) {
+      int sum = 0;
+      for (StepLane &other : lanes) {
+        sum += other.input_acc[j];
+        other.input_acc[j] = 0;
+      }
+      neurons.input[j] += sum;
+    }
+  }
+
+  // Same rule as step_dense(), but with absolute deadlines: a synapse whose
+  // pre/post neuron is silent, that is not eligible during reward/penalty and
+  // whose leak is not due has no work to do, because its countdowns are
+  // implied by global_tick. Cost scales with spikes and eligible synapses.
+  void step_event(const std::vector<int> &sensory_input, bool reward_active,
+                  bool penalty_active, AgentRng &rng) {
+    if (!event_index_ready)
+      build_event_index();
+
+    ++global_tick;
+    const int now = global_tick;
+    PhaseClock clock(stats);
+
+    // 0. Only last tick's causal chain can be lit
+    clear_highlights();
+    clock.lap(PHASE_TRACE);
+    HistorySlot *sent = trace_on() ? &history_at(global_tick) : nullptr;
+    if (sent)
+      sent->reset();
+    clock.lap(PHASE_HISTORY);
+
+    // 1. Update neurons
+    update_neurons(sensory_input);
+    clock.lap(PHASE_NEURONS);
+
+    // 2. Propagate (rows of silent neurons deliver nothing)
+    for (int i : spiked) {
+      for (int s = synapses.row_begin(i); s < synapses.row_end(i); ++s) {
+        if (synapses.active[s]) {
+          neurons.input[synapses.targets[s]] += 1;
+          if (sent)
+            sent->add(synapses.targets[s], i, s);
+        }
+      }
+    }
+
+    // 2.1 Collect synapses with work this tick, each once
+    touched.clear();
+    for (int i : spiked) {
+      for (int s = synapses.row_begin(i); s < synapses.row_end(i); ++s)
+        touch(s);
+    }
+    for (int j : spiked) {
+      for (int p = synapses.in_begin(j); p < synapses.in_end(j); ++p)
+        touch(synapses.in_syn[p]);
+    }
+    if (reward_active || penalty_active) {
+      for (int s : eligible_syns)
+        touch(s);
+    }
+    const int slot = now & leak_wheel_mask;
+    int next = wheel_head[slot];
+    wheel_head[slot] = wheel_tail[slot] = -1;
+    while (next >= 0) {
+      const int s = next;
+      SynapseDeadlines &d = synapses.deadlines[s];
+      next = d.wheel_next;
+      d.wheel_next = WHEEL_UNQUEUED;
+      if (d.leak_due == now)
+        touch(s);
+      else if (d.leak_due > now)
+        schedule_leak(s); // Moved on since it was queued
+    }
+
+    // 2.2 Plasticity for touched synapses
+    for (int s : touched) {
+      if (update_synapse_event(s, reward_active, penalty_active) &&
+          track_changes)
+        mark_synapse(s, changes.synapses);
+    }
+
+    if (reward_active || penalty_active)
+      compact_eligible();
+    clock.lap(PHASE_PLASTICITY);
+
+    // 2.5 Pruning: the most inactive synapse is the oldest last_ltp_tick,
+    // lowest id on ties (same pick as the dense scan)
+    if (now % rules.pruning_period() == 0) {
+      int worst_syn = oldest_ltp_synapse();
+      if (worst_syn >= 0)
+        rewire_synapse(worst_syn, rng);
+    }
+    if (prune_queue.size() > 2 * prune_live + 64)
+      compact_prune_queue();
+    clock.lap(PHASE_PRUNING);
+
+    finish_step(clock);
+  }
+
+  void update_neurons(const std::vector<int> &sensory_input) {
+    spiked.clear();
+    update_neuron_range(0, static_cast<int>(neurons.size()), sensory_input,
+                        spiked, track_changes ? &changes.neurons : nullptr);
+  }
+
+  // Neurons [begin, end); the ones that fire are appended to out_spiked and
+  // set in this tick's spike frame, whose words the range must own (begin a
+  // multiple of 64, end too or the last neuron). If out_changed is set,
+  // newly changed neurons are appended to it.
+  void update_neuron_range(int begin, int end,
+                           const std::vector<int> &sensory_input,
+                           std::vector<int> &out_spiked,
+                           std::vector<int> *out_changed) {
+    update_neuron_words(neurons, begin, end, sensory_input.data(),
+                        static_cast<int>(sensory_input.size()),
+                        rules.v_thresh(), rules.membrane_decay_period(),
+                        out_changed ? neuron_changed.data() : nullptr);
+    uint64_t *frame = spike_frame(global_tick);
+    for (int w = begin / 64; w < frame_words_for(end); ++w) {
+      frame[w] = neurons.fired[w];
+      for (uint64_t bits = frame[w]; bits; bits &= bits - 1)
+        out_spiked.push_back(w * 64 + floor_log2(bits & (0 - bits)));
+      if (!out_changed)
+        continue;
+      for (uint64_t bits = neuron_changed[w]; bits; bits &= bits - 1) {
+        const int k = w * 64 + floor_log2(bits & (0 - bits));
+        if (!neuron_dirty[k]) {
+          neuron_dirty[k] = 1;
+          out_changed->push_back(k);
+        }
+      }
+    }
+  }
+
+  // Prune and rewire synapse s to a random legal target
+  void rewire_synapse(int s, AgentRng &rng) {
+    DigitalSynapse &syn = synapses.state[s];
+    const int pre_idx = synapses.sources[s];
+    const int target = synapses.targets[s];
+
+    // Potential targets: ONLY Hidden (6-35). Motors (4,5) are fixed.
+    // Candidates are the legal range minus the source and the row's current
+    // targets (no duplicates), see pick_rewire_target
+    const int lo = legal_target_begin(pre_idx);
+    std::vector<int> &excluded = rewire_excluded;
+    excluded.clear();
+    if (pre_idx >= lo)
+      excluded.push_back(pre_idx);
+    for (int k = synapses.row_begin(pre_idx); k < synapses.row_end(pre_idx);
+         ++k) {
+      if (synapses.targets[k] >= lo)
+        excluded.push_back(synapses.targets[k]);
+    }
+    rng.at(STREAM_PRUNING, global_tick);
+    int new_target = pick_rewire_target(lo, topo.size(), excluded, rng);
+
+    if (new_target >= 0) {
+      // Constraint: If current target is a motor port (10, 11), check if
+      // this is the only connection
+      if (topo.is_motor_port(target) && synapses.in_degree(target) <= 1) {
+        // Can't move it away. Effectively just reset it on current target.
+        new_target = target;
+      }
+
+      // Prune and Rewire
+      synapses.retarget(s, new_target);
+      stats.counts.add(STAT_REWIRES);
+      ++rewires;
+      if (track_changes) {
+        mark_synapse(s, changes.synapses);
+        if (!(syn_dirty[s] & SYN_DIRTY_REWIRED)) {
+          syn_dirty[s] |= SYN_DIRTY_REWIRED;
+          changes.rewired.push_back(s);
+        }
+      }
+      reset_rewired_synapse(syn);
+      synapses.active[s] = (syn.confidence >= CONFIDENCE_THR);
+
+      // Same reset in absolute-tick form
+      if (!synapses.deadlines.empty()) {
+        SynapseDeadlines &d = synapses.deadlines[s];
+        d.ltp_until = 0;
+        d.ltd_until = 0;
+        d.eligibility_ltp_until = 0;
+        d.eligibility_ltd_until = 0;
+        d.reward_block_until = 0;
+        d.penalty_block_until = 0;
+        d.last_ltp_tick = global_tick;
+        prune_queue.push_back({global_tick, s});
+      }
+    }
+  }
+
+  // Room for the busiest tick once the synapses are built: a synapse is
+  // highlighted at most once and sends at most one contribution per tick,
+  // so stepping never grows these
+  void reserve_for_synapses() {
+    highlighted_syns.reserve(synapses.size());
+    for (HistorySlot &slot : history)
+      slot.arena.reserve(synapses.size());
+  }
+
+  // Spike count and causal tracing, shared by both engines
+  void finish_step(PhaseClock &clock) {
+    stats.counts.add(STAT_SPIKES, spiked.size());
+    if (!trace_on())
+      return;
+
+    // 3. Causal Tracing from Motor Neurons
+    for (int m = 0; m < topo.motors(); ++m) {
+      trace_causal_chain(topo.motor_begin() + m);
+    }
+    clock.lap(PHASE_TRACE);
+  }
+
+  // --- Event engine bookkeeping ---
+
+  // The leak wheel holds each synapse at most once, linked into the slot of
+  // its leak_due when it was queued, so scheduling never allocates. A leak
+  // only moves later, so a queued synapse stays put and is moved on when
+  // its old slot comes due.
+  void schedule_leak(int s) {
+    SynapseDeadlines &d = synapses.deadlines[s];
+    if (d.wheel_next != WHEEL_UNQUEUED)
+      return;
+    const int slot = d.leak_due & leak_wheel_mask;
+    d.wheel_next = -1;
+    if (wheel_tail[slot] < 0)
+      wheel_head[slot] = s;
+    else
+      synapses.deadlines[wheel_tail[slot]].wheel_next = s;
+    wheel_tail[slot] = s;
+  }
+
+  void touch(int s) {
+    SynapseDeadlines &d = synapses.deadlines[s];
+    if (synapses.state[s].plastic && d.touch_tick != global_tick) {
+      d.touch_tick = global_tick;
+      touched.push_back(s);
+    }
+  }
+
+  // One tick of the dense per-synapse rule, expressed on deadlines. Checks
+  // that the dense loop makes before its countdowns are decremented see the
+  // state as of the end of the previous tick (now - 1). Returns true if the
+  // confidence changed.
+  bool update_synapse_event(int s, bool reward_active, bool penalty_active) {
+    DigitalSynapse &syn = synapses.state[s];
+    SynapseDeadlines &d = synapses.deadlines[s];
+    const int now = global_tick;
+    const int old_confidence = syn.confidence;
+    const int prev_leak_due = d.leak_due;
+
+    // Reset inactivity counter on LTP attempt (Reward + Eligible)
+    if (reward_active && now - 1 >= d.reward_block_until &&
+        now - 1 < d.eligibility_ltp_until) {
+      d.last_ltp_tick = now;
+      prune_queue.push_back({now, s});
+    }
+
+    // Trace creation
+    if (neurons.spiked(synapses.sources[s])) {
+      d.ltp_until = now + rules.spike_trace_window();
+      if (now < d.ltd_until)
+        d.eligibility_ltd_until = now + rules.eligibility_trace_window();
+    }
+    if (neurons.spiked(synapses.targets[s])) {
+      d.ltd_until = now + rules.spike_trace_window();
+      if (now < d.ltp_until)
+        d.eligibility_ltp_until = now + rules.eligibility_trace_window();
+    }
+
+    // Learning. A reset leak countdown is decremented in the same tick,
+    // hence the deadline of now - 1 + period.
+    bool eligible_ltp = now < d.eligibility_ltp_until;
+    bool eligible_ltd = now < d.eligibility_ltd_until;
+    if (reward_active && now >= d.reward_block_until) {
+      bool modified = false;
+      if (eligible_ltp && syn.confidence < CONFIDENCE_MAX) {
+        syn.confidence++;
+        d.eligibility_ltp_until = 0;
+        d.leak_due = now - 1 + rules.confidence_leak_period();
+        stats.counts.add(STAT_LTP);
+        modified = true;
+      }
+      if (!modified && eligible_ltd && syn.confidence > 0) {
+        syn.confidence--;
+        d.eligibility_ltd_until = 0;
+        d.leak_due = now - 1 + rules.confidence_leak_period();
+        stats.counts.add(STAT_LTD);
+        modified = true;
+      }
+      if (modified)
+        d.penalty_block_until = now + rules.reinforcement_inertia_period();
+    } else if (penalty_active && now >= d.penalty_block_until) {
+      bool modified = false;
+      if (eligible_ltp && syn.confidence > 0) {
+        syn.confidence--;
+        d.eligibility_ltp_until = 0;
+        d.leak_due = now - 1 + rules.confidence_leak_period();
+        stats.counts.add(STAT_LTD);
+        modified = true;
+      }
+      if (modified)
+        d.reward_block_until = now + rules.reinforcement_inertia_period();
+      if (eligible_ltd)
+        d.eligibility_ltd_until = 0;
+    }
+
+    // Leak
+    if (d.leak_due == now) {
+      syn.confidence >>= 1;
+      d.leak_due = now + rules.confidence_leak_period();
+      stats.counts.add(STAT_LEAKS);
+    }
+    synapses.active[s] = (syn.confidence >= CONFIDENCE_THR);
+
+    if (d.leak_due != prev_leak_due && d.leak_due > now)
+      schedule_leak(s);
+    if (!d.in_eligible_list &&
+        (now < d.eligibility_ltp_until || now < d.eligibility_ltd_until)) {
+      d.in_eligible_list = true;
+      eligible_syns.push_back(s);
+    }
+    return syn.confidence != old_confidence;
+  }
+
+  // Drop synapses whose eligibility windows have both closed
+  void compact_eligible() {
+    size_t out = 0;
+    for (int s : eligible_syns) {
+      SynapseDeadlines &d = synapses.deadlines[s];
+      if (global_tick < d.eligibility_ltp_until ||
+          global_tick < d.eligibility_ltd_until)
+        eligible_syns[out++] = s;
+      else
+        d.in_eligible_list = false;
+    }
+    eligible_syns.resize(out);
+  }
+
+  bool prune_entry_live(const PruneEntry &e) const {
+    return synapses.state[e.syn].plastic &&
+           synapses.deadlines[e.syn].last_ltp_tick == e.last_ltp_tick;
+  }
+
+  // Plastic synapse with the oldest last_ltp_tick, lowest id on ties: the
+  // first live entry once its tick's entries are sorted. The current tick's
+  // entries can still grow, so if they are all that is left they are
+  // scanned instead.
+  int oldest_ltp_synapse() {
+    std::vector<PruneEntry> &q = prune_queue;
+    for (;;) {
+      while (prune_head < q.size() && !prune_entry_live(q[prune_head]))
+        ++prune_head;
+      if (prune_head == q.size())
+        return -1;
+      if (prune_head < prune_sorted_end)
+        return q[prune_head].syn;
+
+      const int oldest = q[prune_head].last_ltp_tick;
+      if (oldest == global_tick) {
+        int worst_syn = q[prune_head].syn;
+        for (size_t k = prune_head + 1; k < q.size(); ++k) {
+          if (q[k].syn < worst_syn && prune_entry_live(q[k]))
+            worst_syn = q[k].syn;
+        }
+        return worst_syn;
+      }
+      size_t end = prune_head;
+      while (end < q.size() && q[end].last_ltp_tick == oldest)
+        ++end;
+      std::sort(q.begin() + prune_head, q.begin() + end,
+                [](const PruneEntry &a, const PruneEntry &b) {
+                  return a.syn < b.syn;
+                });
+      prune_sorted_end = end;
+    }
+  }
+
+  // Drop stale entries, keeping tick order
+  void compact_prune_queue() {
+    size_t out = 0;
+    size_t sorted_end = 0;
+    for (size_t k = prune_head; k < prune_queue.size(); ++k) {
+      if (prune_entry_live(prune_queue[k]))
+        prune_queue[out++] = prune_queue[k];
+      if (k < prune_sorted_end)
+        sorted_end = out;
+    }
+    prune_queue.resize(out);
+    prune_head = 0;
+    prune_sorted_end = sorted_end;
+  }
+
+  void build_event_index() {
+    int wheel_size = 1;
+    while (wheel_size <= rules.confidence_leak_period())
+      wheel_size <<= 1;
+    wheel_head.assign(wheel_size, -1);
+    wheel_tail.assign(wheel_size, -1);
+    leak_wheel_mask = wheel_size - 1;
+
+    eligible_syns.clear();
+    prune_queue.clear();
+    prune_head = 0;
+    for (int s = 0; s < synapses.size(); ++s) {
+      SynapseDeadlines &d = synapses.deadlines[s];
+      d.in_eligible_list = false;
+      d.wheel_next = WHEEL_UNQUEUED;
+      if (!synapses.state[s].plastic)
+        continue;
+      schedule_leak(s);
+      if (global_tick < d.eligibility_ltp_until ||
+          global_tick < d.eligibility_ltd_until) {
+        d.in_eligible_list = true;
+        eligible_syns.push_back(s);
+      }
+      prune_queue.push_back({d.last_ltp_tick, s});
+    }
+    prune_live = prune_queue.size();
+    prune_sorted_end = prune_live;
+    // Room for the busiest tick: every synapse touched, eligible and reset
+    // on top of a queue just short of compaction
+    touched.reserve(synapses.size());
+    eligible_syns.reserve(synapses.size());
+    prune_queue.reserve(2 * prune_live + 64 + synapses.size() + 1);
+    std::sort(prune_queue.begin(), prune_queue.end(),
+              [](const PruneEntry &a, const PruneEntry &b) {
+                return a.last_ltp_tick != b.last_ltp_tick
+                           ? a.last_ltp_tick < b.last_ltp_tick
+                           : a.syn < b.syn;
+              });
+    event_index_ready = true;
+  }
+
+  // Countdowns -> absolute deadlines, as of the end of global_tick
+  void sync_deadlines() {
+    const int now = global_tick;
+    synapses.deadlines.assign(synapses.size(), SynapseDeadlines());
+    for (int s = 0; s < synapses.size(); ++s) {
+      const DigitalSynapse &syn = synapses.state[s];
+      SynapseDeadlines &d = synapses.deadlines[s];
+      d.touch_tick = -1;
+      if (!syn.plastic)
+        continue;
+      d.ltp_until = now + syn.ltp_timer;
+      d.ltd_until = now + syn.ltd_timer;
+      d.eligibility_ltp_until =
+          syn.eligible_for_LTP ? now + syn.eligibility_ltp_timer : 0;
+      d.eligibility_ltd_until =
+          syn.eligible_for_LTD ? now + syn.eligibility_ltd_timer : 0;
+      d.reward_block_until =
+          syn.reward_acceptor ? 0 : now + syn.reward_inertia_counter;
+      d.penalty_block_until =
+          syn.penalty_acceptor ? 0 : now + syn.penalty_inertia_counter;
+      d.leak_due = now + syn.confidence_leak_timer;
+      d.last_ltp_tick = now - syn.ticks_since_ltp;
+    }
+  }
+
+  // Absolute deadlines -> countdowns, as of the end of global_tick. The
+  // deadline table is released afterwards.
+  void sync_countdowns() {
+    const int now = global_tick;
+    auto left = [now](int until) {
+      return static_cast<uint8_t>(std::max(0, until - now));
+    };
+    for (int s = 0; s < synapses.size(); ++s) {
+      DigitalSynapse &syn = synapses.state[s];
+      const SynapseDeadlines &d = synapses.deadlines[s];
+      if (!syn.plastic)
+        continue;
+      syn.ltp_timer = left(d.ltp_until);
+      syn.ltd_timer = left(d.ltd_until);
+      syn.eligibility_ltp_timer = left(d.eligibility_ltp_until);
+      syn.eligibility_ltd_timer = left(d.eligibility_ltd_until);
+      syn.eligible_for_LTP = syn.eligibility_ltp_timer > 0;
+      syn.eligible_for_LTD = syn.eligibility_ltd_timer > 0;
+      syn.reward_inertia_counter = left(d.reward_block_until);
+      syn.penalty_inertia_counter = left(d.penalty_block_until);
+      syn.reward_acceptor = syn.reward_inertia_counter == 0;
+      syn.penalty_acceptor = syn.penalty_inertia_counter == 0;
+      syn.confidence_leak_timer = static_cast<uint16_t>(d.leak_due - now);
+      syn.ticks_since_ltp = now - d.last_ltp_tick;
+    }
+    synapses.deadlines.clear();
+    synapses.deadlines.shrink_to_fit();
+  }
+
+  void trace_causal_chain(int motor_idx) {
+    if (!neurons.spiked(motor_idx))
+      return;
+
+    // We trace back to show what CAUSED the current motor spike.
+    // Limit depth to 12 for cleaner visualization (enough for direct paths).
+    const int n = static_cast<int>(neurons.size());
+    if (visited_stamp.empty()) {
+      visited_stamp.assign((MAX_TRACE + 1) * n, 0);
+      trace_stack.reserve((MAX_TRACE + 1) * n); // One push per visit
+    }
+    if (++trace_generation == 0) {
+      // Wrapped: old stamps could alias the new generation
+      std::fill(visited_stamp.begin(), visited_stamp.end(), 0);
+      trace_generation = 1;
+    }
+    auto visit = [&](int depth, int i) {
+      unsigned &stamp = visited_stamp[depth * n + i];
+      if (stamp == trace_generation)
+        return false;
+      stamp = trace_generation;
+      return true;
+    };
+
+    std::vector<TraceStep> &stack = trace_stack;
+    stack.clear();
+    stack.push_back({motor_idx, 0});
+    visit(0, motor_idx);
+
+    while (!stack.empty()) {
+      TraceStep p = stack.back();
+      stack.pop_back();
+
+      if (p.depth >= MAX_TRACE)
+        continue;
+
+      // Spike at depth 'p.depth' (time T - p.depth) was caused by signals
+      // sent at T - p.depth - 1
+      const HistorySlot &cause = history_at(global_tick - p.depth - 1);
+      const uint64_t *sent = spike_frame(global_tick - p.depth - 1);
+      for (int k = cause.head[p.idx]; k >= 0; k = cause.arena[k].next) {
+        const Contribution &c = cause.arena[k].c;
+        if (c.from_row >= 0 && c.from_row < (int)neurons.size()) {
+          DigitalSynapse &syn = synapses.state[c.syn_idx];
+          if (!syn.highlighted) {
+            syn.highlighted = true;
+            highlighted_syns.push_back(c.syn_idx);
+            if (track_changes)
+              mark_synapse(c.syn_idx, changes.synapses);
+          }
+
+          int next_depth = p.depth + 1;
+          // The sender must have spiked at T - next_depth, when it sent
+          if (next_depth <= MAX_TRACE) {
+            if (frame_test(sent, c.from_row) && visit(next_depth, c.from_row))
+              stack.push_back({c.from_row, next_depth});
+          }
+        }
+      }
+    }
+  }
+};
+
+// The 36-neuron agent brain with every bound known at compile time
+typedef SpikingNet<FixedTopology<BRAIN_SIZE>> DefaultNet;
+// Same brain without causal tracing, for headless and population runs
+typedef SpikingNet<FixedTopology<BRAIN_SIZE>, NoTrace> HeadlessNet;
+
+// --- World Simulation ---
+enum TargetType { NONE, FOOD, DANGER };
+
+struct WorldUpdateResult {
+  bool reward;
+  bool penalty;
+};
+
+struct World {
+  static const int SENSORS = 4; // Food left and right, danger left and right
+  static const int MOTORS = 2;  // Left, right
+
+  int size;
+  int agent_pos;
+  int target_pos;
+  TargetType target_type;
+  int target_timer;
+  int food_eaten;
+  int danger_hit;
+  int reward_mode; // 0: Normal, 1: Inverse, 2: All Danger, 3: All Reward
+  AgentRng rng; // Seed 42 for every agent: they all meet the same world
+
+  explicit World(int _reward_mode = 0, RngKind rng_kind = RNG_MT19937)
+      : size(WORLD_SIZE), agent_pos(WORLD_SIZE / 2), target_pos(0),
+        target_type(NONE), target_timer(0), food_eaten(0), danger_hit(0),
+        reward_mode(_reward_mode), rng(42, rng_kind) {}
+
+  // tick: Simulation::t, the position of the draws
+  void spawn_target(long long tick) {
+    rng.at(STREAM_WORLD, tick);
+    int choice = rng.uniform_int(0, 2);
+    target_timer = rng.uniform_int(3000, 5000);
+
+    // Reset agent to center on target change
+    agent_pos = size / 2;
+
+    if (choice == 2) {
+      target_type = NONE;
+      target_timer /= 3; // NONE phase is 3x shorter
+    } else {
+      target_type = (choice == 0) ? FOOD : DANGER;
+      // Randomly spawn at extreme left (0) or extreme right (size-1)
+      target_pos = (rng.uniform_int(0, 1) == 0) ? 0 : size - 1;
+    }
+  }
+
+  // By value and fixed size, so reading the sensors never allocates
+  std::array<int, SENSORS> get_sensors() const {
+    std::array<int, SENSORS> sensors = {0, 0, 0, 0};
     if (target_type == NONE)
       return sensors;
 
-    bool is_left = target_pos < agent_pos;
-    if (target_type == FOOD) {
-      sensors[0] = is_left ? 1 : 0;
-      sensors[1] = !is_left ? 1 : 0;
+    bool is_left = target_pos < agent_pos;
+    if (target_type == FOOD) {
+      sensors[0] = is_left ? 1 : 0;
+      sensors[1] = !is_left ? 1 : 0;
+    } else {
+      sensors[2] = is_left ? 1 : 0;
+      sensors[3] = !is_left ? 1 : 0;
+    }
+    return sensors;
+  }
+
+  WorldUpdateResult update(bool move_left, bool move_right, long long tick) {
+    if (target_timer <= 0)
+      spawn_target(tick);
+
+    int prev_dist = -1;
+    if (target_type != NONE) {
+      prev_dist = std::abs(agent_pos - target_pos);
+    }
+
+    if (move_left)
+      agent_pos--;
+    if (move_right)
+      agent_pos++;
+
+    // Teleport to center if out of bounds
+    if (agent_pos < 0 || agent_pos >= size) {
+      agent_pos = size / 2;
+      // If it was teleported, we skip reward/penalty for this specific frame
+      // to avoid weird distance jumps.
+      return {false, false};
+    }
+
+    WorldUpdateResult res = {false, false};
+    if (target_type != NONE) {
+      int curr_dist = std::abs(agent_pos - target_pos);
+      int mode = reward_mode;
+
+      // Determine if current target is "Edible" or "Hazardous" based on mode
+      bool is_hazardous = false;
+      if (target_type == FOOD) {
+        if (mode == 1 || mode == 2)
+          is_hazardous = true;
+      } else if (target_type == DANGER) {
+        if (mode == 0 || mode == 2)
+          is_hazardous = true;
+      }
+
+      if (is_hazardous) {
+        // Hazardous logic: avvicinarsi è male, allontanarsi è bene
+        if (curr_dist > prev_dist)
+          res.reward = true;
+        else if (curr_dist < prev_dist)
+          res.penalty = true;
+      } else {
+        // Edible logic: avvicinarsi è bene, allontanarsi è male
+        if (curr_dist < prev_dist)
+          res.reward = true;
+        else if (curr_dist > prev_dist)
+          res.penalty = true;
+      }
+
+      if (curr_dist == 0) {
+        if (!is_hazardous) {
+          food_eaten++;
+          res.reward = true;
+          res.penalty = false;
+        } else {
+          danger_hit++;
+          res.penalty = true;
+          res.reward = false;
+        }
+        // Reset agent to center without removing target
+        agent_pos = size / 2;
+      }
+    }
+
+    if (target_timer > 0) {
+      target_timer--;
+      if (target_timer <= 0)
+        target_type = NONE;
+    }
+
+    return res;
+  }
+};
+
+// The world drives sensors 0 to 3 and reads motors 0 and 1, so an agent's
+// topology must have that many; returns topo
+template <class Topology> const Topology &world_topology(const Topology &topo) {
+  if (topo.sensors() != World::SENSORS || topo.motors() != World::MOTORS)
+    throw std::invalid_argument("the world needs 4 sensors and 2 motors");
+  return topo;
+}
+
+// --- Agent Loop ---
+// One brain in one world plus the reward bookkeeping of the main loop. The
+// interactive and headless front ends both advance it with tick().
+template <class Net = DefaultNet> struct Simulation {
+  Net brain;
+  World world;
+  AgentRng rng;
+  std::vector<int> net_input;
+
+  int t;
+  bool current_reward; // Initially true during constant duration
+  bool current_penalty;
+  int reward_sum;
+  int penalty_sum;
+  int food_time;
+  int danger_time;
+
+  explicit Simulation(unsigned int seed, int reward_mode = 0,
+                      const typename Net::topology_type &topo =
+                          typename Net::topology_type(),
+                      const typename Net::rules_type &rules =
+                          typename Net::rules_type(),
+                      RngKind rng_kind = RNG_MT19937)
+      : brain(world_topology(topo), rules), world(reward_mode, rng_kind),
+        rng(seed, rng_kind),
+        net_input(brain.topo.size(), 0), t(0), current_reward(true),
+        current_penalty(false), reward_sum(0), penalty_sum(0), food_time(0),
+        danger_time(0) {
+    brain.connect_randomly(rng);
+  }
+
+  void tick() {
+    const bool timed = brain.stats.begin_tick();
+    const uint64_t start = timed ? stats_now_ns() : 0;
+    // 1. Sensors
+    auto sensors = world.get_sensors();
+    std::fill(net_input.begin(), net_input.end(), 0);
+    for (int i = 0; i < brain.topo.sensors(); ++i) {
+      net_input[i] = sensors[i];
+    }
+
+    // 1.5. Random wandering activity
+    const int period = brain.rules.random_activity_period();
+    if (period > 0 && t % period == 0) {
+      rng.at(STREAM_ACTIVITY, t);
+      for (int i = 0; i < RANDOM_ACTIVITY_COUNT; ++i) {
+        int rand_idx =
+            rng.uniform_int(brain.topo.hidden_begin(), brain.topo.size() - 1);
+        net_input[rand_idx]++;
+      }
+    }
+
+    // 2. Brain Step
+    bool force_reward = false;
+    brain.step(net_input, force_reward || current_reward,
+               (!force_reward) && current_penalty, rng);
+
+    // 3. Motors
+    bool m_left = brain.neurons.spiked(brain.topo.motor_begin());
+    bool m_right = brain.neurons.spiked(brain.topo.motor_begin() + 1);
+    if (m_left && m_right) {
+      m_left = false;
+      m_right = false;
+    }
+
+    // 4. World Update
+    PhaseClock clock(brain.stats);
+    auto res = world.update(m_left, m_right, t);
+    clock.lap(PHASE_WORLD);
+
+    // 5. Update Reward/Penalty for NEXT step
+    current_reward = res.reward;
+    current_penalty = res.penalty;
+    if (current_reward)
+      reward_sum++;
+    if (current_penalty)
+      penalty_sum++;
+    if (world.target_type == FOOD)
+      food_time++;
+    else if (world.target_type == DANGER)
+      danger_time++;
+    ++t;
+    if (timed) {
+      brain.stats.tick_ns.add(stats_now_ns() - start);
+      brain.stats.timing = false;
+    }
+  }
+};
+
+// --- Batch Engine ---
+// B agents advanced in lockstep by the dense rule, laid out for a data
+// parallel device: every per-synapse array holds field k of lane (agent) a
+// at [k * lanes + a], so the lanes of one launch read consecutive words.
+// Each lane's neurons are a NeuronStore of their own, so its neuron phase
+// runs the vector kernel. Each lane keeps its own CSR rows, with the
+// synapse ids of its SpikingNet, in slots of a common capacity. A launch
+// runs one tick or, since the worlds live alongside, many ticks per lane.
+// World and rng stay per-lane objects: they are used once per tick. The
+// reference is Simulation<SpikingNet<Topology, NoTrace, Rules>>;
+// --batch --conformance checks that both agree.
+template <class Topology = FixedTopology<BRAIN_SIZE>,
+          class Rules = DefaultRules>
+class AgentBatch {
+public:
+  typedef SpikingNet<Topology, NoTrace, Rules> Net;
+  typedef Simulation<Net> Agent;
+
+  // Loop state of one lane, as in Simulation
+  struct LaneLoop {
+    bool current_reward;
+    bool current_penalty;
+    int reward_sum;
+    int penalty_sum;
+    int food_time;
+    int danger_time;
+  };
+
+  Topology topo;
+  Rules rules;
+  int lanes;
+  int syn_capacity; // Synapse slots per lane: the largest lane's count
+  int t;            // Loop tick, shared by all lanes
+  int global_tick;  // Brain tick, shared by all lanes
+
+  std::vector<NeuronStore> neurons;   // Per lane
+  std::vector<int> net_input;         // [a * neurons + neuron]
+  std::vector<int> in_degree;         // [neuron * lanes + a]
+  std::vector<int> row_offsets;       // [row * lanes + a], size + 1 rows
+  std::vector<int> targets;           // [syn * lanes + a]
+  std::vector<unsigned char> active;  // [syn * lanes + a]
+  std::vector<DigitalSynapse> state;  // [syn * lanes + a]
+
+  std::vector<int> syn_count; // Per lane
+  std::vector<LaneLoop> loops;
+  std::vector<World> worlds;
+  std::vector<AgentRng> rngs;
+
+  AgentBatch(int _lanes, const Topology &_topo = Topology(),
+             const Rules &_rules = Rules())
+      : topo(world_topology(_topo)), rules(_rules), lanes(_lanes),
+        syn_capacity(0), t(0),
+        global_tick(0),
+        neurons(_lanes,
+                NeuronStore(topo.size(), rules.membrane_decay_period())),
+        net_input(static_cast<size_t>(topo.size()) * _lanes, 0),
+        in_degree(net_input.size(), 0),
+        row_offsets(static_cast<size_t>(topo.size() + 1) * _lanes, 0),
+        syn_count(_lanes, 0), loops(_lanes), worlds(_lanes), rngs(_lanes),
+        excluded(1) {}
+
+  size_t at(int k, int a) const {
+    return static_cast<size_t>(k) * lanes + a;
+  }
+
+  // Copies an agent into lane a. All lanes must be at the same tick.
+  void upload(int a, const Agent &sim) {
+    if (a == 0) {
+      t = sim.t;
+      global_tick = sim.brain.global_tick;
+    } else if (sim.t != t || sim.brain.global_tick != global_tick) {
+      throw std::invalid_argument("batch lanes must start at the same tick");
+    }
+    const SynapseStore &syn = sim.brain.synapses;
+    if (syn.size() > syn_capacity) {
+      // Slot k of every lane sits in block k, so growing only appends
+      syn_capacity = syn.size();
+      const size_t slots = static_cast<size_t>(syn_capacity) * lanes;
+      targets.resize(slots, 0);
+      active.resize(slots, 0);
+      state.resize(slots, DigitalSynapse(0, false));
+    }
+    neurons[a] = sim.brain.neurons;
+    for (int i = 0; i < topo.size(); ++i)
+      in_degree[at(i, a)] = syn.in_degree(i);
+    for (int i = 0; i <= topo.size(); ++i)
+      row_offsets[at(i, a)] = syn.row_offsets[i];
+    for (int s = 0; s < syn.size(); ++s) {
+      targets[at(s, a)] = syn.targets[s];
+      active[at(s, a)] = syn.active[s];
+      state[at(s, a)] = syn.state[s];
+    }
+    syn_count[a] = syn.size();
+    loops[a] = {sim.current_reward, sim.current_penalty, sim.reward_sum,
+                sim.penalty_sum,    sim.food_time,       sim.danger_time};
+    worlds[a] = sim.world;
+    rngs[a] = sim.rng;
+  }
+
+  // Copies lane a back into an agent built from the same seed, so that
+  // it continues on the CPU (dense engine) from where the lane is
+  void download(int a, Agent &sim) const {
+    Net &brain = sim.brain;
+    std::vector<SynapseStore::Edge> edges;
+    edges.reserve(syn_count[a]);
+    for (int i = 0; i < topo.size(); ++i) {
+      for (int s = row_offsets[at(i, a)]; s < row_offsets[at(i + 1, a)]; ++s)
+        edges.push_back({i, targets[at(s, a)], state[at(s, a)].confidence,
+                         static_cast<bool>(state[at(s, a)].plastic)});
+    }
+    brain.set_engine(DENSE);
+    brain.synapses.build(topo.size(), edges, rules.confidence_leak_period());
+    brain.reserve_for_synapses();
+    for (int s = 0; s < syn_count[a]; ++s) {
+      brain.synapses.state[s] = state[at(s, a)];
+      brain.synapses.active[s] = active[at(s, a)];
+    }
+    std::fill(brain.spike_frames.begin(), brain.spike_frames.end(), 0);
+    brain.global_tick = global_tick;
+    brain.neurons = neurons[a];
+    std::copy(brain.neurons.fired.begin(), brain.neurons.fired.end(),
+              brain.spike_frame(global_tick));
+    if (brain.track_changes)
+      brain.set_change_tracking(true);
+
+    const LaneLoop &loop = loops[a];
+    sim.current_reward = loop.current_reward;
+    sim.current_penalty = loop.current_penalty;
+    sim.reward_sum = loop.reward_sum;
+    sim.penalty_sum = loop.penalty_sum;
+    sim.food_time = loop.food_time;
+    sim.danger_time = loop.danger_time;
+    sim.world = worlds[a];
+    sim.rng = rngs[a];
+    sim.t = t;
+  }
+
+  // Split each launch across n threads, in contiguous blocks of lanes
+  void set_threads(int n) {
+    n = std::max(1, std::min(n, lanes));
+    if (n == (team ? team->lanes() : 1))
+      return;
+    team.reset(n > 1 ? new StepTeam(n) : nullptr);
+    excluded.resize(n);
+  }
+
+  // One launch: every lane advances ticks ticks
+  void run(int ticks) {
+    const int workers = team ? team->lanes() : 1;
+    auto kernel = [&](int w) {
+      const int begin = static_cast<int>(static_cast<long long>(lanes) * w /
+                                         workers);
+      const int end = static_cast<int>(static_cast<long long>(lanes) *
+                                       (w + 1) / workers);
+      for (int a = begin; a < end; ++a) {
+        for (int k = 0; k < ticks; ++k)
+          tick_lane(a, t + k, global_tick + k + 1, excluded[w]);
+      }
+    };
+    if (team)
+      team->run(kernel);
+    else
+      kernel(0);
+    t += ticks;
+    global_tick += ticks;
+  }
+
+  void tick() { run(1); }
+
+private:
+  std::unique_ptr<StepTeam> team;
+  std::vector<std::vector<int>> excluded; // Rewire scratch per thread
+
+  // Simulation::tick() with SpikingNet::step_dense() on lane a; loop_tick is
+  // the loop's t and brain_tick the brain's global_tick after its increment
+  void tick_lane(int a, int loop_tick, int brain_tick,
+                 std::vector<int> &scratch) {
+    const int n = topo.size();
+    World &world = worlds[a];
+    LaneLoop &loop = loops[a];
+    AgentRng &rng = rngs[a];
+
+    // 1. Sensors and random wandering activity
+    const std::array<int, World::SENSORS> sensors = world.get_sensors();
+    int *input = &net_input[static_cast<size_t>(a) * n];
+    std::fill(input, input + n, 0);
+    for (int i = 0; i < topo.sensors(); ++i)
+      input[i] = sensors[i];
+    const int period = rules.random_activity_period();
+    if (period > 0 && loop_tick % period == 0) {
+      rng.at(STREAM_ACTIVITY, loop_tick);
+      for (int i = 0; i < RANDOM_ACTIVITY_COUNT; ++i)
+        input[rng.uniform_int(topo.hidden_begin(), n - 1)]++;
+    }
+
+    // 2. Brain step: neurons, then propagation and plasticity in row order
+    NeuronStore &cells = neurons[a];
+    update_neuron_words(cells, 0, n, input, n, rules.v_thresh(),
+                        rules.membrane_decay_period(), nullptr);
+
+    StatCounts counts; // Not reported
+    int worst_syn = -1;
+    int worst_source = -1;
+    int max_inactive = -1;
+    for (int i = 0; i < n; ++i) {
+      const bool pre_spiked = cells.spiked(i);
+      for (int s = row_offsets[at(i, a)]; s < row_offsets[at(i + 1, a)];
+           ++s) {
+        const size_t k = at(s, a);
+        const int post = targets[k];
+        if (pre_spiked && active[k])
+          cells.input[post] += 1;
+        DigitalSynapse &syn = state[k];
+        if (!syn.plastic)
+          continue;
+        dense_synapse_rule(syn, active[k], pre_spiked, cells.spiked(post),
+                           loop.current_reward, loop.current_penalty, counts,
+                           rules);
+        if (syn.ticks_since_ltp > max_inactive) {
+          max_inactive = syn.ticks_since_ltp;
+          worst_syn = s;
+          worst_source = i;
+        }
+      }
+    }
+
+    // 2.5 Pruning
+    if (worst_syn >= 0 && brain_tick % rules.pruning_period() == 0)
+      rewire_lane(a, worst_syn, worst_source, brain_tick, scratch, rng);
+
+    // 3. Motors
+    bool m_left = cells.spiked(topo.motor_begin());
+    bool m_right = cells.spiked(topo.motor_begin() + 1);
+    if (m_left && m_right) {
+      m_left = false;
+      m_right = false;
+    }
+
+    // 4. World Update and reward/penalty for the next step
+    auto res = world.update(m_left, m_right, loop_tick);
+    loop.current_reward = res.reward;
+    loop.current_penalty = res.penalty;
+    if (loop.current_reward)
+      loop.reward_sum++;
+    if (loop.current_penalty)
+      loop.penalty_sum++;
+    if (world.target_type == FOOD)
+      loop.food_time++;
+    else if (world.target_type == DANGER)
+      loop.danger_time++;
+  }
+
+  // SpikingNet::rewire_synapse() on lane a
+  void rewire_lane(int a, int s, int source, int brain_tick,
+                   std::vector<int> &scratch, AgentRng &rng) {
+    const int lo = legal_target_begin(topo, source);
+    scratch.clear();
+    if (source >= lo)
+      scratch.push_back(source);
+    for (int k = row_offsets[at(source, a)];
+         k < row_offsets[at(source + 1, a)]; ++k) {
+      if (targets[at(k, a)] >= lo)
+        scratch.push_back(targets[at(k, a)]);
+    }
+    rng.at(STREAM_PRUNING, brain_tick);
+    int new_target = pick_rewire_target(lo, topo.size(), scratch, rng);
+    if (new_target < 0)
+      return;
+
+    const size_t k = at(s, a);
+    const int target = targets[k];
+    if (topo.is_motor_port(target) && in_degree[at(target, a)] <= 1)
+      new_target = target;
+    in_degree[at(target, a)]--;
+    in_degree[at(new_target, a)]++;
+    targets[k] = new_target;
+    reset_rewired_synapse(state[k]);
+    active[k] = (state[k].confidence >= CONFIDENCE_THR);
+  }
+};
+
+// --- Checkpoints ---
+// save_checkpoint() writes everything needed to continue a Simulation
+// bit-exactly: all neuron and synapse fields (including trace histories),
+// the CSR/CSC arrays, global_tick, the World, both rng states and the loop
+// counters. Layout, all little-endian:
+//   CheckpointHeader
+//   CheckpointSection[sections]
+//   section payloads, each at an 8-byte aligned offset
+// Sections are flat arrays of fixed-size records, so a mapped file can be
+// read in place; load_checkpoint() maps it and copies the arrays out. The
+// CKPT_SYNAPSES records are the in-memory DigitalSynapse layout: bump
+// CHECKPOINT_VERSION whenever that struct changes.
+const uint32_t CHECKPOINT_MAGIC = 0x43545352; // "RSTC"
+const uint16_t CHECKPOINT_VERSION = 1;
+
+enum CheckpointSectionId {
+  CKPT_COUNTERS = 1,   // CheckpointCounters[1]
+  CKPT_BRAIN_RNG,      // char[]: AgentRng::state_text()
+  CKPT_WORLD_RNG,      // char[]
+  CKPT_NEURONS,        // CheckpointNeuron[neurons]
+  // Per neuron: a reserved 0, then the contributions it received from
+  // each of the last MAX_HIST ticks, newest first
+  CKPT_CONTRIB_COUNTS, // u32[neurons * (MAX_HIST + 1)]
+  CKPT_CONTRIBS,       // Contribution[], in that order
+  CKPT_ROW_OFFSETS,    // i32[neurons + 1]
+  CKPT_TARGETS,        // i32[synapses]
+  CKPT_SOURCES,        // i32[synapses]
+  CKPT_ACTIVE,         // u8[synapses]
+  CKPT_SYNAPSES,       // DigitalSynapse[synapses]
+  CKPT_IN_OFFSETS,     // i32[neurons + 1]
+  CKPT_IN_SYN,         // i32[synapses]
+  CKPT_HIGHLIGHTED,    // i32[]: synapses lit by the last causal trace
+  CKPT_PARAMS,         // Params[1]: rule set the brain ran under (optional)
+  CKPT_SEED            // u32[1]: seed of the brain rng (optional)
+};
+
+struct CheckpointHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t header_bytes;
+  uint32_t sections;
+  uint32_t neurons;
+  uint32_t synapses;
+  uint32_t max_hist;
+};
+
+struct CheckpointSection {
+  uint32_t id;
+  uint32_t record_bytes;
+  uint64_t offset; // From the start of the file
+  uint64_t bytes;
+};
+
+struct CheckpointCounters {
+  int32_t global_tick;
+  int32_t t;
+  int32_t current_reward;
+  int32_t current_penalty;
+  int32_t reward_sum;
+  int32_t penalty_sum;
+  int32_t food_time;
+  int32_t danger_time;
+  int32_t world_size;
+  int32_t agent_pos;
+  int32_t target_pos;
+  int32_t target_type;
+  int32_t target_timer;
+  int32_t food_eaten;
+  int32_t danger_hit;
+  int32_t reward_mode;
+};
+
+struct CheckpointNeuron {
+  int32_t voltage;
+  int32_t refractory_timer;
+  int32_t input_buffer;
+  int32_t leak_timer;
+  uint32_t spike_history; // Bit h: spiked at global_tick - h
+  uint8_t spiked_this_step;
+  uint8_t pad[3];
+};
+
+static_assert(sizeof(CheckpointHeader) == 24, "checkpoint header layout");
+static_assert(sizeof(CheckpointSection) == 24, "checkpoint section layout");
+static_assert(sizeof(CheckpointNeuron) == 24, "checkpoint neuron layout");
+static_assert(sizeof(Contribution) == 8,
+              "checkpoint contribution layout");
+static_assert(MAX_HIST <= 32, "spike history fits 32 bits");
+static_assert(sizeof(Params) == 32, "checkpoint params layout");
+
+// Read-only view of a whole file: mmap where available, a plain read on
+// Windows. Throws std::runtime_error if the file cannot be read.
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &path) : bytes(nullptr), length(0) {
+#ifdef _WIN32
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in)
+      throw std::runtime_error("cannot open " + path);
+    buffer.resize(static_cast<size_t>(in.tellg()));
+    in.seekg(0);
+    if (!in.read(buffer.data(), buffer.size()))
+      throw std::runtime_error("cannot read " + path);
+    bytes = buffer.data();
+    length = buffer.size();
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("cannot open " + path);
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+      close(fd);
+      throw std::runtime_error("cannot stat " + path);
+    }
+    length = static_cast<size_t>(info.st_size);
+    if (length > 0) {
+      void *map = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error("cannot map " + path);
+      }
+      bytes = static_cast<const char *>(map);
+    }
+    close(fd);
+#endif
+  }
+
+  ~MappedFile() {
+#ifndef _WIN32
+    if (bytes)
+      munmap(const_cast<char *>(bytes), length);
+#endif
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const char *data() const { return bytes; }
+  size_t size() const { return length; }
+
+private:
+  const char *bytes;
+  size_t length;
+#ifdef _WIN32
+  std::vector<char> buffer;
+#endif
+};
+
+// Collects sections in memory, then writes header, table and payloads
+class CheckpointWriter {
+public:
+  template <class T> void add(uint32_t id, const T *data, size_t count) {
+    Pending p;
+    p.id = id;
+    p.record_bytes = sizeof(T);
+    p.bytes.assign(reinterpret_cast<const char *>(data),
+                   reinterpret_cast<const char *>(data) + count * sizeof(T));
+    pending.push_back(std::move(p));
+  }
+
+  template <class T> void add(uint32_t id, const std::vector<T> &v) {
+    add(id, v.data(), v.size());
+  }
+
+  void add_text(uint32_t id, const std::string &text) {
+    add(id, text.data(), text.size());
+  }
+
+  void write(const std::string &path, uint32_t neurons, uint32_t synapses) {
+    CheckpointHeader header;
+    header.magic = CHECKPOINT_MAGIC;
+    header.version = CHECKPOINT_VERSION;
+    header.header_bytes = sizeof(CheckpointHeader);
+    header.sections = static_cast<uint32_t>(pending.size());
+    header.neurons = neurons;
+    header.synapses = synapses;
+    header.max_hist = MAX_HIST;
+
+    std::vector<CheckpointSection> table(pending.size());
+    uint64_t offset = align8(sizeof(CheckpointHeader) +
+                             table.size() * sizeof(CheckpointSection));
+    for (size_t k = 0; k < pending.size(); ++k) {
+      table[k].id = pending[k].id;
+      table[k].record_bytes = pending[k].record_bytes;
+      table[k].offset = offset;
+      table[k].bytes = pending[k].bytes.size();
+      offset = align8(offset + table[k].bytes);
+    }
+
+    // Write to a temporary name first so a crash never truncates the
+    // previous checkpoint
+    const std::string tmp = path + ".tmp";
+    {
+      std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+      if (!out)
+        throw std::runtime_error("cannot write " + tmp);
+      out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+      out.write(reinterpret_cast<const char *>(table.data()),
+                table.size() * sizeof(CheckpointSection));
+      uint64_t at = sizeof(header) + table.size() * sizeof(CheckpointSection);
+      static const char zeros[8] = {0};
+      for (size_t k = 0; k < pending.size(); ++k) {
+        out.write(zeros, table[k].offset - at);
+        out.write(pending[k].bytes.data(), pending[k].bytes.size());
+        at = table[k].offset + table[k].bytes;
+      }
+      if (!out)
+        throw std::runtime_error("cannot write " + tmp);
+    }
+#ifdef _WIN32
+    std::remove(path.c_str()); // rename() does not replace there
+#endif
+    if (std::rename(tmp.c_str(), path.c_str()) != 0)
+      throw std::runtime_error("cannot rename " + tmp + " to " + path);
+  }
+
+  static uint64_t align8(uint64_t v) { return (v + 7) & ~uint64_t(7); }
+
+private:
+  struct Pending {
+    uint32_t id;
+    uint32_t record_bytes;
+    std::vector<char> bytes;
+  };
+  std::vector<Pending> pending;
+};
+
+// Validated section lookup over a mapped checkpoint
+class CheckpointReader {
+public:
+  explicit CheckpointReader(const std::string &path) : file(path) {
+    if (file.size() < sizeof(CheckpointHeader))
+      throw std::runtime_error(path + ": not a checkpoint");
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (header.magic != CHECKPOINT_MAGIC)
+      throw std::runtime_error(path + ": not a checkpoint");
+    if (header.version != CHECKPOINT_VERSION)
+      throw std::runtime_error(path + ": unsupported checkpoint version " +
+                               std::to_string(header.version));
+    if (header.max_hist != MAX_HIST)
+      throw std::runtime_error(path + ": different trace history length");
+    const uint64_t table_end =
+        header.header_bytes +
+        uint64_t(header.sections) * sizeof(CheckpointSection);
+    if (table_end > file.size())
+      throw std::runtime_error(path + ": truncated checkpoint");
+    table.resize(header.sections);
+    std::memcpy(table.data(), file.data() + header.header_bytes,
+                table.size() * sizeof(CheckpointSection));
+    for (const CheckpointSection &sec : table)
+      if (sec.offset + sec.bytes > file.size())
+        throw std::runtime_error(path + ": truncated checkpoint");
+  }
+
+  // Copies section id into out; its size must be a multiple of T, and
+  // exactly count records when count >= 0
+  template <class T>
+  void read(uint32_t id, std::vector<T> &out, long long count = -1) const {
+    const CheckpointSection &sec = find(id);
+    if (sec.record_bytes != sizeof(T) || sec.bytes % sizeof(T) != 0 ||
+        (count >= 0 && sec.bytes != count * sizeof(T)))
+      throw std::runtime_error("checkpoint section " + std::to_string(id) +
+                               " has the wrong size");
+    out.resize(sec.bytes / sizeof(T));
+    if (sec.bytes > 0)
+      std::memcpy(out.data(), file.data() + sec.offset, sec.bytes);
+  }
+
+  std::string read_text(uint32_t id) const {
+    const CheckpointSection &sec = find(id);
+    return std::string(file.data() + sec.offset, sec.bytes);
+  }
+
+  bool has(uint32_t id) const {
+    for (const CheckpointSection &sec : table)
+      if (sec.id == id)
+        return true;
+    return false;
+  }
+
+  CheckpointHeader header;
+
+private:
+  const CheckpointSection &find(uint32_t id) const {
+    for (const CheckpointSection &sec : table)
+      if (sec.id == id)
+        return sec;
+    throw std::runtime_error("checkpoint section " + std::to_string(id) +
+                             " missing");
+  }
+
+  MappedFile file;
+  std::vector<CheckpointSection> table;
+};
+
+void rng_from_text(AgentRng &rng, const std::string &text) {
+  if (!rng.set_state_text(text))
+    throw std::runtime_error("checkpoint rng state is corrupt");
+}
+
+// The event engine keeps its timers as deadlines; they are folded back into
+// the DigitalSynapse countdowns for the file and rebuilt afterwards
+template <class Net>
+void save_checkpoint(Simulation<Net> &sim, const std::string &path) {
+  Net &net = sim.brain;
+  const Engine engine = net.engine;
+  net.set_engine(DENSE);
+
+  const int n = static_cast<int>(net.neurons.size());
+  const SynapseStore &syns = net.synapses;
+
+  CheckpointCounters c;
+  c.global_tick = net.global_tick;
+  c.t = sim.t;
+  c.current_reward = sim.current_reward;
+  c.current_penalty = sim.current_penalty;
+  c.reward_sum = sim.reward_sum;
+  c.penalty_sum = sim.penalty_sum;
+  c.food_time = sim.food_time;
+  c.danger_time = sim.danger_time;
+  c.world_size = sim.world.size;
+  c.agent_pos = sim.world.agent_pos;
+  c.target_pos = sim.world.target_pos;
+  c.target_type = sim.world.target_type;
+  c.target_timer = sim.world.target_timer;
+  c.food_eaten = sim.world.food_eaten;
+  c.danger_hit = sim.world.danger_hit;
+  c.reward_mode = sim.world.reward_mode;
+
+  std::vector<CheckpointNeuron> cells(n);
+  std::vector<uint32_t> contrib_counts;
+  std::vector<Contribution> contribs;
+  contrib_counts.reserve(n * (MAX_HIST + 1));
+  for (int i = 0; i < n; ++i) {
+    CheckpointNeuron &cell = cells[i];
+    std::memset(&cell, 0, sizeof(cell));
+    cell.voltage = net.neurons.voltage[i];
+    cell.refractory_timer = net.neurons.refractory[i];
+    cell.input_buffer = net.neurons.input[i];
+    cell.leak_timer = net.neurons.leak[i];
+    cell.spiked_this_step = net.neurons.spiked(i);
+
+    // Untraced nets have no contributions to save
+    contrib_counts.push_back(0);
+    for (int h = 0; h < MAX_HIST; ++h) {
+      if (frame_test(net.spike_frame(net.global_tick - h), i))
+        cell.spike_history |= 1u << h;
+      if (!net.trace_on()) {
+        contrib_counts.push_back(0);
+        continue;
+      }
+      const HistorySlot &slot = net.history_at(net.global_tick - h);
+      uint32_t count = 0;
+      for (int k = slot.head[i]; k >= 0; k = slot.arena[k].next, ++count)
+        contribs.push_back(slot.arena[k].c);
+      contrib_counts.push_back(count);
+    }
+  }
+
+  CheckpointWriter out;
+  out.add(CKPT_COUNTERS, &c, 1);
+  out.add_text(CKPT_BRAIN_RNG, sim.rng.state_text());
+  out.add_text(CKPT_WORLD_RNG, sim.world.rng.state_text());
+  out.add(CKPT_NEURONS, cells);
+  out.add(CKPT_CONTRIB_COUNTS, contrib_counts);
+  out.add(CKPT_CONTRIBS, contribs);
+  out.add(CKPT_ROW_OFFSETS, syns.row_offsets);
+  out.add(CKPT_TARGETS, syns.targets);
+  out.add(CKPT_SOURCES, syns.sources);
+  out.add(CKPT_ACTIVE, syns.active);
+  out.add(CKPT_SYNAPSES, syns.state);
+  out.add(CKPT_IN_OFFSETS, syns.in_offsets);
+  out.add(CKPT_IN_SYN, syns.in_syn);
+  out.add(CKPT_HIGHLIGHTED, net.highlighted_syns);
+  out.add(CKPT_PARAMS, &net.rules.params(), 1);
+  const uint32_t seed = sim.rng.seed_used();
+  out.add(CKPT_SEED, &seed, 1);
+
+  net.set_engine(engine);
+  out.write(path, n, syns.size());
+}
+
+// Replaces the state of sim with the checkpoint at path. The brain must
+// have the checkpoint's neuron count (pass --neurons for large brains);
+// engine, threads and change tracking keep their current settings. Throws
+// std::runtime_error and leaves sim untouched if the file does not fit.
+// Returns false if the file predates CKPT_SEED and holds an mt19937 state,
+// whose seed is then unknown (sim.rng.seed_used() is not it).
+template <class Net>
+bool load_checkpoint(Simulation<Net> &sim, const std::string &path) {
+  CheckpointReader in(path);
+  const int n = static_cast<int>(in.header.neurons);
+  const long long m = in.header.synapses;
+  if (n != static_cast<int>(sim.brain.neurons.size()))
+    throw std::runtime_error(path + ": checkpoint has " + std::to_string(n) +
+                             " neurons, the brain " +
+                             std::to_string(sim.brain.neurons.size()));
+
+  // Read and check everything before touching sim
+  std::vector<CheckpointCounters> counters;
+  std::vector<CheckpointNeuron> cells;
+  std::vector<uint32_t> contrib_counts;
+  std::vector<Contribution> contribs;
+  SynapseStore syns;
+  std::vector<int> highlighted;
+  in.read(CKPT_COUNTERS, counters, 1);
+  in.read(CKPT_NEURONS, cells, n);
+  in.read(CKPT_CONTRIB_COUNTS, contrib_counts,
+          n * (MAX_HIST + 1LL));
+  in.read(CKPT_CONTRIBS, contribs);
+  in.read(CKPT_ROW_OFFSETS, syns.row_offsets, n + 1);
+  in.read(CKPT_TARGETS, syns.targets, m);
+  in.read(CKPT_SOURCES, syns.sources, m);
+  in.read(CKPT_ACTIVE, syns.active, m);
+  in.read(CKPT_SYNAPSES, syns.state, m);
+  in.read(CKPT_IN_OFFSETS, syns.in_offsets, n + 1);
+  in.read(CKPT_IN_SYN, syns.in_syn, m);
+  in.read(CKPT_HIGHLIGHTED, highlighted);
+  // Older checkpoints ran under the defaults
+  std::vector<Params> saved_params(1, DEFAULT_PARAMS);
+  if (in.has(CKPT_PARAMS))
+    in.read(CKPT_PARAMS, saved_params, 1);
+  std::vector<uint32_t> saved_seed;
+  if (in.has(CKPT_SEED))
+    in.read(CKPT_SEED, saved_seed, 1);
+  unsigned long long listed = 0;
+  bool ok = true;
+  for (size_t k = 0; k < contrib_counts.size(); ++k) {
+    listed += contrib_counts[k];
+    if (k % (MAX_HIST + 1) == 0)
+      ok = ok && contrib_counts[k] == 0;
+  }
+  ok = ok && listed == contribs.size() && syns.row_offsets[0] == 0 &&
+       syns.row_offsets[n] == m && syns.in_offsets[0] == 0 &&
+       syns.in_offsets[n] == m;
+  for (int i = 0; ok && i < n; ++i)
+    ok = syns.row_offsets[i] <= syns.row_offsets[i + 1] &&
+         syns.in_offsets[i] <= syns.in_offsets[i + 1];
+  for (long long s = 0; ok && s < m; ++s)
+    ok = syns.targets[s] >= 0 && syns.targets[s] < n &&
+         syns.sources[s] >= 0 && syns.sources[s] < n && syns.in_syn[s] >= 0 &&
+         syns.in_syn[s] < m;
+  // Both indices must list every synapse once, where its source and target
+  // say (SynapseStore::retarget looks for a synapse in its target's column)
+  std::vector<unsigned char> listed_in(ok ? m : 0, 0);
+  for (int i = 0; ok && i < n; ++i) {
+    for (int s = syns.row_offsets[i]; ok && s < syns.row_offsets[i + 1]; ++s)
+      ok = syns.sources[s] == i;
+    for (int p = syns.in_offsets[i]; ok && p < syns.in_offsets[i + 1]; ++p) {
+      const int s = syns.in_syn[p];
+      ok = syns.targets[s] == i && !listed_in[s];
+      listed_in[s] = 1;
+    }
+  }
+  for (const auto &con : contribs)
+    ok = ok && con.from_row >= 0 && con.from_row < n && con.syn_idx >= 0 &&
+         con.syn_idx < m;
+  for (int hs : highlighted)
+    ok = ok && hs >= 0 && hs < m;
+  // Within the NeuronStore's field types
+  for (const CheckpointNeuron &cell : cells)
+    ok = ok && cell.voltage >= INT16_MIN && cell.voltage <= INT16_MAX &&
+         cell.refractory_timer >= 0 && cell.refractory_timer <= UINT8_MAX &&
+         cell.leak_timer >= 0 && cell.leak_timer <= UINT16_MAX;
+  if (!ok)
+    throw std::runtime_error(path + ": inconsistent checkpoint");
+  AgentRng brain_rng(saved_seed.empty() ? 0 : saved_seed[0]), world_rng;
+  rng_from_text(brain_rng, in.read_text(CKPT_BRAIN_RNG));
+  rng_from_text(world_rng, in.read_text(CKPT_WORLD_RNG));
+
+  Net &net = sim.brain;
+  // Allowed (a trained brain may be explored under other rules), but the
+  // run is then not a continuation of the saved one
+  if (saved_params[0] != net.rules.params()) {
+    LOG_AT(LOG_WARN, path + ": saved under other rule parameters");
+    std::cerr << "[CPP] " << path
+              << ": saved under other rule parameters, continuing with "
+                 "the current ones"
+              << std::endl;
+  }
+  const Engine engine = net.engine;
+  net.set_engine(DENSE);
+
+  const CheckpointCounters &c = counters[0];
+  net.global_tick = c.global_tick;
+  sim.t = c.t;
+  sim.current_reward = c.current_reward != 0;
+  sim.current_penalty = c.current_penalty != 0;
+  sim.reward_sum = c.reward_sum;
+  sim.penalty_sum = c.penalty_sum;
+  sim.food_time = c.food_time;
+  sim.danger_time = c.danger_time;
+  sim.world.size = c.world_size;
+  sim.world.agent_pos = c.agent_pos;
+  sim.world.target_pos = c.target_pos;
+  sim.world.target_type = static_cast<TargetType>(c.target_type);
+  sim.world.target_timer = c.target_timer;
+  sim.world.food_eaten = c.food_eaten;
+  sim.world.danger_hit = c.danger_hit;
+  sim.world.rng = world_rng;
+  sim.rng = brain_rng;
+  // reward_mode stays as configured ('mode' / --mode); the saved one is
+  // only informational
+
+  for (HistorySlot &slot : net.history)
+    slot.resize(n);
+  std::fill(net.spike_frames.begin(), net.spike_frames.end(), 0);
+  size_t next = 0, list = 0;
+  net.spiked.clear();
+  for (int i = 0; i < n; ++i) {
+    NeuronStore &nr = net.neurons;
+    const CheckpointNeuron &cell = cells[i];
+    nr.voltage[i] = static_cast<int16_t>(cell.voltage);
+    nr.refractory[i] = static_cast<uint8_t>(cell.refractory_timer);
+    nr.input[i] = cell.input_buffer;
+    nr.leak[i] = static_cast<uint16_t>(cell.leak_timer);
+    nr.set_spiked(i, cell.spiked_this_step != 0);
+    ++list; // Reserved
+    for (int h = 0; h < MAX_HIST; ++h) {
+      if ((cell.spike_history >> h) & 1)
+        frame_set(net.spike_frame(net.global_tick - h), i);
+      if (!net.trace_on()) {
+        next += contrib_counts[list++];
+        continue;
+      }
+      HistorySlot &slot = net.history_at(net.global_tick - h);
+      for (uint32_t k = contrib_counts[list++]; k > 0; --k, ++next)
+        slot.add(i, contribs[next].from_row, contribs[next].syn_idx);
+    }
+    if (nr.spiked(i))
+      net.spiked.push_back(i);
+  }
+
+  net.synapses = std::move(syns);
+  net.highlighted_syns = std::move(highlighted);
+  net.reserve_for_synapses();
+  net.event_index_ready = false;
+  net.set_engine(engine);
+  if (net.track_changes)
+    net.set_change_tracking(true);
+  return !saved_seed.empty() || brain_rng.rng_kind() == RNG_PHILOX;
+}
+
+// --- Record and Replay ---
+// An interactive session is a pure function of the brain seed of each run
+// and of the settings the simulation thread applied between ticks, so that
+// is all the recorder keeps (speed, pause and fps only change pacing).
+// Every --record-interval ticks it also saves a checkpoint and indexes it,
+// so replay_recording() can start from the last checkpoint before the
+// target tick instead of from tick 0.
+// File layout, little-endian: u32 magic "RSTR", u16 version, u16 reserved,
+// then RecordHeader records, each followed by text_bytes of text. Records
+// are flushed as they are written, so a crashed session is still usable.
+const uint32_t RECORD_MAGIC = 0x52545352; // "RSTR"
+const uint16_t RECORD_VERSION = 1;
+
+enum RecordKind {
+  REC_RUN = 1,    // value: brain seed; starts a run at tick 0
+  REC_MODE,       // value: reward mode applied from this tick on
+  REC_ENGINE,     // value: Engine
+  REC_LOAD,       // text: checkpoint loaded at this tick
+  REC_CHECKPOINT, // text: checkpoint of the state at this tick (index)
+};
+
+struct RecordHeader {
+  uint32_t kind;
+  uint32_t text_bytes;
+  int64_t tick; // Simulation::t the record applies to
+  int64_t value;
+};
+
+static_assert(sizeof(RecordHeader) == 24, "record layout");
+
+struct RecordEvent {
+  int kind;
+  long long tick;
+  long long value;
+  std::string text;
+};
+
+class Recorder {
+public:
+  explicit Recorder(const std::string &_path)
+      : path(_path), out(_path, std::ios::binary | std::ios::trunc),
+        runs(0) {
+    if (!out)
+      throw std::runtime_error("cannot write " + path);
+    const uint32_t magic = RECORD_MAGIC;
+    const uint16_t version = RECORD_VERSION, reserved = 0;
+    out.write(reinterpret_cast<const char *>(&magic), sizeof(magic));
+    out.write(reinterpret_cast<const char *>(&version), sizeof(version));
+    out.write(reinterpret_cast<const char *>(&reserved), sizeof(reserved));
+    out.flush();
+  }
+
+  void write(int kind, long long tick, long long value,
+             const std::string &text = std::string()) {
+    RecordHeader rec;
+    rec.kind = kind;
+    rec.text_bytes = static_cast<uint32_t>(text.size());
+    rec.tick = tick;
+    rec.value = value;
+    out.write(reinterpret_cast<const char *>(&rec), sizeof(rec));
+    out.write(text.data(), text.size());
+    out.flush();
+    if (kind == REC_RUN)
+      ++runs;
+  }
+
+  // Where the index checkpoint of the current run at tick goes
+  std::string checkpoint_path(long long tick) const {
+    return path + ".r" + std::to_string(runs) + ".t" + std::to_string(tick) +
+           ".ck";
+  }
+
+private:
+  std::string path;
+  std::ofstream out;
+  int runs;
+};
+
+std::vector<RecordEvent> read_recording(const std::string &path) {
+  std::ifstream in(path, std::ios::binary);
+  uint32_t magic = 0;
+  uint16_t version = 0, reserved = 0;
+  in.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+  in.read(reinterpret_cast<char *>(&version), sizeof(version));
+  in.read(reinterpret_cast<char *>(&reserved), sizeof(reserved));
+  if (!in || magic != RECORD_MAGIC)
+    throw std::runtime_error(path + ": not a recording");
+  if (version != RECORD_VERSION)
+    throw std::runtime_error(path + ": unsupported recording version " +
+                             std::to_string(version));
+
+  std::vector<RecordEvent> events;
+  RecordHeader rec;
+  // A record cut short by a crash ends the recording
+  while (in.read(reinterpret_cast<char *>(&rec), sizeof(rec))) {
+    RecordEvent e;
+    e.kind = rec.kind;
+    e.tick = rec.tick;
+    e.value = rec.value;
+    e.text.resize(rec.text_bytes);
+    if (!in.read(&e.text[0], rec.text_bytes))
+      break;
+    events.push_back(std::move(e));
+  }
+  return events;
+}
+
+// Re-executes run number run (1-based) of a recording at full speed and
+// returns the simulation as of tick target (-1: the last recorded event).
+// Replay starts from the last indexed checkpoint that comes before the
+// target, so a seek costs at most one --record-interval of ticks. Throws
+// std::runtime_error if the run or a checkpoint it needs is missing.
+std::unique_ptr<Simulation<>> replay_recording(const std::string &path,
+                                               int run, long long target) {
+  const std::vector<RecordEvent> events = read_recording(path);
+  size_t begin = events.size(), end = events.size();
+  for (size_t k = 0, seen = 0; k < events.size(); ++k) {
+    if (events[k].kind != REC_RUN)
+      continue;
+    if (++seen == static_cast<size_t>(run))
+      begin = k;
+    else if (begin < events.size()) {
+      end = k;
+      break;
+    }
+  }
+  if (begin == events.size())
+    throw std::runtime_error(path + ": no run " + std::to_string(run));
+  if (target < 0)
+    target = events[end - 1].tick;
+
+  // Events up to the target tick; an index checkpoint at the target itself
+  // was taken before that tick's records
+  size_t stop = end;
+  for (size_t k = begin + 1; k < end; ++k) {
+    const RecordEvent &e = events[k];
+    if (e.tick > target || (e.tick == target && e.kind != REC_CHECKPOINT)) {
+      stop = k;
+      break;
+    }
+  }
+  size_t resume = begin; // Checkpoint the replay starts from
+  for (size_t k = begin + 1; k < stop; ++k)
+    if (events[k].kind == REC_CHECKPOINT)
+      resume = k;
+
+  std::unique_ptr<Simulation<>> sim;
+  int mode = 0;
+  Engine engine = DENSE;
+  auto advance = [&](long long tick) {
+    sim->brain.set_engine(engine);
+    sim->world.reward_mode = mode;
+    while (sim->t < tick) {
+      // Highlights need only the history the target tick can trace
+      sim->brain.set_tracing(sim->t >= target - MAX_HIST - 1);
+      sim->tick();
+    }
+  };
+  for (size_t k = begin; k < stop; ++k) {
+    const RecordEvent &e = events[k];
+    // Settings still apply before the resume point; state comes from it
+    if (k < resume && e.kind != REC_RUN && e.kind != REC_MODE &&
+        e.kind != REC_ENGINE)
+      continue;
+    if (k > resume)
+      advance(e.tick);
+    switch (e.kind) {
+    case REC_RUN:
+      sim.reset(new Simulation<>(static_cast<unsigned int>(e.value), mode));
+      break;
+    case REC_MODE:
+      mode = static_cast<int>(e.value);
+      break;
+    case REC_ENGINE:
+      engine = static_cast<Engine>(e.value);
+      break;
+    case REC_LOAD:
+      load_checkpoint(*sim, e.text);
+      break;
+    case REC_CHECKPOINT:
+      if (k == resume)
+        load_checkpoint(*sim, e.text);
+      break;
+    }
+  }
+  advance(target);
+  return sim;
+}
+
+// One command and its arguments, read from 'in' (stdin, or a WebSocket
+// message in --serve mode). Returns false after 'stop'.
+bool handle_command(const std::string &cmd, std::istream &in) {
+  log_to_file("Received command: " + cmd);
+  std::cerr << "[CPP] Received command: " << cmd << std::endl;
+  if (cmd == "stop") {
+    g_running = false;
+    g_control.notify();
+    return false;
+  } else if (cmd == "pause") {
+    g_paused = true;
+  } else if (cmd == "resume" || cmd == "start") {
+    g_paused = false;
+  } else if (cmd == "reset") {
+    g_reset = true;
+  } else if (cmd == "speed") {
+    int val;
+    if (in >> val) {
+      log_to_file("Speed value received: " + std::to_string(val));
+      std::cerr << "[CPP] Speed value: " << val << std::endl;
+      if (val < 0)
+        val = 0;
+      g_delay_ms = val;
+    }
+  } else if (cmd == "mode") {
+    int val;
+    if (in >> val) {
+      log_to_file("Reward mode received: " + std::to_string(val));
+      std::cerr << "[CPP] Reward mode: " << val << std::endl;
+      if (val < 0)
+        val = 0;
+      if (val > 3)
+        val = 3;
+      g_reward_mode = val;
+    }
+  } else if (cmd == "fps") {
+    int val;
+    if (in >> val) {
+      log_to_file("Frame rate received: " + std::to_string(val));
+      std::cerr << "[CPP] Frame rate: " << val << std::endl;
+      if (val < 0)
+        val = 0;
+      if (val > 1000)
+        val = 1000;
+      g_fps = val;
+    }
+  } else if (cmd == "trace") {
+    int val;
+    if (in >> val) {
+      log_to_file("Tracing received: " + std::to_string(val));
+      std::cerr << "[CPP] Tracing: " << val << std::endl;
+      g_trace = val != 0;
+    }
+  } else if (cmd == "step") {
+    long long val;
+    if (in >> val) {
+      log_to_file("Step received: " + std::to_string(val));
+      std::cerr << "[CPP] Step: " << val << std::endl;
+      g_paused = true;
+      if (val > 0)
+        g_step_ticks += val;
+    }
+  } else if (cmd == "keyframe") {
+    g_keyframe_request = true;
+  } else if (cmd == "stats") {
+    g_stats_request = true;
+  } else if (cmd == "engine") {
+    std::string val;
+    if (in >> val) {
+      log_to_file("Engine received: " + val);
+      std::cerr << "[CPP] Engine: " << val << std::endl;
+      g_engine = (val == "event") ? EVENT : DENSE;
+    }
+  } else if (cmd == "save" || cmd == "load") {
+    // Done by the simulation thread between ticks
+    std::string path;
+    if (in >> path) {
+      log_to_file("Checkpoint " + cmd + " requested: " + path);
+      std::cerr << "[CPP] Checkpoint " << cmd << ": " << path << std::endl;
+      std::lock_guard<std::mutex> lock(g_checkpoint_mutex);
+      (cmd == "save" ? g_save_path : g_load_path) = path;
+      g_checkpoint_request = true;
+    }
+  }
+  g_control.notify();
+  return true;
+}
+
+void input_listener() {
+  std::string cmd;
+  while (std::cin >> cmd) {
+    if (!handle_command(cmd, std::cin))
+      break;
+  }
+}
+
+// --- State Snapshots ---
+// Copy of everything a frame shows, taken between ticks only when the
+// publisher asks for one (see SnapshotExchange)
+struct StateSnapshot {
+  int run; // Bumped on reset; a new run starts with a keyframe
+  int tick;
+  bool reward;
+  bool penalty;
+  int reward_sum;
+  int penalty_sum;
+  int food_time;
+  int danger_time;
+  int agent;
+  int target;
+  int target_type;
+  int food;
+  int danger;
+  int dist;
+
+  std::vector<int> voltage;
+  std::vector<unsigned char> spiked;
+  std::vector<int> out_degree; // Synapses are listed row by row
+  std::vector<int> targets;
+  std::vector<unsigned char> syn_state; // SNAP_* bits
+
+  // Changes since the previous snapshot (if the net tracks them)
+  std::vector<int> changed_neurons;
+  std::vector<int> changed_synapses;
+  std::vector<int> rewired;
+
+  std::string stats; // format_stats() JSON when a report is due, else empty
+
+  int neuron_count() const { return static_cast<int>(voltage.size()); }
+  int synapse_count() const { return static_cast<int>(targets.size()); }
+};
+
+enum SnapshotSynapseBits {
+  SNAP_CONFIDENCE = 0x0F,
+  SNAP_ACTIVE = 0x10,
+  SNAP_HIGHLIGHTED = 0x20
+};
+
+// Fills snap from sim and starts a new change set, so consecutive snapshots
+// carry consecutive deltas
+template <class Net>
+void capture_snapshot(StateSnapshot &snap, Simulation<Net> &sim, int run) {
+  const uint64_t start = ENABLE_STATS ? stats_now_ns() : 0;
+  const Net &net = sim.brain;
+  const World &world = sim.world;
+  const SynapseStore &syns = net.synapses;
+  const int n = static_cast<int>(net.neurons.size());
+
+  snap.run = run;
+  snap.tick = sim.t;
+  snap.reward = sim.current_reward;
+  snap.penalty = sim.current_penalty;
+  snap.reward_sum = sim.reward_sum;
+  snap.penalty_sum = sim.penalty_sum;
+  snap.food_time = sim.food_time;
+  snap.danger_time = sim.danger_time;
+  snap.agent = world.agent_pos;
+  snap.target = world.target_pos;
+  snap.target_type = world.target_type;
+  snap.food = world.food_eaten;
+  snap.danger = world.danger_hit;
+  snap.dist = (world.target_type != NONE)
+                  ? std::abs(world.agent_pos - world.target_pos)
+                  : 0;
+
+  snap.voltage.resize(n);
+  snap.spiked.resize(n);
+  snap.out_degree.resize(n);
+  for (int i = 0; i < n; ++i) {
+    snap.voltage[i] = net.neurons.voltage[i];
+    snap.spiked[i] = net.neurons.spiked(i);
+    snap.out_degree[i] = syns.row_end(i) - syns.row_begin(i);
+  }
+  snap.targets.assign(syns.targets.begin(), syns.targets.end());
+  snap.syn_state.resize(syns.size());
+  for (int s = 0; s < syns.size(); ++s)
+    snap.syn_state[s] = static_cast<unsigned char>(
+        syns.state[s].confidence | (syns.active[s] ? SNAP_ACTIVE : 0) |
+        (syns.state[s].highlighted ? SNAP_HIGHLIGHTED : 0));
+
+  snap.changed_neurons = net.changes.neurons;
+  snap.changed_synapses = net.changes.synapses;
+  snap.rewired = net.changes.rewired;
+  sim.brain.clear_changes();
+  snap.stats.clear();
+  if (ENABLE_STATS) {
+    sim.brain.stats.snapshot_ns += stats_now_ns() - start;
+    sim.brain.stats.snapshots++;
+  }
+}
+
+// Lock-free single-producer/single-consumer handoff between the simulation
+// and the publisher. The publisher request()s a snapshot; the simulation
+// checks wanted() between ticks, fills back() and publish()es it; the
+// publisher take()s it from the other slot while the simulation may already
+// fill the next one. Ticks nobody asked for are never copied.
+class SnapshotExchange {
+public:
+  SnapshotExchange() : state(IDLE), front_idx(0), back_idx(1) {}
+
+  // Simulation side
+  bool wanted() const {
+    return state.load(std::memory_order_acquire) == WANTED;
+  }
+  StateSnapshot &back() { return slots[back_idx]; }
+  void publish() {
+    front_idx = back_idx;
+    back_idx ^= 1;
+    state.store(READY, std::memory_order_release);
+  }
+
+  // Publisher side
+  void request() { state.store(WANTED, std::memory_order_release); }
+  const StateSnapshot *take() {
+    if (state.load(std::memory_order_acquire) != READY)
+      return nullptr;
+    state.store(IDLE, std::memory_order_relaxed);
+    return &slots[front_idx];
+  }
+
+private:
+  enum { IDLE, WANTED, READY };
+  std::atomic<int> state;
+  StateSnapshot slots[2];
+  int front_idx; // Written before the READY release, read after the acquire
+  int back_idx;  // Simulation only
+};
+
+void print_json_state(const StateSnapshot &snap,
+                      std::ostream &out = std::cout) {
+  out << "{";
+  out << "\"reward\":" << (snap.reward ? "true" : "false") << ",";
+  out << "\"penalty\":" << (snap.penalty ? "true" : "false") << ",";
+  out << "\"reward_sum\":" << snap.reward_sum << ",";
+  out << "\"penalty_sum\":" << snap.penalty_sum << ",";
+  out << "\"food_time\":" << snap.food_time << ",";
+  out << "\"danger_time\":" << snap.danger_time << ",";
+  out << "\"t\":" << snap.tick << ",";
+
+  out << "\"world\":{";
+  out << "\"agent\":" << snap.agent << ",";
+  out << "\"target\":" << snap.target << ",";
+  out << "\"type\":" << snap.target_type << ",";
+  out << "\"food\":" << snap.food << ",";
+  out << "\"danger\":" << snap.danger << ",";
+  out << "\"dist\":" << snap.dist;
+  out << "},";
+
+  out << "\"neurons\":[";
+  for (int i = 0; i < snap.neuron_count(); ++i) {
+    out << "{\"id\":" << i << ",\"v\":" << snap.voltage[i]
+              << ",\"s\":" << (snap.spiked[i] ? "true" : "false") << "}";
+    if (i < snap.neuron_count() - 1)
+      out << ",";
+  }
+  out << "],";
+
+  out << "\"synapses\":[";
+  int s = 0;
+  for (int i = 0; i < snap.neuron_count(); ++i) {
+    for (int k = 0; k < snap.out_degree[i]; ++k, ++s) {
+      const unsigned char st = snap.syn_state[s];
+      if (s > 0)
+        out << ",";
+      out << "{\"s\":" << i << ",\"t\":" << snap.targets[s]
+                << ",\"c\":" << (st & SNAP_CONFIDENCE)
+                << ",\"a\":" << ((st & SNAP_ACTIVE) ? "true" : "false")
+                << ",\"b\":" << ((st & SNAP_HIGHLIGHTED) ? "1" : "0")
+                << "}";
+    }
+  }
+  out << "]";
+  if (!snap.stats.empty())
+    out << ",\"stats\":" << snap.stats;
+  out << "}" << std::endl;
+}
+
+// --- Binary State Frames ---
+// Compact alternative to print_json_state(), selected with --binary. Fields
+// are little-endian and every section starts 4-byte aligned, so the browser
+// can view it with typed arrays:
+//   u32 length               bytes after this field
+//   u32 magic                "RST1"
+//   u16 version, u16 header  header bytes including length (68)
+//   u32 tick, u32 flags      FrameFlags
+//   i32 reward_sum, penalty_sum, food_time, danger_time
+//   i32 agent, target, type, food, danger, dist
+//   u32 neurons (n), synapses (m)
+//   i16 voltage[n]
+//   u8  spiked[(n + 7) / 8]  neuron i is bit i % 8 of byte i / 8
+//   idx out_degree[n]        synapses are listed row by row (CSR order)
+//   idx target[m]
+//   u8  state[m]             bits 0-3 confidence, 4 active, 5 highlighted
+// idx is u16, or u32 when FRAME_WIDE_IDS is set.
+//
+// With --delta most frames carry FRAME_DELTA and, after the same header,
+// only what changed since the previous frame (StateSnapshot::changed_*):
+//   u32 changed neurons (a), changed synapses (b), rewired synapses (r)
+//   u32 neuron_id[a]
+//   i16 voltage[a]
+//   u8  spiked[a]            0 or 1
+//   u32 synapse_id[b]
+//   u8  state[b]             as in keyframes
+//   u32 rewired_id[r]
+//   u32 new_target[r]        sources never change
+// Full frames (keyframes) are still sent every --keyframe-interval frames
+// and after a 'keyframe' command, so a viewer can resync.
+//
+// Either kind may carry FRAME_STATS and end with a stats report, found from
+// the end of the frame:
+//   u8  json[s]              format_stats() text, zero padded to 4 bytes
+//   u32 s
+const uint32_t FRAME_MAGIC = 0x31545352; // "RST1"
+const uint16_t FRAME_VERSION = 2;
+const uint16_t FRAME_HEADER_BYTES = 68;
+
+enum FrameFlags {
+  FRAME_REWARD = 1,
+  FRAME_PENALTY = 2,
+  FRAME_WIDE_IDS = 4,
+  FRAME_DELTA = 8,
+  FRAME_STATS = 16
+};
+
+struct FrameWriter {
+  std::vector<unsigned char> buf; // Reused across frames
+
+  void u8(uint32_t v) { buf.push_back(static_cast<unsigned char>(v)); }
+  void u16(uint32_t v) {
+    u8(v);
+    u8(v >> 8);
+  }
+  void u32(uint32_t v) {
+    u16(v);
+    u16(v >> 16);
+  }
+  void index(uint32_t v, bool wide) {
+    if (wide)
+      u32(v);
+    else
+      u16(v);
+  }
+  void align() {
+    while (buf.size() % 4)
+      buf.push_back(0);
+  }
+  void patch_u32(size_t at, uint32_t v) {
+    for (int k = 0; k < 4; ++k)
+      buf[at + k] = static_cast<unsigned char>(v >> (8 * k));
+  }
+};
+
+void encode_frame_header(FrameWriter &out, const StateSnapshot &snap,
+                         uint32_t flags) {
+  const int n = snap.neuron_count();
+  out.buf.clear();
+  out.u32(0); // Length, patched by finish_frame()
+  out.u32(FRAME_MAGIC);
+  out.u16(FRAME_VERSION);
+  out.u16(FRAME_HEADER_BYTES);
+  out.u32(snap.tick);
+  out.u32(flags | (snap.reward ? FRAME_REWARD : 0) |
+          (snap.penalty ? FRAME_PENALTY : 0) |
+          (n > 0xFFFF ? FRAME_WIDE_IDS : 0) |
+          (snap.stats.empty() ? 0 : FRAME_STATS));
+  out.u32(snap.reward_sum);
+  out.u32(snap.penalty_sum);
+  out.u32(snap.food_time);
+  out.u32(snap.danger_time);
+  out.u32(snap.agent);
+  out.u32(snap.target);
+  out.u32(snap.target_type);
+  out.u32(snap.food);
+  out.u32(snap.danger);
+  out.u32(snap.dist);
+  out.u32(n);
+  out.u32(snap.synapse_count());
+}
+
+inline void finish_frame(FrameWriter &out, const StateSnapshot &snap) {
+  out.align();
+  if (!snap.stats.empty()) {
+    out.buf.insert(out.buf.end(), snap.stats.begin(), snap.stats.end());
+    out.align();
+    out.u32(snap.stats.size());
+  }
+  out.patch_u32(0, static_cast<uint32_t>(out.buf.size() - 4));
+}
+
+inline int16_t clamp_voltage(int v) {
+  return static_cast<int16_t>(std::max(-32768, std::min(32767, v)));
+}
+
+// Keyframe: the whole state
+void encode_binary_state(FrameWriter &out, const StateSnapshot &snap) {
+  const int n = snap.neuron_count();
+  const int m = snap.synapse_count();
+  const bool wide = n > 0xFFFF;
+
+  encode_frame_header(out, snap, 0);
+  for (int i = 0; i < n; ++i)
+    out.u16(clamp_voltage(snap.voltage[i]));
+  out.align();
+  for (int i = 0; i < n; i += 8) {
+    uint32_t bits = 0;
+    for (int k = 0; k < 8 && i + k < n; ++k)
+      bits |= snap.spiked[i + k] ? 1u << k : 0u;
+    out.u8(bits);
+  }
+  out.align();
+  for (int i = 0; i < n; ++i)
+    out.index(snap.out_degree[i], wide);
+  out.align();
+  for (int s = 0; s < m; ++s)
+    out.index(snap.targets[s], wide);
+  out.align();
+  for (int s = 0; s < m; ++s)
+    out.u8(snap.syn_state[s]);
+  finish_frame(out, snap);
+}
+
+// Delta: the changes recorded since the previous snapshot
+void encode_delta_state(FrameWriter &out, const StateSnapshot &snap) {
+  encode_frame_header(out, snap, FRAME_DELTA);
+  out.u32(snap.changed_neurons.size());
+  out.u32(snap.changed_synapses.size());
+  out.u32(snap.rewired.size());
+  for (int i : snap.changed_neurons)
+    out.u32(i);
+  for (int i : snap.changed_neurons)
+    out.u16(clamp_voltage(snap.voltage[i]));
+  out.align();
+  for (int i : snap.changed_neurons)
+    out.u8(snap.spiked[i] ? 1 : 0);
+  out.align();
+  for (int s : snap.changed_synapses)
+    out.u32(s);
+  for (int s : snap.changed_synapses)
+    out.u8(snap.syn_state[s]);
+  out.align();
+  for (int s : snap.rewired)
+    out.u32(s);
+  for (int s : snap.rewired)
+    out.u32(snap.targets[s]);
+  finish_frame(out, snap);
+}
+
+void encode_state(FrameWriter &out, const StateSnapshot &snap, bool delta) {
+  if (delta)
+    encode_delta_state(out, snap);
+  else
+    encode_binary_state(out, snap);
+}
+
+void write_binary_state(FrameWriter &out, const StateSnapshot &snap,
+                        bool delta) {
+  encode_state(out, snap, delta);
+  std::cout.write(reinterpret_cast<const char *>(out.buf.data()),
+                  static_cast<std::streamsize>(out.buf.size()));
+}
+
+// --- Embedded Server ---
+// With --serve PORT the backend serves web_interface/public over HTTP and
+// speaks WebSocket itself, so frames reach the browser without the stdout
+// pipe and the Node process. An I/O thread accepts connections, answers
+// HTTP requests and runs the commands that arrive as text messages; the
+// publisher thread sends each frame to every viewer straight from its
+// FrameWriter buffer. Only what a socket does not take at once is copied.
+#ifdef _WIN32
+typedef SOCKET socket_t;
+const socket_t NO_SOCKET = INVALID_SOCKET;
+inline void close_socket(socket_t s) { closesocket(s); }
+inline bool socket_would_block() {
+  return WSAGetLastError() == WSAEWOULDBLOCK;
+}
+inline int poll_sockets(pollfd *fds, size_t n, int ms) {
+  return WSAPoll(fds, static_cast<ULONG>(n), ms);
+}
+inline void set_nonblocking(socket_t s) {
+  u_long on = 1;
+  ioctlsocket(s, FIONBIO, &on);
+}
+#else
+typedef int socket_t;
+const socket_t NO_SOCKET = -1;
+inline void close_socket(socket_t s) { close(s); }
+inline bool socket_would_block() {
+  return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+inline int poll_sockets(pollfd *fds, size_t n, int ms) {
+  return poll(fds, static_cast<nfds_t>(n), ms);
+}
+inline void set_nonblocking(socket_t s) {
+  fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+}
+#endif
+
+// Socket library setup for a process that uses sockets. A peer that went
+// away is an error code, not SIGPIPE.
+inline void sockets_begin() {
+#ifdef _WIN32
+  WSADATA wsa;
+  WSAStartup(MAKEWORD(2, 2), &wsa);
+#else
+  signal(SIGPIPE, SIG_IGN);
+#endif
+}
+
+inline void sockets_end() {
+#ifdef _WIN32
+  WSACleanup();
+#endif
+}
+
+// A non-blocking socket listening on port of the IPv4 address host
+// (0.0.0.0: all interfaces), or NO_SOCKET
+socket_t open_listener(const std::string &host, int port) {
+  socket_t fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == NO_SOCKET)
+    return NO_SOCKET;
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+             reinterpret_cast<const char *>(&on), sizeof(on));
+  sockaddr_in addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(static_cast<uint16_t>(port));
+  if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1 ||
+      bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+      listen(fd, 16) != 0) {
+    close_socket(fd);
+    return NO_SOCKET;
+  }
+  set_nonblocking(fd);
+  return fd;
+}
+
+// Bytes a non-blocking socket took, or -1 if the connection is gone
+long long try_send(socket_t fd, const char *data, size_t size) {
+  size_t sent = 0;
+  while (sent < size) {
+    const int n = static_cast<int>(
+        send(fd, data + sent, static_cast<int>(size - sent), 0));
+    if (n > 0)
+      sent += n;
+    else if (n < 0 && socket_would_block())
+      break;
+    else
+      return -1;
+  }
+  return static_cast<long long>(sent);
+}
+
+// SHA-1 (RFC 3174) and base64, for the handshake's Sec-WebSocket-Accept
+std::string sha1(const std::string &msg) {
+  uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476,
+                   0xC3D2E1F0};
+  std::string m = msg + '\x80';
+  while (m.size() % 64 != 56)
+    m += '\0';
+  const uint64_t bits = static_cast<uint64_t>(msg.size()) * 8;
+  for (int k = 7; k >= 0; --k)
+    m += static_cast<char>(bits >> (8 * k));
+  auto rol = [](uint32_t v, int c) { return (v << c) | (v >> (32 - c)); };
+  for (size_t off = 0; off < m.size(); off += 64) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; ++i) {
+      w[i] = 0;
+      for (int k = 0; k < 4; ++k)
+        w[i] = (w[i] << 8) | static_cast<unsigned char>(m[off + 4 * i + k]);
+    }
+    for (int i = 16; i < 80; ++i)
+      w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; ++i) {
+      uint32_t f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5A827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ED9EBA1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8F1BBCDC;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xCA62C1D6;
+      }
+      const uint32_t t = rol(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = rol(b, 30);
+      b = a;
+      a = t;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  }
+  std::string out;
+  for (uint32_t v : h)
+    for (int k = 3; k >= 0; --k)
+      out += static_cast<char>(v >> (8 * k));
+  return out;
+}
+
+std::string base64(const std::string &in) {
+  static const char digits[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  for (size_t i = 0; i < in.size(); i += 3) {
+    uint32_t v = static_cast<unsigned char>(in[i]) << 16;
+    if (i + 1 < in.size())
+      v |= static_cast<unsigned char>(in[i + 1]) << 8;
+    if (i + 2 < in.size())
+      v |= static_cast<unsigned char>(in[i + 2]);
+    out += digits[(v >> 18) & 63];
+    out += digits[(v >> 12) & 63];
+    out += i + 1 < in.size() ? digits[(v >> 6) & 63] : '=';
+    out += i + 2 < in.size() ? digits[v & 63] : '=';
+  }
+  return out;
+}
+
+enum WsOpcode {
+  WS_CONTINUATION = 0,
+  WS_TEXT = 1,
+  WS_BINARY = 2,
+  WS_CLOSE = 8,
+  WS_PING = 9,
+  WS_PONG = 10
+};
+
+// A viewer's message as the one command it holds, rebuilt from its parsed
+// argument (an integer, or the engine's name), or "" for anything else:
+// other or several commands, a missing or extra argument, control
+// characters. Checkpoint paths are the process's own (command line and
+// stdin), so save and load are not viewer commands.
+std::string viewer_command(const std::string &text) {
+  static const char *const bare[] = {"start", "resume", "pause", "stop",
+                                     "reset", "keyframe", "stats"};
+  static const char *const numeric[] = {"speed", "mode", "fps", "trace",
+                                        "step"};
+  if (text.size() > 64)
+    return "";
+  for (char ch : text) {
+    if (static_cast<unsigned char>(ch) < 0x20 || ch == 0x7f)
+      return "";
+  }
+  std::istringstream in(text);
+  std::string name, arg, extra;
+  in >> name >> arg >> extra;
+  if (!extra.empty())
+    return "";
+  for (const char *b : bare) {
+    if (name == b)
+      return arg.empty() ? name : "";
+  }
+  for (const char *n : numeric) {
+    if (name != n)
+      continue;
+    size_t digits = arg.size() > 0 && arg[0] == '-' ? 1 : 0;
+    if (arg.size() <= digits || arg.size() > digits + 9)
+      return "";
+    for (size_t k = digits; k < arg.size(); ++k) {
+      if (arg[k] < '0' || arg[k] > '9')
+        return "";
+    }
+    return name + " " + std::to_string(std::stoll(arg));
+  }
+  if (name == "engine" && (arg == "dense" || arg == "event"))
+    return name + " " + arg;
+  return "";
+}
+
+class FrameServer {
+public:
+  // Throws std::runtime_error if the port cannot be opened
+  FrameServer(const std::string &host, int port, const std::string &_www,
+              bool _delta)
+      : listener(NO_SOCKET), www(_www), delta(_delta), next_id(1),
+        stopping(false), controller(0) {
+    sockets_begin();
+    listener = open_listener(host, port);
+    if (listener == NO_SOCKET) {
+      sockets_end();
+      throw std::runtime_error("serve: cannot listen on " + host + ":" +
+                               std::to_string(port));
+    }
+    io_thread = std::thread(&FrameServer::io_loop, this);
+  }
+
+  ~FrameServer() {
+    stopping = true;
+    io_thread.join();
+    for (auto &c : clients)
+      close_socket(c->fd);
+    close_socket(listener);
+    sockets_end();
+  }
+
+  // Publisher side: one frame to every viewer. A viewer with a backlog
+  // skips frames; in delta mode it then waits for a keyframe, which is
+  // requested once it has drained.
+  void broadcast(const unsigned char *data, size_t size, bool binary,
+                 bool is_delta) {
+    std::lock_guard<std::mutex> lock(mutex);
+    bool want_keyframe = false;
+    for (auto &cp : clients) {
+      Client &c = *cp;
+      if (!c.websocket || c.closing || c.dead)
+        continue;
+      if (c.out.size() >= BACKLOG_LIMIT) {
+        c.awaiting_keyframe = delta;
+        continue;
+      }
+      if (is_delta && c.awaiting_keyframe) {
+        want_keyframe = true;
+        continue;
+      }
+      send_message(c, binary ? WS_BINARY : WS_TEXT, data, size);
+      if (!is_delta)
+        c.awaiting_keyframe = false;
+    }
+    if (want_keyframe)
+      g_keyframe_request = true;
+  }
+
+private:
+  static const size_t BACKLOG_LIMIT = 1 << 20; // Unsent bytes per viewer
+  static const size_t REQUEST_LIMIT = 16 << 10; // HTTP request head
+  static const size_t MESSAGE_LIMIT = 64 << 10; // WebSocket message
+  static const int CONTROL_LEASE_SECONDS = 30;  // As server.js
+
+  struct Client {
+    socket_t fd;
+    int id;
+    bool websocket;
+    bool closing; // Close once out is sent
+    bool dead;    // Connection lost, dropped by the I/O thread
+    bool awaiting_keyframe;
+    std::string in;           // Received, not parsed yet
+    std::string message;      // Fragments of a WebSocket message
+    int message_opcode;       // Of its first frame; WS_CONTINUATION: none
+    std::vector<char> out;    // Not taken by the socket yet
+  };
+
+  socket_t listener;
+  std::string www;
+  bool delta;
+  std::mutex mutex; // clients and their buffers
+  std::vector<std::unique_ptr<Client>> clients;
+  int next_id;
+  std::atomic<bool> stopping;
+  std::thread io_thread;
+  // One viewer drives at a time, as with server.js: the first to send a
+  // command holds the controls until it has been quiet for the lease
+  int controller; // Client id, 0: none
+  std::chrono::steady_clock::time_point control_until;
+
+  // Sends what the socket takes now and queues the rest behind out
+  void queue(Client &c, const char *data, size_t size) {
+    size_t sent = 0;
+    if (c.out.empty()) {
+      const long long n = try_send(c.fd, data, size);
+      if (n < 0) {
+        c.dead = true;
+        return;
+      }
+      sent = static_cast<size_t>(n);
+    }
+    c.out.insert(c.out.end(), data + sent, data + size);
+  }
+
+  void flush(Client &c) {
+    if (c.out.empty())
+      return;
+    const long long n = try_send(c.fd, c.out.data(), c.out.size());
+    if (n < 0)
+      c.dead = true;
+    else
+      c.out.erase(c.out.begin(), c.out.begin() + n);
+  }
+
+  // Server messages are unmasked, in one frame
+  void send_message(Client &c, int opcode, const unsigned char *data,
+                    size_t size) {
+    unsigned char head[10];
+    size_t h = 2;
+    head[0] = static_cast<unsigned char>(0x80 | opcode);
+    if (size < 126) {
+      head[1] = static_cast<unsigned char>(size);
+    } else if (size <= 0xFFFF) {
+      head[1] = 126;
+      head[2] = static_cast<unsigned char>(size >> 8);
+      head[3] = static_cast<unsigned char>(size);
+      h = 4;
+    } else {
+      head[1] = 127;
+      for (int k = 0; k < 8; ++k)
+        head[2 + k] = static_cast<unsigned char>(
+            static_cast<uint64_t>(size) >> (8 * (7 - k)));
+      h = 10;
+    }
+    queue(c, reinterpret_cast<const char *>(head), h);
+    if (!c.dead)
+      queue(c, reinterpret_cast<const char *>(data), size);
+  }
+
+  void send_text(Client &c, const std::string &text) {
+    send_message(c, WS_TEXT,
+                 reinterpret_cast<const unsigned char *>(text.data()),
+                 text.size());
+  }
+
+  void io_loop() {
+    std::vector<pollfd> fds;
+    std::vector<std::string> commands;
+    while (!stopping && g_running) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        fds.assign(1, pollfd());
+        fds[0].fd = listener;
+        fds[0].events = POLLIN;
+        for (auto &c : clients) {
+          pollfd p = pollfd();
+          p.fd = c->fd;
+          p.events = static_cast<short>(POLLIN |
+                                        (c->out.empty() ? 0 : POLLOUT));
+          fds.push_back(p);
+        }
+      }
+      // Frames are sent by the publisher; the timeout only bounds how
+      // late a stop or a backlog is noticed
+      if (poll_sockets(fds.data(), fds.size(), 50) < 0)
+        continue;
+
+      std::unique_lock<std::mutex> lock(mutex);
+      // Only this thread adds or removes clients, so fds[k + 1] is still
+      // clients[k]
+      for (size_t k = 0; k + 1 < fds.size(); ++k) {
+        Client &c = *clients[k];
+        const short ev = fds[k + 1].revents;
+        if (ev & (POLLERR | POLLHUP | POLLNVAL))
+          c.dead = true;
+        if (!c.dead && (ev & POLLIN))
+          receive(c, commands);
+        if (!c.dead && (ev & POLLOUT))
+          flush(c);
+      }
+      if (fds[0].revents & POLLIN)
+        accept_clients();
+      for (size_t k = clients.size(); k-- > 0;) {
+        Client &c = *clients[k];
+        if (c.dead || (c.closing && c.out.empty())) {
+          if (c.websocket)
+            log_to_file("Viewer " + std::to_string(c.id) + " left");
+          if (controller == c.id)
+            controller = 0;
+          close_socket(c.fd);
+          clients.erase(clients.begin() + k);
+        }
+      }
+      // Commands may touch the disk (save): keep the publisher unblocked
+      lock.unlock();
+      // One parsed viewer command each (see command)
+      for (const std::string &text : commands) {
+        std::istringstream in(text);
+        std::string cmd;
+        in >> cmd;
+        handle_command(cmd, in);
+      }
+      commands.clear();
+    }
+  }
+
+  void accept_clients() {
+    for (;;) {
+      socket_t fd = accept(listener, nullptr, nullptr);
+      if (fd == NO_SOCKET)
+        return;
+      set_nonblocking(fd);
+      int on = 1; // Frames are small and latency matters
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
+                 reinterpret_cast<const char *>(&on), sizeof(on));
+      std::unique_ptr<Client> c(new Client());
+      c->fd = fd;
+      c->id = next_id++;
+      c->websocket = c->closing = c->dead = c->awaiting_keyframe = false;
+      c->message_opcode = WS_CONTINUATION;
+      clients.push_back(std::move(c));
+    }
+  }
+
+  void receive(Client &c, std::vector<std::string> &commands) {
+    char buf[4096];
+    for (;;) {
+      const int n = static_cast<int>(recv(c.fd, buf, sizeof(buf), 0));
+      if (n > 0) {
+        c.in.append(buf, n);
+        continue;
+      }
+      if (n == 0 || !socket_would_block())
+        c.dead = true;
+      break;
+    }
+    if (c.dead || c.closing)
+      return;
+    if (!c.websocket)
+      handle_http(c);
+    if (c.websocket)
+      handle_frames(c, commands);
+  }
+
+  static std::string lower(std::string text) {
+    for (char &ch : text)
+      ch = static_cast<char>(std::tolower(static_cast<unsigned char>(ch)));
+    return text;
+  }
+
+  void respond(Client &c, const std::string &status,
+               const std::string &type, const std::string &body) {
+    std::ostringstream head;
+    head << "HTTP/1.1 " << status << "\r\nContent-Type: " << type
+         << "\r\nContent-Length: " << body.size()
+         << "\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n";
+    const std::string h = head.str();
+    queue(c, h.data(), h.size());
+    queue(c, body.data(), body.size());
+    c.closing = true;
+  }
+
+  void handle_http(Client &c) {
+    const size_t end = c.in.find("\r\n\r\n");
+    if (end == std::string::npos) {
+      if (c.in.size() > REQUEST_LIMIT)
+        respond(c, "431 Request Header Fields Too Large", "text/plain",
+                "Request too large\n");
+      return;
+    }
+    std::istringstream head(c.in.substr(0, end));
+    c.in.erase(0, end + 4);
+    std::string method, target, line;
+    head >> method >> target;
+    std::getline(head, line);
+    std::string upgrade, key;
+    while (std::getline(head, line)) {
+      const size_t colon = line.find(':');
+      if (colon == std::string::npos)
+        continue;
+      const std::string name = lower(line.substr(0, colon));
+      size_t v = line.find_first_not_of(' ', colon + 1);
+      std::string value = v == std::string::npos ? "" : line.substr(v);
+      if (!value.empty() && value.back() == '\r')
+        value.pop_back();
+      if (name == "upgrade")
+        upgrade = lower(value);
+      else if (name == "sec-websocket-key")
+        key = value;
+    }
+    if (method != "GET") {
+      respond(c, "405 Method Not Allowed", "text/plain", "GET only\n");
+    } else if (upgrade.find("websocket") != std::string::npos &&
+               !key.empty()) {
+      const std::string accept =
+          base64(sha1(key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"));
+      const std::string reply = "HTTP/1.1 101 Switching Protocols\r\n"
+                                "Upgrade: websocket\r\n"
+                                "Connection: Upgrade\r\n"
+                                "Sec-WebSocket-Accept: " +
+                                accept + "\r\n\r\n";
+      queue(c, reply.data(), reply.size());
+      c.websocket = true;
+      // A new viewer starts from a full frame, sent even while paused
+      c.awaiting_keyframe = delta;
+      g_keyframe_request = true;
+      log_to_file("Viewer " + std::to_string(c.id) + " joined");
+      std::cerr << "[CPP] Viewer " << c.id << " joined" << std::endl;
+    } else {
+      serve_file(c, target);
+    }
+  }
+
+  void serve_file(Client &c, std::string path) {
+    path = path.substr(0, path.find_first_of("?#"));
+    if (path.empty() || path.back() == '/')
+      path += "index.html";
+    if (path[0] != '/' || path.find("..") != std::string::npos ||
+        path.find('\\') != std::string::npos) {
+      respond(c, "404 Not Found", "text/plain", "Not found\n");
+      return;
+    }
+    std::ifstream file(www + path, std::ios::binary);
+    if (!file) {
+      respond(c, "404 Not Found", "text/plain", "Not found\n");
+      return;
+    }
+    std::ostringstream body;
+    body << file.rdbuf();
+    const std::string ext = lower(path.substr(path.find_last_of('.') + 1));
+    const char *type = ext == "html"  ? "text/html; charset=utf-8"
+                       : ext == "js"  ? "text/javascript; charset=utf-8"
+                       : ext == "css" ? "text/css; charset=utf-8"
+                       : ext == "json" ? "application/json"
+                       : ext == "svg"  ? "image/svg+xml"
+                       : ext == "png"  ? "image/png"
+                       : ext == "ico"  ? "image/x-icon"
+                                       : "application/octet-stream";
+    respond(c, "200 OK", type, body.str());
+  }
+
+  // Client frames are masked; text messages are commands, the others
+  // follow RFC 6455 (pings answered, close echoed, binary ignored)
+  void handle_frames(Client &c, std::vector<std::string> &commands) {
+    size_t pos = 0;
+    while (!c.dead && !c.closing && c.in.size() - pos >= 2) {
+      const unsigned char b0 = c.in[pos], b1 = c.in[pos + 1];
+      const bool fin = (b0 & 0x80) != 0;
+      const int opcode = b0 & 0x0F;
+      uint64_t size = b1 & 0x7F;
+      size_t h = 2;
+      if (size == 126 || size == 127) {
+        const size_t bytes = size == 126 ? 2 : 8;
+        if (c.in.size() - pos < 2 + bytes)
+          break;
+        size = 0;
+        for (size_t k = 0; k < bytes; ++k)
+          size = (size << 8) | static_cast<unsigned char>(c.in[pos + 2 + k]);
+        h += bytes;
+      }
+      if (!(b1 & 0x80) || size > MESSAGE_LIMIT) {
+        c.dead = true; // Unmasked or oversized: not a browser
+        break;
+      }
+      if (c.in.size() - pos < h + 4 + size)
+        break;
+      const char *mask = &c.in[pos + h];
+      std::string payload = c.in.substr(pos + h + 4, size);
+      for (size_t k = 0; k < payload.size(); ++k)
+        payload[k] ^= mask[k & 3];
+      pos += h + 4 + size;
+
+      if (opcode == WS_TEXT || opcode == WS_BINARY ||
+          opcode == WS_CONTINUATION) {
+        // Only text is kept: binary and stray continuations are dropped
+        if (opcode != WS_CONTINUATION) {
+          c.message_opcode = opcode;
+          c.message.clear();
+        }
+        if (c.message_opcode == WS_TEXT)
+          c.message += payload;
+        if (c.message.size() > MESSAGE_LIMIT) {
+          c.dead = true;
+        } else if (fin) {
+          if (c.message_opcode == WS_TEXT)
+            command(c, c.message, commands);
+          c.message.clear();
+          c.message_opcode = WS_CONTINUATION;
+        }
+      } else if (opcode == WS_PING) {
+        send_message(c, WS_PONG,
+                     reinterpret_cast<const unsigned char *>(payload.data()),
+                     payload.size());
+      } else if (opcode == WS_CLOSE) {
+        send_message(c, WS_CLOSE,
+                     reinterpret_cast<const unsigned char *>(payload.data()),
+                     std::min<size_t>(payload.size(), 2));
+        c.closing = true;
+      }
+    }
+    c.in.erase(0, pos);
+  }
+
+  void command(Client &c, const std::string &text,
+               std::vector<std::string> &commands) {
+    const std::string parsed = viewer_command(text);
+    if (parsed.empty()) {
+      log_to_file("Viewer " + std::to_string(c.id) +
+                  ": refused a message that is not a viewer command");
+      send_text(c, "{\"log\":\"Unknown command\"}");
+      return;
+    }
+    const std::string name = parsed.substr(0, parsed.find(' '));
+    if (name == "keyframe") {
+      c.awaiting_keyframe = delta;
+    } else if (name != "stats") {
+      const auto now = std::chrono::steady_clock::now();
+      if (controller != 0 && controller != c.id && now < control_until) {
+        const long long left =
+            std::chrono::duration_cast<std::chrono::seconds>(control_until -
+                                                             now)
+                .count() +
+            1;
+        log_to_file("Viewer " + std::to_string(c.id) + ": '" + parsed +
+                    "' refused, viewer " + std::to_string(controller) +
+                    " has the controls");
+        send_text(c, "{\"log\":\"Viewer " + std::to_string(controller) +
+                         " has the controls; try again in " +
+                         std::to_string(left) + " s\"}");
+        return;
+      }
+      controller = c.id;
+      control_until = now + std::chrono::seconds(CONTROL_LEASE_SECONDS);
+    }
+    // Nothing would be left to restart the process: a viewer's stop pauses,
+    // the process itself is stopped from stdin or with a signal
+    commands.push_back(name == "stop" ? "pause" : parsed);
+  }
+};
+
+// --- Publisher ---
+// Serializes and writes frames on its own thread so the simulation never
+// blocks on stdout. Paced by g_fps on a steady_clock deadline; a slow or
+// stalled viewer only lowers the frame rate, never the tick rate. With a
+// server the frames go to its viewers instead of stdout.
+void publisher_loop(SnapshotExchange &exchange, bool binary, bool delta,
+                    int keyframe_interval, FrameServer *server) {
+  typedef std::chrono::steady_clock Clock;
+  FrameWriter frame;
+  std::ostringstream json; // JSON frames for the server
+  int last_run = -1;
+  int last_tick = -1;
+  int since_key = 0; // Frames since the last keyframe
+  Clock::time_point deadline = Clock::now();
+
+  while (g_running) {
+    int fps = g_fps;
+    if (fps > 0) {
+      deadline += std::chrono::microseconds(1000000 / fps);
+      Clock::time_point now = Clock::now();
+      if (deadline < now)
+        deadline = now; // Do not burst to catch up after a stall
+      std::this_thread::sleep_until(deadline);
+    }
+
+    exchange.request();
+    g_control.notify(); // A paused or pacing loop serves it right away
+    const StateSnapshot *snap = nullptr;
+    while (g_running && !(snap = exchange.take()))
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    if (!snap)
+      break;
+
+    bool requested = g_keyframe_request.exchange(false);
+    bool new_run = snap->run != last_run;
+    // Nothing moved (paused or slow ticks): skip the duplicate
+    if (!new_run && !requested && snap->tick == last_tick &&
+        snap->stats.empty())
+      continue;
+
+    const uint64_t start = ENABLE_STATS ? stats_now_ns() : 0;
+    if (binary) {
+      // Keyframes let a viewer (re)sync; deltas carry the rest
+      bool key = !delta || new_run || requested ||
+                 ++since_key >= keyframe_interval;
+      if (key)
+        since_key = 0;
+      if (server) {
+        encode_state(frame, *snap, !key);
+        server->broadcast(frame.buf.data(), frame.buf.size(), true, !key);
+      } else {
+        write_binary_state(frame, *snap, !key);
+        std::cout.flush();
+      }
+    } else if (server) {
+      json.str("");
+      print_json_state(*snap, json);
+      const std::string text = json.str();
+      server->broadcast(reinterpret_cast<const unsigned char *>(text.data()),
+                        text.size(), false, false);
+    } else
+      print_json_state(*snap);
+    if (ENABLE_STATS) {
+      g_serialize_ns += stats_now_ns() - start;
+      g_serialized++;
+    }
+    last_run = snap->run;
+    last_tick = snap->tick;
+  }
+}
+
+// --- Thread Pool ---
+// Work-stealing pool: a worker pops the newest task from the back of its own
+// deque and, once that is empty, steals the oldest task from the front of
+// another worker's deque. Tasks may push follow-up tasks; run() returns when
+// every task, including those pushed while running, has finished.
+class WorkStealingPool {
+public:
+  typedef std::function<void(int worker)> Task;
+
+  explicit WorkStealingPool(int threads)
+      : queues(std::max(1, threads)), pending(0) {}
+
+  int size() const { return (int)queues.size(); }
+
+  // Safe to call from inside a running task
+  void push(int worker, Task task) {
+    pending++;
+    WorkerQueue &q = queues[worker % size()];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    q.tasks.push_back(std::move(task));
+  }
+
+  // Runs worker 0 on the calling thread
+  void run() {
+    std::vector<std::thread> threads;
+    for (int w = 1; w < size(); ++w)
+      threads.emplace_back(&WorkStealingPool::worker_loop, this, w);
+    worker_loop(0);
+    for (auto &th : threads)
+      th.join();
+  }
+
+private:
+  struct WorkerQueue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+  std::vector<WorkerQueue> queues;
+  std::atomic<int> pending; // Pushed but not yet finished
+
+  bool pop_local(int w, Task &task) {
+    WorkerQueue &q = queues[w];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    if (q.tasks.empty())
+      return false;
+    task = std::move(q.tasks.back());
+    q.tasks.pop_back();
+    return true;
+  }
+
+  bool steal(int w, Task &task) {
+    for (int k = 1; k < size(); ++k) {
+      WorkerQueue &q = queues[(w + k) % size()];
+      std::lock_guard<std::mutex> lock(q.mutex);
+      if (!q.tasks.empty()) {
+        task = std::move(q.tasks.front());
+        q.tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void worker_loop(int w) {
+    Task task;
+    while (pending > 0) {
+      if (pop_local(w, task) || steal(w, task)) {
+        task(w);
+        task = nullptr;
+        pending--; // After any follow-up push, so pending never dips to 0
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  }
+};
+
+// --- Metrics ---
+// Learning curves without the JSON: every --metrics-window ticks an agent
+// appends one row of aggregates to a block of columns, and full blocks go
+// to a writer thread, so simulation threads never format or touch the file.
+// File layout, little-endian, every array 8-byte aligned so a column can be
+// read straight from a memory map (README has a pandas loader):
+//   u32 magic "RSTM", u16 version, u16 columns, i64 window,
+//   u32 spec_bytes, u32 reserved,
+//   spec text "name:i8,...,name:f8" (numpy dtypes), zero-padded to 8 bytes,
+//   then blocks: u32 magic "RSTB", u32 rows, i32 agent, u32 reserved,
+//   and each column's rows values in spec order.
+// Counts cover the ticks of the row's window (the last one may be shorter);
+// mean_confidence and active_synapses are sampled at its last tick. A block
+// cut short by a crash ends the file.
+const uint32_t METRICS_MAGIC = 0x4d545352;       // "RSTM"
+const uint32_t METRICS_BLOCK_MAGIC = 0x42545352; // "RSTB"
+const uint16_t METRICS_VERSION = 1;
+const int METRICS_BLOCK_ROWS = 4096;
+const size_t METRICS_QUEUE_LIMIT = 64; // Blocks waiting for the writer
+
+enum MetricColumn {
+  MET_TICK, // Simulation::t after the window
+  MET_REWARDS,
+  MET_PENALTIES,
+  MET_FOOD,
+  MET_DANGER,
+  MET_SENSOR_SPIKES,
+  MET_MOTOR_SPIKES,
+  MET_HIDDEN_SPIKES, // Ports and interior
+  MET_MEAN_CONFIDENCE,
+  MET_ACTIVE_SYNAPSES,
+  MET_REWIRES,
+  MET_COUNT
+};
+const char *const METRIC_NAMES[MET_COUNT] = {
+    "tick",          "rewards",         "penalties",     "food_eaten",
+    "danger_hit",    "sensor_spikes",   "motor_spikes",  "hidden_spikes",
+    "mean_confidence", "active_synapses", "rewires"};
+
+struct MetricsBlockHeader {
+  uint32_t magic;
+  uint32_t rows;
+  int32_t agent;
+  uint32_t reserved;
+};
+
+static_assert(sizeof(MetricsBlockHeader) == 16, "metrics block layout");
+
+// Column c of row r is cells[c * METRICS_BLOCK_ROWS + r]; mean_confidence
+// holds the bits of a double
+struct MetricsBlock {
+  int agent;
+  int rows;
+  std::vector<int64_t> cells;
+
+  MetricsBlock() : agent(0), rows(0), cells(MET_COUNT * METRICS_BLOCK_ROWS) {}
+  void set(MetricColumn c, int64_t v) {
+    cells[c * METRICS_BLOCK_ROWS + rows] = v;
+  }
+  void set(MetricColumn c, double v) {
+    std::memcpy(&cells[c * METRICS_BLOCK_ROWS + rows], &v, sizeof(v));
+  }
+};
+
+// Owns the file and the thread that writes it. Blocks are recycled, so a
+// long run allocates only while the queue first fills up. Any thread may
+// take and push blocks; push waits while METRICS_QUEUE_LIMIT blocks are
+// queued, which only happens when the disk falls behind.
+class MetricsWriter {
+public:
+  // append continues a file written with the same window after its last
+  // whole block (a missing file is started afresh); last_tick then has
+  // each agent's last row
+  MetricsWriter(const std::string &_path, long long window,
+                bool append = false)
+      : path(_path), closing(false), failed(false) {
+    std::string spec;
+    for (int c = 0; c < MET_COUNT; ++c)
+      spec += std::string(c ? "," : "") + METRIC_NAMES[c] +
+              (c == MET_MEAN_CONFIDENCE ? ":f8" : ":i8");
+    const uint32_t magic = METRICS_MAGIC, spec_bytes = spec.size(),
+                   reserved = 0;
+    const uint16_t version = METRICS_VERSION, columns = MET_COUNT;
+    const int64_t window64 = window;
+    std::string head;
+    auto put = [&head](const void *v, size_t n) {
+      head.append(static_cast<const char *>(v), n);
+    };
+    put(&magic, sizeof(magic));
+    put(&version, sizeof(version));
+    put(&columns, sizeof(columns));
+    put(&window64, sizeof(window64));
+    put(&spec_bytes, sizeof(spec_bytes));
+    put(&reserved, sizeof(reserved));
+    spec.resize((spec.size() + 7) / 8 * 8, '\0');
+    head += spec;
+    if (append && std::ifstream(path)) {
+      std::filesystem::resize_file(path, scan(head));
+      out.open(path, std::ios::binary | std::ios::app);
+    } else {
+      out.open(path, std::ios::binary | std::ios::trunc);
+      out.write(head.data(), head.size());
+    }
+    if (!out)
+      throw std::runtime_error("cannot write " + path);
+    thread = std::thread(&MetricsWriter::run, this);
+  }
+
+  ~MetricsWriter() { close(); }
+
+  MetricsWriter(const MetricsWriter &) = delete;
+  MetricsWriter &operator=(const MetricsWriter &) = delete;
+
+  // An empty block for agent
+  std::unique_ptr<MetricsBlock> take(int agent) {
+    std::unique_ptr<MetricsBlock> block;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!spare.empty()) {
+        block = std::move(spare.back());
+        spare.pop_back();
+      }
+    }
+    if (!block)
+      block.reset(new MetricsBlock());
+    block->agent = agent;
+    block->rows = 0;
+    return block;
+  }
+
+  void push(std::unique_ptr<MetricsBlock> block) {
+    std::unique_lock<std::mutex> lock(mutex);
+    room.wait(lock, [this] { return queue.size() < METRICS_QUEUE_LIMIT; });
+    queue.push_back(std::move(block));
+    ready.notify_one();
+  }
+
+  // Writes what is queued and stops the thread; false if a write failed
+  bool close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      closing = true;
+    }
+    ready.notify_one();
+    if (thread.joinable())
+      thread.join();
+    return !failed;
+  }
+
+  std::map<int, int64_t> last_tick; // Rows found by an append
+
+private:
+  // Size of the file up to its last whole block
+  std::streamoff scan(const std::string &head) {
+    const std::streamoff size = std::filesystem::file_size(path);
+    std::ifstream in(path, std::ios::binary);
+    std::string found(head.size(), '\0');
+    if (!in.read(&found[0], found.size()) || found != head)
+      throw std::runtime_error(path + " is not a metrics file of this "
+                                      "window; cannot append");
+    std::streamoff end = head.size();
+    MetricsBlockHeader block;
+    while (in.seekg(end) &&
+           in.read(reinterpret_cast<char *>(&block), sizeof(block)) &&
+           block.magic == METRICS_BLOCK_MAGIC && block.rows > 0 &&
+           block.rows <= METRICS_BLOCK_ROWS) {
+      const std::streamoff cells = end + std::streamoff(sizeof(block));
+      const std::streamoff next =
+          cells + std::streamoff(block.rows) * MET_COUNT * sizeof(int64_t);
+      if (next > size)
+        break; // Cut short
+      // The tick column comes first
+      int64_t tick = 0;
+      in.seekg(cells + (block.rows - 1) * sizeof(int64_t));
+      in.read(reinterpret_cast<char *>(&tick), sizeof(tick));
+      int64_t &last = last_tick[block.agent];
+      last = std::max(last, tick);
+      end = next;
+    }
+    return end;
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      ready.wait(lock, [this] { return closing || !queue.empty(); });
+      if (queue.empty())
+        break;
+      // Everything queued goes out in one batch and one flush
+      std::vector<std::unique_ptr<MetricsBlock>> batch;
+      while (!queue.empty()) {
+        batch.push_back(std::move(queue.front()));
+        queue.pop_front();
+      }
+      room.notify_all();
+      lock.unlock();
+      for (const auto &block : batch)
+        write_block(*block);
+      out.flush();
+      if (!out && !failed) {
+        failed = true;
+        LOG_AT(LOG_ERROR, "cannot write " + path);
+        std::cerr << "[CPP] Metrics: cannot write " << path << std::endl;
+      }
+      lock.lock();
+      for (auto &block : batch)
+        spare.push_back(std::move(block));
+    }
+    out.close();
+  }
+
+  void write_block(const MetricsBlock &block) {
+    MetricsBlockHeader header;
+    header.magic = METRICS_BLOCK_MAGIC;
+    header.rows = block.rows;
+    header.agent = block.agent;
+    header.reserved = 0;
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    for (int c = 0; c < MET_COUNT; ++c)
+      out.write(reinterpret_cast<const char *>(
+                    &block.cells[c * METRICS_BLOCK_ROWS]),
+                block.rows * sizeof(int64_t));
+  }
+
+  std::string path;
+  std::ofstream out; // Writer thread only, once it runs
+  std::mutex mutex;
+  std::condition_variable ready; // Queue not empty, or closing
+  std::condition_variable room;  // Queue below the limit
+  std::deque<std::unique_ptr<MetricsBlock>> queue;
+  std::vector<std::unique_ptr<MetricsBlock>> spare;
+  bool closing;
+  bool failed;
+  std::thread thread;
+};
+
+// One agent's rows, on whichever thread ticks it. Per tick it only bins the
+// tick's spikes; the other columns are differences of the simulation's own
+// totals, and the confidence scan runs once per window.
+// Sink is anything with MetricsWriter's take and push.
+template <class Net, class Sink = MetricsWriter> class MetricsRecorder {
+public:
+  MetricsRecorder(Sink &_writer, int _agent, long long _window,
+                  const Simulation<Net> &sim)
+      : writer(_writer), agent(_agent), window(_window),
+        block(_writer.take(_agent)), ticks(0) {
+    std::fill(spikes, spikes + 3, 0);
+    mark(sim);
+  }
+
+  // After every sim.tick()
+  void tick(const Simulation<Net> &sim) {
+    const auto &topo = sim.brain.topo;
+    for (int i : sim.brain.spiked)
+      spikes[(i >= topo.motor_begin()) + (i >= topo.hidden_begin())]++;
+    if (++ticks == window)
+      end_row(sim);
+  }
+
+  // Adds the partial last window and hands over the last block
+  void finish(const Simulation<Net> &sim) {
+    if (ticks > 0)
+      end_row(sim);
+    flush();
+  }
+
+  // Hands over the rows so far, e.g. before a checkpoint
+  void flush() {
+    if (block->rows == 0)
+      return;
+    writer.push(std::move(block));
+    block = writer.take(agent);
+  }
+
+private:
+  void mark(const Simulation<Net> &sim) {
+    last_reward = sim.reward_sum;
+    last_penalty = sim.penalty_sum;
+    last_food = sim.world.food_eaten;
+    last_danger = sim.world.danger_hit;
+    last_rewires = sim.brain.rewires;
+  }
+
+  void end_row(const Simulation<Net> &sim) {
+    const SynapseStore &store = sim.brain.synapses;
+    int64_t confidence = 0, active = 0;
+    for (int s = 0; s < store.size(); ++s) {
+      confidence += store.state[s].confidence;
+      active += store.active[s];
+    }
+    block->set(MET_TICK, int64_t(sim.t));
+    block->set(MET_REWARDS, int64_t(sim.reward_sum - last_reward));
+    block->set(MET_PENALTIES, int64_t(sim.penalty_sum - last_penalty));
+    block->set(MET_FOOD, int64_t(sim.world.food_eaten - last_food));
+    block->set(MET_DANGER, int64_t(sim.world.danger_hit - last_danger));
+    block->set(MET_SENSOR_SPIKES, spikes[0]);
+    block->set(MET_MOTOR_SPIKES, spikes[1]);
+    block->set(MET_HIDDEN_SPIKES, spikes[2]);
+    block->set(MET_MEAN_CONFIDENCE,
+               store.size() ? double(confidence) / store.size() : 0.0);
+    block->set(MET_ACTIVE_SYNAPSES, active);
+    block->set(MET_REWIRES, int64_t(sim.brain.rewires - last_rewires));
+    mark(sim);
+    std::fill(spikes, spikes + 3, 0);
+    ticks = 0;
+    if (++block->rows == METRICS_BLOCK_ROWS) {
+      writer.push(std::move(block));
+      block = writer.take(agent);
+    }
+  }
+
+  Sink &writer;
+  int agent;
+  long long window;
+  std::unique_ptr<MetricsBlock> block;
+  long long ticks; // In the current window
+  int64_t spikes[3]; // Sensors, motors, hidden
+  int last_reward, last_penalty, last_food, last_danger;
+  uint64_t last_rewires;
+};
+
+// --- Command line ---
+struct Options {
+  bool headless;
+  long long ticks;  // Headless run length (per agent)
+  bool has_seed;    // Otherwise seeded from the clock
+  unsigned int seed;
+  int engine;       // Initial g_engine
+  int reward_mode;  // Initial g_reward_mode
+  int population;   // Independent agents; > 1 runs on the thread pool
+  int threads;      // Pool size, 0: one per core
+  long long chunk;  // Ticks an agent runs before yielding its worker
+  int net_threads;  // Threads inside one brain step (dense engine)
+  int neurons;      // Headless brain size; BRAIN_SIZE uses HeadlessNet
+  double density;   // Hidden connection density for --neurons
+  bool binary;      // Interactive frames: binary (see FrameWriter) or JSON
+  bool delta;       // Binary frames as deltas between keyframes
+  int keyframe_interval; // Frames between keyframes in delta mode
+  std::string load_path; // Checkpoint to start from (first run only)
+  std::string save_path; // Checkpoint written when the run ends
+  std::string record_path; // Interactive session recording
+  long long record_interval; // Ticks between indexed checkpoints, 0: none
+  std::string replay_path; // Recording to replay before the session
+  int replay_run;          // Run of the recording, 1-based
+  long long seek;          // Replay target tick, -1: end of the run
+  int stats_interval;      // Frames between stats reports, 0: on request
+  int batch;               // Lockstep agents on the batch engine, 0: none
+  bool conformance;        // Check the batch against the CPU reference
+  int serve_port;          // Embedded HTTP/WebSocket server, 0: stdout
+  std::string bind_address; // IPv4 address of --serve and --coordinator
+  std::string www;         // Static files for the server
+  Params params;           // Rule set (headless runs only)
+  std::string metrics_path; // Columnar learning curves (headless runs)
+  long long metrics_window; // Ticks per metrics row
+  RngKind rng;              // Generator of fresh brains (headless runs)
+  int coordinator_port;     // Sweep coordinator, 0: none
+  std::string sweep_path;   // Sweep file of the coordinator
+  std::string sweep_dir;    // Results and checkpoints of a sweep
+  std::string worker_address; // HOST:PORT of the coordinator to work for
+  int checkpoint_seconds;     // Between a sweep job's checkpoints
+  int neuron_kernel;          // NeuronKernel, -1: the best the CPU has
+
+  Options()
+      : headless(false), ticks(1000000), has_seed(false), seed(0),
+        engine(DENSE), reward_mode(0), population(1), threads(0),
+        chunk(10000), net_threads(1), neurons(BRAIN_SIZE),
+        density(CONNECTION_DENSITY), binary(false), delta(false),
+        keyframe_interval(300), record_interval(100000), replay_run(1),
+        seek(-1), stats_interval(0), batch(0), conformance(false),
+        serve_port(0), bind_address("127.0.0.1"), www("web_interface/public"),
+        params(DEFAULT_PARAMS),
+        metrics_window(1000), rng(RNG_MT19937), coordinator_port(0),
+        sweep_dir("sweep"), checkpoint_seconds(30), neuron_kernel(-1) {}
+};
+
+void print_usage() {
+  std::cerr << "Usage: binary_rstdp [--headless] [--ticks N] [--seed N]\n"
+               "                    [--engine dense|event] [--mode 0-3]\n"
+               "                    [--population N] [--threads N]\n"
+               "                    [--chunk N] [--net-threads N]\n"
+               "                    [--neurons N] [--density D] [--binary]\n"
+               "                    [--delta] [--keyframe-interval K]\n"
+               "                    [--load PATH] [--save PATH]\n"
+               "                    [--record PATH] [--record-interval N]\n"
+               "                    [--replay PATH] [--replay-run R]\n"
+               "                    [--seek T] [--stats-interval N]\n"
+               "                    [--batch B] [--conformance]\n"
+               "                    [--serve PORT] [--www DIR] [--bind ADDR]\n"
+               "                    [--params NAME|PATH] [--param K=V]\n"
+               "                    [--metrics PATH] [--metrics-window N]\n"
+               "                    [--rng mt19937|philox]\n"
+               "                    [--coordinator PORT --sweep FILE]\n"
+               "                    [--worker HOST:PORT] [--sweep-dir DIR]\n"
+               "                    [--checkpoint-seconds S]\n"
+               "                    [--neuron-kernel auto|scalar|avx2|neon]\n"
+               "  --headless  Train at full speed: no JSON, pacing or stdin\n"
+               "              commands; print a summary when done\n"
+               "  --ticks N   Headless run length (default 1000000)\n"
+               "  --seed N    Brain rng seed (default: clock)\n"
+               "  --engine    Plasticity engine (default dense)\n"
+               "  --mode N    Reward mode, as the 'mode' command\n"
+               "  --population N\n"
+               "              Run N headless agents with seeds seed..seed+N-1\n"
+               "  --threads N Worker threads (default: one per core)\n"
+               "  --chunk N   Ticks per scheduling chunk (default 10000)\n"
+               "  --net-threads N\n"
+               "              Split each brain step across N threads\n"
+               "  --neurons N Headless brain size (default 36)\n"
+               "  --density D Hidden connection density (default 0.1)\n"
+               "  --binary    Interactive state as binary frames, not JSON\n"
+               "  --delta     Binary frames carry only changes, with a full\n"
+               "              keyframe every K frames (default 300) and on\n"
+               "              the 'keyframe' command\n"
+               "  --load PATH Start from a checkpoint (see 'save'); --ticks\n"
+               "              then counts ticks after it. Population agents\n"
+               "              all start from it with their own rng seeds\n"
+               "  --save PATH Write a checkpoint when the run ends (for a\n"
+               "              population: of the agent with the best score)\n"
+               "  --record PATH\n"
+               "              Record the interactive session's seeds and\n"
+               "              settings, with a checkpoint every N ticks\n"
+               "              (--record-interval, default 100000, 0: none)\n"
+               "  --replay PATH\n"
+               "              Re-run run R (default 1) of a recording to tick\n"
+               "              T (default: its end), then continue paused in\n"
+               "              the interactive mode; with --headless print\n"
+               "              the score at T instead\n"
+               "  --stats-interval N\n"
+               "              Add a tick statistics report to every Nth frame\n"
+               "              (default 0: only after a 'stats' command)\n"
+               "  --batch B   Run B headless agents with seeds seed..seed+B-1\n"
+               "              in lockstep on the batch engine, --chunk ticks\n"
+               "              per launch (dense rule only)\n"
+               "  --conformance\n"
+               "              With --batch: re-run every agent on the CPU\n"
+               "              engine and compare; exit status 1 on mismatch\n"
+               "  --serve PORT\n"
+               "              Serve the viewer on http://localhost:PORT and\n"
+               "              stream frames over WebSocket instead of stdout;\n"
+               "              viewers send commands as text messages (not\n"
+               "              save or load)\n"
+               "  --bind ADDR IPv4 address --serve and --coordinator listen\n"
+               "              on (default 127.0.0.1, this machine only;\n"
+               "              0.0.0.0 for every interface)\n"
+               "  --www DIR   Viewer files for --serve (default\n"
+               "              web_interface/public)\n"
+               "  --params NAME|PATH\n"
+               "              Rule parameters of headless runs: a preset\n"
+               "              (default, pow2) or a file of 'name value'\n"
+               "              lines over the defaults. Presets run on code\n"
+               "              compiled for their values, anything else on\n"
+               "              the runtime-parameter engine\n"
+               "  --param K=V Set one rule parameter (v_thresh,\n"
+               "              membrane_decay_period, spike_trace_window,\n"
+               "              eligibility_trace_window,\n"
+               "              confidence_leak_period,\n"
+               "              reinforcement_inertia_period, pruning_period,\n"
+               "              random_activity_period), after --params\n"
+               "  --metrics PATH\n"
+               "              Write per-window learning curves of headless\n"
+               "              and population runs to a columnar binary file\n"
+               "              (see MetricsWriter), one row per agent every\n"
+               "              N ticks (--metrics-window, default 1000)\n"
+               "  --rng       Random generator of headless runs: mt19937\n"
+               "              (default, the sequence of earlier versions)\n"
+               "              or philox, counter-based streams keyed by\n"
+               "              (seed, stream, tick). A loaded checkpoint\n"
+               "              keeps the generator it was saved with\n"
+               "  --coordinator PORT\n"
+               "              Run the sweep in FILE (--sweep) on the workers\n"
+               "              that connect to PORT and print one summary per\n"
+               "              job and per config; the other options are the\n"
+               "              settings the file does not vary. With --metrics\n"
+               "              every job's curves go to one file (agent: job)\n"
+               "  --worker HOST:PORT\n"
+               "              Run sweep jobs for a coordinator, --threads at\n"
+               "              a time (default: one per core)\n"
+               "  --sweep-dir DIR\n"
+               "              Coordinator results and checkpoints, kept to\n"
+               "              resume a sweep; worker scratch files (default\n"
+               "              sweep)\n"
+               "  --checkpoint-seconds S\n"
+               "              Between the checkpoints of a job (default 30)\n"
+               "  --neuron-kernel auto|scalar|avx2|neon\n"
+               "              Neuron update code (default auto: avx2 if\n"
+               "              this CPU runs it, else scalar; neon only when\n"
+               "              named). --conformance checks each against\n"
+               "              scalar\n";
+}
+
+// Returns false on a malformed command line
+bool parse_args(int argc, char **argv, Options &opts) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    try {
+      if (arg == "--headless") {
+        opts.headless = true;
+      } else if (arg == "--ticks" && has_value) {
+        opts.ticks = std::stoll(argv[++i]);
+      } else if (arg == "--seed" && has_value) {
+        opts.seed = static_cast<unsigned int>(std::stoul(argv[++i]));
+        opts.has_seed = true;
+      } else if (arg == "--engine" && has_value) {
+        std::string val = argv[++i];
+        if (val != "dense" && val != "event")
+          return false;
+        opts.engine = (val == "event") ? EVENT : DENSE;
+      } else if (arg == "--mode" && has_value) {
+        opts.reward_mode = std::stoi(argv[++i]);
+        if (opts.reward_mode < 0 || opts.reward_mode > 3)
+          return false;
+      } else if (arg == "--population" && has_value) {
+        opts.population = std::stoi(argv[++i]);
+        opts.headless = true;
+      } else if (arg == "--threads" && has_value) {
+        opts.threads = std::stoi(argv[++i]);
+      } else if (arg == "--chunk" && has_value) {
+        opts.chunk = std::stoll(argv[++i]);
+      } else if (arg == "--net-threads" && has_value) {
+        opts.net_threads = std::stoi(argv[++i]);
+      } else if (arg == "--neurons" && has_value) {
+        opts.neurons = std::stoi(argv[++i]);
+      } else if (arg == "--density" && has_value) {
+        opts.density = std::stod(argv[++i]);
+      } else if (arg == "--binary") {
+        opts.binary = true;
+      } else if (arg == "--delta") {
+        opts.binary = true;
+        opts.delta = true;
+      } else if (arg == "--keyframe-interval" && has_value) {
+        opts.keyframe_interval = std::stoi(argv[++i]);
+      } else if (arg == "--load" && has_value) {
+        opts.load_path = argv[++i];
+      } else if (arg == "--save" && has_value) {
+        opts.save_path = argv[++i];
+      } else if (arg == "--record" && has_value) {
+        opts.record_path = argv[++i];
+      } else if (arg == "--record-interval" && has_value) {
+        opts.record_interval = std::stoll(argv[++i]);
+      } else if (arg == "--replay" && has_value) {
+        opts.replay_path = argv[++i];
+      } else if (arg == "--replay-run" && has_value) {
+        opts.replay_run = std::stoi(argv[++i]);
+      } else if (arg == "--seek" && has_value) {
+        opts.seek = std::stoll(argv[++i]);
+      } else if (arg == "--stats-interval" && has_value) {
+        opts.stats_interval = std::stoi(argv[++i]);
+      } else if (arg == "--batch" && has_value) {
+        opts.batch = std::stoi(argv[++i]);
+        opts.headless = true;
+      } else if (arg == "--conformance") {
+        opts.conformance = true;
+      } else if (arg == "--serve" && has_value) {
+        opts.serve_port = std::stoi(argv[++i]);
+        if (opts.serve_port <= 0 || opts.serve_port > 65535)
+          return false;
+      } else if (arg == "--bind" && has_value) {
+        opts.bind_address = argv[++i];
+        in_addr addr;
+        if (inet_pton(AF_INET, opts.bind_address.c_str(), &addr) != 1)
+          return false;
+      } else if (arg == "--www" && has_value) {
+        opts.www = argv[++i];
+      } else if (arg == "--params" && has_value) {
+        opts.params = read_params(argv[++i]);
+      } else if (arg == "--rng" && has_value) {
+        std::string val = argv[++i];
+        if (val != "mt19937" && val != "philox")
+          return false;
+        opts.rng = (val == "philox") ? RNG_PHILOX : RNG_MT19937;
+      } else if (arg == "--neuron-kernel" && has_value) {
+        std::string val = argv[++i];
+        opts.neuron_kernel = -1;
+        for (int k = 0; k < KERNEL_COUNT; ++k) {
+          if (val == NEURON_KERNEL_NAMES[k])
+            opts.neuron_kernel = k;
+        }
+        if (val != "auto" &&
+            (opts.neuron_kernel < 0 ||
+             !neuron_kernel_supported(NeuronKernel(opts.neuron_kernel))))
+          return false;
+      } else if (arg == "--metrics" && has_value) {
+        opts.metrics_path = argv[++i];
+      } else if (arg == "--metrics-window" && has_value) {
+        opts.metrics_window = std::stoll(argv[++i]);
+      } else if (arg == "--coordinator" && has_value) {
+        opts.coordinator_port = std::stoi(argv[++i]);
+        opts.headless = true;
+        if (opts.coordinator_port <= 0 || opts.coordinator_port > 65535)
+          return false;
+      } else if (arg == "--sweep" && has_value) {
+        opts.sweep_path = argv[++i];
+      } else if (arg == "--sweep-dir" && has_value) {
+        opts.sweep_dir = argv[++i];
+      } else if (arg == "--worker" && has_value) {
+        opts.worker_address = argv[++i];
+        opts.headless = true;
+        if (opts.worker_address.find(':') == std::string::npos)
+          return false;
+      } else if (arg == "--checkpoint-seconds" && has_value) {
+        opts.checkpoint_seconds = std::stoi(argv[++i]);
+      } else if (arg == "--param" && has_value) {
+        const std::string val = argv[++i];
+        const size_t eq = val.find('=');
+        if (eq == std::string::npos ||
+            !set_param(opts.params, val.substr(0, eq),
+                       std::stoi(val.substr(eq + 1))))
+          return false;
+      } else {
+        return false;
+      }
+    } catch (const std::exception &) {
+      return false;
+    }
+  }
+  // A replayed session is not reproducible from its seeds, so it cannot
+  // be recorded; nor does --load mean anything on top of a replay
+  if (!opts.replay_path.empty() &&
+      (!opts.record_path.empty() || !opts.load_path.empty() ||
+       opts.population > 1))
+    return false;
+  // The batch engine replaces the population and runs only fresh or loaded
+  // agents
+  if ((opts.batch > 0 || opts.conformance) &&
+      (opts.batch <= 0 || opts.population > 1 || !opts.replay_path.empty()))
+    return false;
+  // Only the interactive session has viewers
+  if (opts.serve_port > 0 && (opts.headless || opts.population > 1))
+    return false;
+  // Sessions and recordings run under the defaults
+  if ((opts.params != DEFAULT_PARAMS || opts.rng != RNG_MT19937) &&
+      (!opts.headless || !opts.replay_path.empty()))
+    return false;
+  if (!params_valid(opts.params))
+    return false;
+  // Learning curves of training runs; a batch keeps no per-tick spike list
+  if (!opts.metrics_path.empty() &&
+      (!opts.headless || opts.batch > 0 || !opts.replay_path.empty()))
+    return false;
+  // A sweep runs its own jobs; workers take everything from the coordinator
+  const bool coordinator = opts.coordinator_port > 0,
+             worker = !opts.worker_address.empty();
+  if (coordinator != !opts.sweep_path.empty())
+    return false;
+  if ((coordinator || worker) &&
+      ((coordinator && worker) || opts.population > 1 || opts.batch > 0 ||
+       !opts.replay_path.empty() || !opts.load_path.empty() ||
+       !opts.save_path.empty() || (worker && !opts.metrics_path.empty())))
+    return false;
+  return opts.ticks >= 0 && opts.population > 0 && opts.threads >= 0 &&
+         opts.chunk > 0 && opts.net_threads > 0 && opts.keyframe_interval > 0 &&
+         opts.record_interval >= 0 && opts.replay_run > 0 && opts.seek >= -1 &&
+         opts.stats_interval >= 0 && opts.batch >= 0 &&
+         opts.metrics_window > 0 && opts.checkpoint_seconds > 0;
+}
+
+unsigned int clock_seed() {
+  return static_cast<unsigned int>(
+      std::chrono::system_clock::now().time_since_epoch().count());
+}
+
+// "params":{...}, and "rng", only for a run off the defaults; rng is the
+// generator the agents ran on (a loaded one keeps its own)
+void print_rules(const Options &opts, RngKind rng) {
+  if (opts.params != DEFAULT_PARAMS) {
+    std::cout << "\"params\":";
+    print_params(std::cout, opts.params);
+    std::cout << ",";
+  }
+  if (rng != RNG_MT19937)
+    std::cout << "\"rng\":\"philox\",";
+}
+
+template <class Net> void print_score(const Simulation<Net> &sim) {
+  std::cout << "\"food_eaten\":" << sim.world.food_eaten
+            << ",\"danger_hit\":" << sim.world.danger_hit
+            << ",\"reward_sum\":" << sim.reward_sum
+            << ",\"penalty_sum\":" << sim.penalty_sum;
+}
+
+// Runs one agent flat out and prints a JSON summary line
+template <class Net>
+int run_headless(const Options &opts,
+                 const typename Net::topology_type &topo =
+                     typename Net::topology_type(),
+                 const typename Net::rules_type &rules =
+                     typename Net::rules_type()) {
+  Simulation<Net> sim(opts.has_seed ? opts.seed : clock_seed(),
+                      opts.reward_mode, topo, rules, opts.rng);
+  sim.brain.set_engine(static_cast<Engine>(opts.engine));
+  sim.brain.set_threads(opts.net_threads);
+  // A loaded brain goes on with the checkpoint's rng, seed and generator
+  bool seed_known = true;
+  if (!opts.load_path.empty())
+    seed_known = load_checkpoint(sim, opts.load_path);
+  const std::string seed =
+      seed_known ? std::to_string(sim.rng.seed_used()) : "null";
+  const RngKind rng = sim.rng.rng_kind();
+  log_to_file("Headless run: " + std::to_string(opts.ticks) +
+              " ticks, seed " + (seed_known ? seed : "unknown") + ", " +
+              (rng == RNG_PHILOX ? "philox" : "mt19937") + ", " +
+              std::to_string(topo.size()) + " neurons" +
+              (opts.load_path.empty() ? "" : ", from " + opts.load_path));
+  std::unique_ptr<MetricsWriter> metrics;
+  std::unique_ptr<MetricsRecorder<Net>> recorder;
+  if (!opts.metrics_path.empty()) {
+    metrics.reset(new MetricsWriter(opts.metrics_path, opts.metrics_window));
+    recorder.reset(
+        new MetricsRecorder<Net>(*metrics, 0, opts.metrics_window, sim));
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  if (recorder) {
+    for (long long i = 0; i < opts.ticks; ++i) {
+      sim.tick();
+      recorder->tick(sim);
+    }
+    recorder->finish(sim);
+  } else {
+    for (long long i = 0; i < opts.ticks; ++i)
+      sim.tick();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  double secs = elapsed.count();
+  if (!opts.save_path.empty())
+    save_checkpoint(sim, opts.save_path);
+  if (metrics && !metrics->close())
+    return 1;
+
+  std::cout << "{\"ticks\":" << opts.ticks << ",\"seed\":" << seed
+            << ",\"neurons\":" << topo.size()
+            << ",\"synapses\":" << sim.brain.synapses.size()
+            << ",\"engine\":\"" << (opts.engine == EVENT ? "event" : "dense")
+            << "\",\"mode\":" << opts.reward_mode << ",";
+  print_rules(opts, rng);
+  print_score(sim);
+  std::cout << ",\"seconds\":" << secs << ",\"ticks_per_sec\":"
+            << (secs > 0 ? opts.ticks / secs : 0.0) << "}" << std::endl;
+  log_to_file("Headless run finished");
+  return 0;
+}
+
+// Population of independent agents. Each agent is advanced in chunks by pool
+// tasks that re-queue themselves on the worker that ran them, so fast agents
+// free their worker early and idle workers steal the remaining chunks.
+template <class Net = HeadlessNet> struct Population {
+  typedef typename Net::topology_type Topology;
+  typedef typename Net::rules_type Rules;
+
+  const Options &opts;
+  Topology topo;
+  Rules rules;
+  unsigned int base_seed;
+  std::vector<std::unique_ptr<Simulation<Net>>> agents;
+  std::vector<double> busy_secs; // Time spent advancing each agent
+  std::vector<long long> end_tick; // Agent tick at which it is done
+  MetricsWriter *metrics; // Shared by the agents' recorders, may be null
+  std::vector<std::unique_ptr<MetricsRecorder<Net>>> recorders;
+  WorkStealingPool pool;
+
+  Population(const Options &_opts, unsigned int _base_seed, int threads,
+             const Topology &_topo = Topology(), const Rules &_rules = Rules(),
+             MetricsWriter *_metrics = nullptr)
+      : opts(_opts), topo(_topo), rules(_rules), base_seed(_base_seed),
+        agents(_opts.population),
+        busy_secs(_opts.population, 0.0), end_tick(_opts.population, 0),
+        metrics(_metrics), recorders(_opts.population), pool(threads) {}
+
+  void run() {
+    for (int a = 0; a < (int)agents.size(); ++a)
+      pool.push(a, [this, a](int w) { run_chunk(a, w); });
+    pool.run();
+  }
+
+  void run_chunk(int a, int worker) {
+    auto start = std::chrono::steady_clock::now();
+    if (!agents[a]) {
+      // Built by its first worker so the brain is allocated there
+      agents[a].reset(new Simulation<Net>(
+          base_seed + a, opts.reward_mode, topo, rules, opts.rng));
+      agents[a]->brain.set_engine(static_cast<Engine>(opts.engine));
+      agents[a]->brain.set_threads(opts.net_threads);
+      if (!opts.load_path.empty()) {
+        // Same trained brain, but each agent keeps its own rng stream
+        load_checkpoint(*agents[a], opts.load_path);
+        agents[a]->rng.seed(base_seed + a);
+      }
+      end_tick[a] = agents[a]->t + opts.ticks;
+      if (metrics)
+        recorders[a].reset(new MetricsRecorder<Net>(
+            *metrics, a, opts.metrics_window, *agents[a]));
+    }
+    Simulation<Net> &sim = *agents[a];
+    long long end = std::min<long long>(sim.t + opts.chunk, end_tick[a]);
+    if (MetricsRecorder<Net> *recorder = recorders[a].get()) {
+      while (sim.t < end) {
+        sim.tick();
+        recorder->tick(sim);
+      }
+      if (sim.t == end_tick[a])
+        recorder->finish(sim);
+    } else {
+      while (sim.t < end)
+        sim.tick();
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    busy_secs[a] += elapsed.count();
+    if (sim.t < end_tick[a])
+      pool.push(worker, [this, a](int w) { run_chunk(a, w); });
+  }
+};
+
+// Runs opts.population agents on the thread pool and prints one JSON line per
+// agent followed by a population summary
+template <class Net = HeadlessNet>
+int run_population(const Options &opts,
+                   const typename Net::topology_type &topo =
+                       typename Net::topology_type(),
+                   const typename Net::rules_type &rules =
+                       typename Net::rules_type()) {
+  unsigned int base_seed = opts.has_seed ? opts.seed : clock_seed();
+  int threads = opts.threads;
+  if (threads == 0)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  log_to_file("Population run: " + std::to_string(opts.population) +
+              " agents x " + std::to_string(opts.ticks) + " ticks, " +
+              std::to_string(topo.size()) + " neurons, on " +
+              std::to_string(threads) + " threads");
+
+  std::unique_ptr<MetricsWriter> metrics;
+  if (!opts.metrics_path.empty())
+    metrics.reset(new MetricsWriter(opts.metrics_path, opts.metrics_window));
+  Population<Net> pop(opts, base_seed, threads, topo, rules, metrics.get());
+  auto start = std::chrono::steady_clock::now();
+  pop.run();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  double secs = elapsed.count();
+
+  int food_min = 0, food_max = 0, danger_min = 0, danger_max = 0;
+  double food_sum = 0, danger_sum = 0, reward_sum = 0, penalty_sum = 0;
+  int best = 0; // Most food minus danger, lowest index on ties
+  for (int a = 0; a < opts.population; ++a) {
+    const Simulation<Net> &sim = *pop.agents[a];
+    std::cout << "{\"agent\":" << a << ",\"seed\":" << base_seed + a << ",";
+    print_score(sim);
+    std::cout << ",\"seconds\":" << pop.busy_secs[a] << "}" << std::endl;
+
+    int food = sim.world.food_eaten, danger = sim.world.danger_hit;
+    food_min = (a == 0) ? food : std::min(food_min, food);
+    food_max = (a == 0) ? food : std::max(food_max, food);
+    danger_min = (a == 0) ? danger : std::min(danger_min, danger);
+    danger_max = (a == 0) ? danger : std::max(danger_max, danger);
+    food_sum += food;
+    danger_sum += danger;
+    reward_sum += sim.reward_sum;
+    penalty_sum += sim.penalty_sum;
+    const Simulation<Net> &top = *pop.agents[best];
+    if (food - danger > top.world.food_eaten - top.world.danger_hit)
+      best = a;
+  }
+  if (!opts.save_path.empty()) {
+    save_checkpoint(*pop.agents[best], opts.save_path);
+    log_to_file("Saved agent " + std::to_string(best) + " to " +
+                opts.save_path);
+  }
+  if (metrics && !metrics->close())
+    return 1;
+
+  double n = opts.population;
+  std::cout << "{\"population\":" << opts.population
+            << ",\"threads\":" << threads << ",\"ticks\":" << opts.ticks
+            << ",\"neurons\":" << topo.size()
+            << ",\"engine\":\"" << (opts.engine == EVENT ? "event" : "dense")
+            << "\",\"mode\":" << opts.reward_mode << ",";
+  print_rules(opts, pop.agents[0]->rng.rng_kind());
+  std::cout << "\"food_eaten\":{\"mean\":" << food_sum / n
+            << ",\"min\":" << food_min << ",\"max\":" << food_max << "}"
+            << ",\"danger_hit\":{\"mean\":" << danger_sum / n
+            << ",\"min\":" << danger_min << ",\"max\":" << danger_max << "}"
+            << ",\"reward_sum\":{\"mean\":" << reward_sum / n << "}"
+            << ",\"penalty_sum\":{\"mean\":" << penalty_sum / n << "}"
+            << ",\"seconds\":" << secs << ",\"ticks_per_sec\":"
+            << (secs > 0 ? n * opts.ticks / secs : 0.0) << "}" << std::endl;
+  log_to_file("Population run finished");
+  return 0;
+}
+
+// Whether a batch lane agrees with its CPU reference: scores, neurons and
+// synapse state
+template <class Net>
+bool same_agent(const Simulation<Net> &a, const Simulation<Net> &b) {
+  if (a.world.food_eaten != b.world.food_eaten ||
+      a.world.danger_hit != b.world.danger_hit ||
+      a.reward_sum != b.reward_sum || a.penalty_sum != b.penalty_sum ||
+      a.brain.synapses.size() != b.brain.synapses.size())
+    return false;
+  for (int i = 0; i < a.brain.topo.size(); ++i) {
+    if (a.brain.neurons.voltage[i] != b.brain.neurons.voltage[i] ||
+        a.brain.neurons.spiked(i) != b.brain.neurons.spiked(i))
+      return false;
+  }
+  for (int s = 0; s < a.brain.synapses.size(); ++s) {
+    if (a.brain.synapses.targets[s] != b.brain.synapses.targets[s] ||
+        a.brain.synapses.state[s].confidence !=
+            b.brain.synapses.state[s].confidence ||
+        a.brain.synapses.state[s].ticks_since_ltp !=
+            b.brain.synapses.state[s].ticks_since_ltp)
+      return false;
+  }
+  return true;
+}
+
+// Runs opts.batch agents on the batch engine and prints one JSON line per
+// agent and a summary. With --conformance each agent is then re-run by
+// Simulation on the CPU and every neuron kernel checked against the scalar
+// one; any difference is reported and fails the run.
+template <class Topology, class Rules = DefaultRules>
+int run_batch(const Options &opts, const Topology &topo = Topology(),
+              const Rules &rules = Rules()) {
+  typedef AgentBatch<Topology, Rules> Batch;
+  typedef typename Batch::Agent Agent;
+  unsigned int base_seed = opts.has_seed ? opts.seed : clock_seed();
+  int threads = opts.threads;
+  if (threads == 0)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  log_to_file("Batch run: " + std::to_string(opts.batch) + " agents x " +
+              std::to_string(opts.ticks) + " ticks, " +
+              std::to_string(topo.size()) + " neurons");
+
+  // Agents are wired (or loaded) on the CPU, then copied into their lanes
+  auto make_agent = [&](int a) {
+    std::unique_ptr<Agent> sim(
+        new Agent(base_seed + a, opts.reward_mode, topo, rules, opts.rng));
+    if (!opts.load_path.empty()) {
+      load_checkpoint(*sim, opts.load_path);
+      sim->rng.seed(base_seed + a);
+    }
+    return sim;
+  };
+  Batch batch(opts.batch, topo, rules);
+  for (int a = 0; a < opts.batch; ++a)
+    batch.upload(a, *make_agent(a));
+  batch.set_threads(threads);
+
+  auto start = std::chrono::steady_clock::now();
+  for (long long done = 0; done < opts.ticks;) {
+    const int launch =
+        static_cast<int>(std::min<long long>(opts.chunk, opts.ticks - done));
+    batch.run(launch);
+    done += launch;
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  double secs = elapsed.count();
+
+  int best = 0; // Most food minus danger, lowest index on ties
+  for (int a = 0; a < opts.batch; ++a) {
+    const World &w = batch.worlds[a];
+    std::cout << "{\"agent\":" << a << ",\"seed\":" << base_seed + a
+              << ",\"food_eaten\":" << w.food_eaten
+              << ",\"danger_hit\":" << w.danger_hit
+              << ",\"reward_sum\":" << batch.loops[a].reward_sum
+              << ",\"penalty_sum\":" << batch.loops[a].penalty_sum << "}"
+              << std::endl;
+    const World &top = batch.worlds[best];
+    if (w.food_eaten - w.danger_hit > top.food_eaten - top.danger_hit)
+      best = a;
+  }
+  if (!opts.save_path.empty()) {
+    std::unique_ptr<Agent> sim = make_agent(best);
+    batch.download(best, *sim);
+    save_checkpoint(*sim, opts.save_path);
+    log_to_file("Saved agent " + std::to_string(best) + " to " +
+                opts.save_path);
+  }
+
+  int mismatches = 0, kernel_mismatches = 0;
+  double reference_secs = 0;
+  if (opts.conformance) {
+    for (int a = 0; a < opts.batch; ++a) {
+      std::unique_ptr<Agent> ref = make_agent(a);
+      auto ref_start = std::chrono::steady_clock::now();
+      for (long long i = 0; i < opts.ticks; ++i)
+        ref->tick();
+      std::chrono::duration<double> ref_elapsed =
+          std::chrono::steady_clock::now() - ref_start;
+      reference_secs += ref_elapsed.count();
+
+      std::unique_ptr<Agent> lane = make_agent(a);
+      batch.download(a, *lane);
+      if (same_agent(*ref, *lane))
+        continue;
+      ++mismatches;
+      std::cout << "{\"mismatch\":" << a << ",\"seed\":" << base_seed + a
+                << ",\"reference\":{";
+      print_score(*ref);
+      std::cout << "},\"batch\":{";
+      print_score(*lane);
+      std::cout << "}}" << std::endl;
+    }
+    log_to_file("Conformance: " + std::to_string(mismatches) + " of " +
+                std::to_string(opts.batch) + " agents differ");
+    // Every neuron kernel this CPU runs, not only the one the lanes used
+    for (int k = KERNEL_SCALAR + 1; k < KERNEL_COUNT; ++k) {
+      const NeuronKernel kernel = static_cast<NeuronKernel>(k);
+      if (!neuron_kernel_supported(kernel) || neuron_kernel_agrees(kernel))
+        continue;
+      ++kernel_mismatches;
+      std::cout << "{\"kernel_mismatch\":\"" << NEURON_KERNEL_NAMES[k]
+                << "\"}" << std::endl;
+      log_to_file(std::string("Conformance: neuron kernel ") +
+                  NEURON_KERNEL_NAMES[k] + " differs from scalar");
+    }
+  }
+
+  double n = opts.batch;
+  std::cout << "{\"batch\":" << opts.batch << ",\"threads\":" << threads
+            << ",\"ticks\":" << opts.ticks << ",\"neurons\":" << topo.size()
+            << ",\"mode\":" << opts.reward_mode << ",";
+  print_rules(opts, batch.rngs[0].rng_kind());
+  std::cout << "\"seconds\":" << secs << ",\"ticks_per_sec\":"
+            << (secs > 0 ? n * opts.ticks / secs : 0.0);
+  if (opts.conformance)
+    std::cout << ",\"conformance\":\""
+              << (mismatches || kernel_mismatches ? "fail" : "pass")
+              << "\",\"mismatches\":" << mismatches
+              << ",\"kernel_mismatches\":" << kernel_mismatches
+              << ",\"reference_seconds\":" << reference_secs;
+  std::cout << "}" << std::endl;
+  log_to_file("Batch run finished");
+  return mismatches || kernel_mismatches ? 1 : 0;
+}
+
+// Calls run(rules) with the rules policy for params: the preset compiled
+// for them if there is one (full speed), RuntimeRules otherwise
+template <class Run> int dispatch_rules(const Params &params, Run run) {
+  if (params == DEFAULT_PARAMS)
+    return run(PresetRules<DEFAULT_PARAMS>());
+  if (params == POW2_PARAMS)
+    return run(PresetRules<POW2_PARAMS>());
+  return run(RuntimeRules(params));
+}
+
+// --- Sweeps ---
+// A parameter sweep over several machines. The coordinator (--coordinator
+// PORT --sweep FILE) expands the sweep file into jobs, one per (config,
+// seed), and hands them to the workers (--worker HOST:PORT) that connect,
+// as many at a time as each has slots. Workers stream back metrics rows,
+// a checkpoint every --checkpoint-seconds and the final score. A worker
+// that disconnects or goes quiet loses its jobs to the others, which
+// resume them from their last checkpoint; once the queue is empty, idle
+// slots back up jobs that have run long, and the first copy to finish
+// wins. The coordinator keeps results and checkpoints in --sweep-dir, so
+// a coordinator restarted on the same sweep skips what is done.
+//
+// The protocol is lines of "word name=value ..."; a line with bytes=N is
+// followed by N raw bytes. Worker to coordinator:
+//   hello slots=N
+//   ping
+//   checkpoint job=J tick=T seconds=S bytes=N
+//   metrics job=J <one value per metrics column>
+//   result job=J food_eaten=F danger_hit=D reward_sum=R penalty_sum=P
+//          seconds=S
+//   failed job=J <message>
+// Coordinator to worker:
+//   job job=J seed=S <setting>=<value>... metrics_window=W
+//       checkpoint_seconds=C seconds=S bytes=N (N > 0: a checkpoint to
+//       resume from)
+// seconds= is the job's run time up to the checkpoint or result, the runs
+// it was resumed from included. The coordinator keeps each checkpoint's
+// tick and seconds as a checkpoint line in results.txt.
+//   cancel job=J
+//   done
+const int SWEEP_PING_SECONDS = 5;     // Worker heartbeat
+const int SWEEP_TIMEOUT_SECONDS = 30; // Silence after which a worker is lost
+const int SWEEP_BACKUP_SECONDS = 60;  // Running time before a backup copy
+const int SWEEP_MAX_FAILURES = 3;     // Failed runs before a job is given up
+const int SWEEP_CONNECT_SECONDS = 60; // Worker retries to reach the coordinator
+const long long SWEEP_CHUNK = 10000;  // Ticks between cancel checks
+const size_t SWEEP_LINE_LIMIT = 64 << 10;
+const long long SWEEP_PAYLOAD_LIMIT = 1LL << 32; // Checkpoint bytes
+
+// Everything a job runs with but its seed
+struct SweepConfig {
+  Params params;
+  int neurons;
+  double density;
+  int mode;
+  int engine;
+  RngKind rng;
+  long long ticks;
+};
+
+// Settings other than the rule parameters, in protocol order
+const char *const SWEEP_SETTINGS[] = {"ticks",  "neurons", "density",
+                                      "mode",   "engine",  "rng"};
+
+// Shortest text that reads back as the same double
+std::string exact_text(double v) {
+  std::ostringstream os;
+  os << std::setprecision(15) << v;
+  if (std::stod(os.str()) != v) {
+    os.str("");
+    os << std::setprecision(17) << v;
+  }
+  return os.str();
+}
+
+// False if name is not a setting or value not one of its values
+bool set_sweep_setting(SweepConfig &c, const std::string &name,
+                       const std::string &value) {
+  try {
+    if (name == "ticks") {
+      c.ticks = std::stoll(value);
+    } else if (name == "neurons") {
+      c.neurons = std::stoi(value);
+    } else if (name == "density") {
+      c.density = std::stod(value);
+    } else if (name == "mode") {
+      c.mode = std::stoi(value);
+    } else if (name == "engine") {
+      if (value != "dense" && value != "event")
+        return false;
+      c.engine = value == "event" ? EVENT : DENSE;
+    } else if (name == "rng") {
+      if (value != "mt19937" && value != "philox")
+        return false;
+      c.rng = value == "philox" ? RNG_PHILOX : RNG_MT19937;
+    } else {
+      return set_param(c.params, name, std::stoi(value));
+    }
+  } catch (const std::exception &) {
+    return false;
+  }
+  return true;
+}
+
+std::string sweep_setting(const SweepConfig &c, const std::string &name) {
+  if (name == "ticks")
+    return std::to_string(c.ticks);
+  if (name == "neurons")
+    return std::to_string(c.neurons);
+  if (name == "density")
+    return exact_text(c.density);
+  if (name == "mode")
+    return std::to_string(c.mode);
+  if (name == "engine")
+    return c.engine == EVENT ? "event" : "dense";
+  if (name == "rng")
+    return c.rng == RNG_PHILOX ? "philox" : "mt19937";
+  for (const ParamField &f : PARAM_FIELDS)
+    if (name == f.name)
+      return std::to_string(c.params.*f.field);
+  return std::string();
+}
+
+bool sweep_config_valid(const SweepConfig &c) {
+  return params_valid(c.params) && c.neurons > 12 && c.density >= 0 &&
+         c.density <= 1 && c.mode >= 0 && c.mode <= 3 && c.ticks >= 0 &&
+         c.ticks <= INT_MAX;
+}
+
+// name=value for every setting
+std::string sweep_config_text(const SweepConfig &c) {
+  std::string text;
+  for (const char *name : SWEEP_SETTINGS)
+    text += std::string(text.empty() ? "" : " ") + name + "=" +
+            sweep_setting(c, name);
+  for (const ParamField &f : PARAM_FIELDS)
+    text += std::string(" ") + f.name + "=" + sweep_setting(c, f.name);
+  return text;
+}
+
+// Job j is seed j % seeds.size() of config j / seeds.size()
+struct Sweep {
+  std::vector<SweepConfig> configs;
+  std::vector<unsigned int> seeds;
+  std::vector<std::string> settings; // Set by the sweep file, in its order
+  std::string id; // Hash of the job list, ties a sweep directory to it
+
+  int jobs() const { return static_cast<int>(configs.size() * seeds.size()); }
+  const SweepConfig &config(int j) const { return configs[j / seeds.size()]; }
+  unsigned int seed(int j) const { return seeds[j % seeds.size()]; }
+};
+
+// Reads a sweep file: lines of "setting value...", '#' comments. Settings
+// are SWEEP_SETTINGS and the rule parameters, over base; "seeds" takes
+// numbers and ranges (1-8). Configs are every combination of the values,
+// the last line varying fastest. Throws std::runtime_error.
+Sweep read_sweep(const std::string &path, const SweepConfig &base,
+                 unsigned int base_seed) {
+  std::ifstream in(path);
+  if (!in)
+    throw std::runtime_error("cannot open " + path);
+  Sweep sweep;
+  std::vector<std::vector<std::string>> axes; // Values per setting
+  std::string line;
+  for (int n = 1; std::getline(in, line); ++n) {
+    std::istringstream fields(line.substr(0, line.find('#')));
+    const std::string where = path + ":" + std::to_string(n) + ": ";
+    std::string name, value;
+    if (!(fields >> name))
+      continue;
+    std::vector<std::string> values;
+    while (fields >> value)
+      values.push_back(value);
+    if (values.empty())
+      throw std::runtime_error(where + "no values for " + name);
+    if (std::find(sweep.settings.begin(), sweep.settings.end(), name) !=
+            sweep.settings.end() ||
+        (name == "seeds" && !sweep.seeds.empty()))
+      throw std::runtime_error(where + name + " is set twice");
+    if (name == "seeds") {
+      for (const std::string &v : values) {
+        const size_t dash = v.find('-');
+        try {
+          const unsigned long lo = std::stoul(v.substr(0, dash));
+          const unsigned long hi =
+              dash == std::string::npos ? lo : std::stoul(v.substr(dash + 1));
+          if (hi < lo || hi > UINT_MAX || hi - lo >= 1000000)
+            throw std::out_of_range(v);
+          for (unsigned long s = lo; s <= hi; ++s)
+            sweep.seeds.push_back(static_cast<unsigned int>(s));
+        } catch (const std::exception &) {
+          throw std::runtime_error(where + "bad seeds " + v);
+        }
+      }
+      continue;
+    }
+    if (sweep_setting(base, name).empty())
+      throw std::runtime_error(where + "unknown setting " + name);
+    SweepConfig probe = base;
+    for (const std::string &v : values)
+      if (!set_sweep_setting(probe, name, v))
+        throw std::runtime_error(where + "bad value " + v + " for " + name);
+    sweep.settings.push_back(name);
+    axes.push_back(values);
+  }
+  if (sweep.seeds.empty())
+    sweep.seeds.push_back(base_seed);
+
+  std::vector<size_t> pick(axes.size(), 0);
+  for (;;) {
+    SweepConfig c = base;
+    for (size_t k = 0; k < axes.size(); ++k)
+      set_sweep_setting(c, sweep.settings[k], axes[k][pick[k]]);
+    if (!sweep_config_valid(c))
+      throw std::runtime_error(path + ": out of range: " +
+                               sweep_config_text(c));
+    sweep.configs.push_back(c);
+    if (sweep.configs.size() * sweep.seeds.size() > INT_MAX / 2)
+      throw std::runtime_error(path + ": too many jobs");
+    size_t k = axes.size();
+    while (k > 0 && ++pick[k - 1] == axes[k - 1].size())
+      pick[--k] = 0;
+    if (k == 0)
+      break;
+  }
+
+  uint64_t h = 1469598103934665603ULL; // FNV-1a
+  auto mix = [&h](const std::string &text) {
+    for (unsigned char ch : text + "\n")
+      h = (h ^ ch) * 1099511628211ULL;
+  };
+  for (unsigned int s : sweep.seeds)
+    mix(std::to_string(s));
+  for (const SweepConfig &c : sweep.configs)
+    mix(sweep_config_text(c));
+  std::ostringstream id;
+  id << std::hex << std::setw(16) << std::setfill('0') << h;
+  sweep.id = id.str();
+  return sweep;
+}
+
+// One protocol message: the first word, name=value fields, other values
+// and the payload that followed a bytes=N line
+struct SweepMessage {
+  std::string word;
+  std::map<std::string, std::string> fields;
+  std::vector<std::string> values;
+  std::string payload;
+
+  SweepMessage() {}
+  explicit SweepMessage(const std::string &line) {
+    std::istringstream in(line);
+    in >> word;
+    std::string token;
+    while (in >> token) {
+      const size_t eq = token.find('=');
+      if (eq == std::string::npos)
+        values.push_back(token);
+      else
+        fields[token.substr(0, eq)] = token.substr(eq + 1);
+    }
+  }
+
+  bool has(const std::string &name) const { return fields.count(name) > 0; }
+
+  // Throws std::runtime_error if the field is missing or not a number
+  long long number(const std::string &name) const {
+    auto it = fields.find(name);
+    try {
+      if (it != fields.end())
+        return std::stoll(it->second);
+    } catch (const std::exception &) {
+    }
+    throw std::runtime_error("bad " + word + " message: no number " + name);
+  }
+
+  double real(const std::string &name) const {
+    auto it = fields.find(name);
+    try {
+      if (it != fields.end())
+        return std::stod(it->second);
+    } catch (const std::exception &) {
+    }
+    throw std::runtime_error("bad " + word + " message: no number " + name);
+  }
+};
+
+// Cuts a received byte stream into messages
+class SweepStream {
+public:
+  SweepStream() : pos(0), waiting(false), need(0) {}
+
+  void append(const char *data, size_t size) { buffer.append(data, size); }
+
+  // False until another message is complete; throws std::runtime_error on
+  // a stream that is not the protocol
+  bool next(SweepMessage &msg) {
+    if (!waiting) {
+      const size_t eol = buffer.find('\n', pos);
+      if (eol == std::string::npos) {
+        if (buffer.size() - pos > SWEEP_LINE_LIMIT)
+          throw std::runtime_error("protocol line too long");
+        compact();
+        return false;
+      }
+      pending = SweepMessage(buffer.substr(pos, eol - pos));
+      pos = eol + 1;
+      need = pending.has("bytes") ? pending.number("bytes") : 0;
+      if (need < 0 || need > SWEEP_PAYLOAD_LIMIT)
+        throw std::runtime_error("bad payload size");
+      waiting = true;
+    }
+    if (static_cast<long long>(buffer.size() - pos) < need) {
+      compact();
+      return false;
+    }
+    pending.payload = buffer.substr(pos, static_cast<size_t>(need));
+    pos += static_cast<size_t>(need);
+    waiting = false;
+    msg = std::move(pending);
+    pending = SweepMessage();
+    return true;
+  }
+
+private:
+  void compact() {
+    buffer.erase(0, pos);
+    pos = 0;
+  }
+
+  std::string buffer;
+  size_t pos; // Start of what is not parsed yet
+  bool waiting; // pending has its line, the payload is still coming
+  long long need;
+  SweepMessage pending;
+};
+
+struct SweepResult {
+  int food_eaten;
+  int danger_hit;
+  int reward_sum;
+  int penalty_sum;
+  double seconds;
+};
+
+std::string sweep_result_text(int job, const SweepResult &r) {
+  std::ostringstream os;
+  os << "result job=" << job << " food_eaten=" << r.food_eaten
+     << " danger_hit=" << r.danger_hit << " reward_sum=" << r.reward_sum
+     << " penalty_sum=" << r.penalty_sum << " seconds=" << r.seconds << "\n";
+  return os.str();
+}
+
+SweepResult sweep_result(const SweepMessage &msg) {
+  SweepResult r;
+  r.food_eaten = static_cast<int>(msg.number("food_eaten"));
+  r.danger_hit = static_cast<int>(msg.number("danger_hit"));
+  r.reward_sum = static_cast<int>(msg.number("reward_sum"));
+  r.penalty_sum = static_cast<int>(msg.number("penalty_sum"));
+  r.seconds = msg.real("seconds");
+  return r;
+}
+
+std::string read_file(const std::string &path) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in)
+    throw std::runtime_error("cannot read " + path);
+  std::ostringstream os;
+  os << in.rdbuf();
+  return os.str();
+}
+
+// Through a temporary file, so path is always whole
+void write_file(const std::string &path, const std::string &data) {
+  const std::string tmp = path + ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    out.write(data.data(), data.size());
+    if (!out.flush())
+      throw std::runtime_error("cannot write " + tmp);
+  }
+  std::filesystem::rename(tmp, path);
+}
+
+class SweepCoordinator {
+public:
+  SweepCoordinator(const Options &_opts, const Sweep &_sweep)
+      : opts(_opts), sweep(_sweep), jobs(_sweep.jobs()), listener(NO_SOCKET),
+        next_worker(1), joined(0), finished(0), failed(0), ending(false),
+        disk_ok(true) {}
+
+  // Runs the sweep to the end and prints the summary; exit status
+  int run() {
+    std::filesystem::create_directories(opts.sweep_dir);
+    const bool resumed = restore();
+    const int restored = finished;
+    if (!opts.metrics_path.empty()) {
+      metrics.reset(
+          new MetricsWriter(opts.metrics_path, opts.metrics_window, resumed));
+      for (auto &kv : metrics->last_tick)
+        if (kv.first >= 0 && kv.first < sweep.jobs())
+          jobs[kv.first].metrics_tick = kv.second;
+    }
+    for (int j = 0; j < sweep.jobs(); ++j)
+      if (jobs[j].state == JOB_PENDING)
+        queue.push_back(j);
+    sockets_begin();
+    listener = open_listener(opts.bind_address, opts.coordinator_port);
+    if (listener == NO_SOCKET) {
+      sockets_end();
+      throw std::runtime_error("sweep: cannot listen on " +
+                               opts.bind_address + ":" +
+                               std::to_string(opts.coordinator_port));
+    }
+    log_to_file("Sweep " + sweep.id + ": " + std::to_string(sweep.jobs()) +
+                " jobs, " + std::to_string(restored) + " done before");
+    std::cerr << "[CPP] Sweep: " << sweep.jobs() << " jobs ("
+              << sweep.configs.size() << " configs x " << sweep.seeds.size()
+              << " seeds), " << restored << " done; listening on port "
+              << opts.coordinator_port << std::endl;
+
+    auto start = std::chrono::steady_clock::now();
+    while (finished < sweep.jobs()) {
+      poll_once(200);
+      drop_silent();
+      assign();
+    }
+    // Let the workers go, giving the goodbyes a moment to leave
+    ending = true;
+    for (auto &w : workers)
+      w->out += "done\n";
+    for (int k = 0; k < 10 && !workers.empty(); ++k) {
+      poll_once(100);
+      for (size_t i = workers.size(); i-- > 0;)
+        if (workers[i]->out.empty())
+          remove_worker(i);
+    }
+    while (!workers.empty())
+      remove_worker(workers.size() - 1);
+    close_socket(listener);
+    sockets_end();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    bool wrote = true;
+    if (metrics) {
+      for (Job &job : jobs)
+        keep_rows(job);
+      wrote = metrics->close();
+    }
+    print_summary(elapsed.count());
+    return failed == 0 && disk_ok && wrote ? 0 : 1;
+  }
+
+private:
+  enum JobState { JOB_PENDING, JOB_RUNNING, JOB_DONE, JOB_FAILED };
+
+  struct Job {
+    JobState state;
+    std::vector<int> copies; // Ids of the workers running it
+    std::chrono::steady_clock::time_point started; // Of the first copy
+    long long checkpoint_tick; // Of job<J>.ck, -1: none
+    double checkpoint_secs;    // Run time up to it
+    int64_t metrics_tick;      // Last metrics row kept
+    int failures;
+    SweepResult result;
+    std::unique_ptr<MetricsBlock> rows; // Not handed to the writer yet
+
+    Job()
+        : state(JOB_PENDING), checkpoint_tick(-1), checkpoint_secs(0),
+          metrics_tick(0), failures(0), result() {}
+  };
+
+  struct Worker {
+    socket_t fd;
+    int id;
+    std::string name; // Address, for the log
+    int slots;        // 0 until its hello
+    std::vector<int> jobs;
+    SweepStream in;
+    std::string out; // Not taken by the socket yet
+    std::chrono::steady_clock::time_point heard;
+    bool dead;
+    std::string why; // Of dead
+  };
+
+  std::string results_path() const { return opts.sweep_dir + "/results.txt"; }
+
+  std::string checkpoint_path(int j) const {
+    return opts.sweep_dir + "/job" + std::to_string(j) + ".ck";
+  }
+
+  // Takes the results of an earlier coordinator of this sweep, or starts
+  // the results file; true if there was one
+  bool restore() {
+    const std::string path = results_path();
+    const std::string header =
+        "sweep id=" + sweep.id + " jobs=" + std::to_string(sweep.jobs());
+    std::ifstream in(path);
+    if (!in) {
+      results.open(path, std::ios::trunc);
+      results << header << std::endl;
+      if (!results)
+        throw std::runtime_error("cannot write " + path);
+      return false;
+    }
+    std::string line;
+    if (!std::getline(in, line) || line != header)
+      throw std::runtime_error(path + " belongs to another sweep");
+    std::vector<long long> saved_tick(sweep.jobs(), 0);
+    std::vector<double> saved_secs(sweep.jobs(), 0);
+    while (std::getline(in, line)) {
+      SweepMessage msg(line);
+      const int j = job_of(msg);
+      if (j < 0 || jobs[j].state == JOB_DONE)
+        continue;
+      try {
+        if (msg.word == "checkpoint") {
+          saved_tick[j] = msg.number("tick");
+          saved_secs[j] = msg.real("seconds");
+          continue;
+        }
+        if (msg.word != "result")
+          continue;
+        jobs[j].result = sweep_result(msg);
+      } catch (const std::runtime_error &) {
+        continue; // The line a crash cut short
+      }
+      jobs[j].state = JOB_DONE;
+      ++finished;
+    }
+    for (int j = 0; j < sweep.jobs(); ++j)
+      if (jobs[j].state == JOB_PENDING && std::ifstream(checkpoint_path(j))) {
+        jobs[j].checkpoint_tick = saved_tick[j];
+        jobs[j].checkpoint_secs = saved_secs[j];
+      }
+    results.open(path, std::ios::app);
+    if (!results)
+      throw std::runtime_error("cannot write " + path);
+    return true;
+  }
+
+  // The job= of msg if it is a job of the sweep, -1 otherwise
+  int job_of(const SweepMessage &msg) const {
+    auto it = msg.fields.find("job");
+    if (it == msg.fields.end())
+      return -1;
+    try {
+      const long long j = std::stoll(it->second);
+      return j >= 0 && j < sweep.jobs() ? static_cast<int>(j) : -1;
+    } catch (const std::exception &) {
+      return -1;
+    }
+  }
+
+  void poll_once(int ms) {
+    std::vector<pollfd> fds(1 + workers.size());
+    fds[0].fd = listener;
+    fds[0].events = POLLIN;
+    for (size_t k = 0; k < workers.size(); ++k) {
+      fds[k + 1].fd = workers[k]->fd;
+      fds[k + 1].events =
+          static_cast<short>(POLLIN | (workers[k]->out.empty() ? 0 : POLLOUT));
+    }
+    if (poll_sockets(fds.data(), fds.size(), ms) < 0)
+      return;
+    for (size_t k = 0; k < workers.size(); ++k) {
+      Worker &w = *workers[k];
+      const short ev = fds[k + 1].revents;
+      if (ev & (POLLIN | POLLERR | POLLHUP | POLLNVAL))
+        receive(w);
+      if (!w.dead && (ev & POLLOUT))
+        flush(w);
+    }
+    if (fds[0].revents & POLLIN)
+      accept_workers();
+    for (size_t k = workers.size(); k-- > 0;)
+      if (workers[k]->dead)
+        remove_worker(k);
+  }
+
+  void accept_workers() {
+    for (;;) {
+      sockaddr_in addr;
+      socklen_t len = sizeof(addr);
+      socket_t fd =
+          accept(listener, reinterpret_cast<sockaddr *>(&addr), &len);
+      if (fd == NO_SOCKET)
+        return;
+      set_nonblocking(fd);
+      std::unique_ptr<Worker> w(new Worker());
+      w->fd = fd;
+      w->id = next_worker++;
+      char host[64] = "?";
+      inet_ntop(AF_INET, &addr.sin_addr, host, sizeof(host));
+      w->name = std::string(host) + ":" + std::to_string(ntohs(addr.sin_port));
+      w->slots = 0;
+      w->heard = std::chrono::steady_clock::now();
+      w->dead = false;
+      workers.push_back(std::move(w));
+    }
+  }
+
+  void receive(Worker &w) {
+    char buf[65536];
+    SweepMessage msg;
+    for (;;) {
+      const int n = static_cast<int>(recv(w.fd, buf, sizeof(buf), 0));
+      if (n > 0) {
+        w.in.append(buf, n);
+        continue;
+      }
+      if (n == 0 || !socket_would_block()) {
+        w.dead = true;
+        w.why = "disconnected";
+      }
+      break;
+    }
+    try {
+      while (w.in.next(msg))
+        handle(w, msg);
+    } catch (const std::exception &e) {
+      w.dead = true;
+      w.why = e.what();
+    }
+  }
+
+  void flush(Worker &w) {
+    const long long n = try_send(w.fd, w.out.data(), w.out.size());
+    if (n < 0) {
+      w.dead = true;
+      w.why = "disconnected";
     } else {
-      sensors[2] = is_left ? 1 : 0;
-      sensors[3] = !is_left ? 1 : 0;
+      w.out.erase(0, static_cast<size_t>(n));
     }
-    return sensors;
   }
 
-  WorldUpdateResult update(bool move_left, bool move_right) {
-    if (target_timer <= 0)
-      spawn_target();
+  void handle(Worker &w, const SweepMessage &msg) {
+    w.heard = std::chrono::steady_clock::now();
+    const int j = job_of(msg);
+    if (msg.word == "hello") {
+      w.slots = static_cast<int>(std::max(1LL, msg.number("slots")));
+      ++joined;
+      log_to_file("Sweep worker " + w.name + " joined with " +
+                  std::to_string(w.slots) + " slots");
+      std::cerr << "[CPP] Sweep: worker " << w.name << " joined ("
+                << w.slots << " slots)" << std::endl;
+    } else if (msg.word == "ping") {
+      // heard is all it is for
+    } else if (j < 0) {
+      throw std::runtime_error("bad message " + msg.word);
+    } else if (msg.word == "checkpoint") {
+      Job &job = jobs[j];
+      const long long tick = msg.number("tick");
+      const double secs = msg.real("seconds");
+      if (job.state == JOB_RUNNING && tick > job.checkpoint_tick) {
+        keep_rows(job); // The rows before it reach the file first
+        try {
+          write_file(checkpoint_path(j), msg.payload);
+          job.checkpoint_tick = tick;
+          job.checkpoint_secs = secs;
+          results << "checkpoint job=" << j << " tick=" << tick
+                  << " seconds=" << secs << std::endl;
+          if (!results)
+            disk_error("cannot write " + results_path());
+        } catch (const std::exception &e) {
+          disk_error(e.what());
+        }
+      }
+    } else if (msg.word == "metrics") {
+      keep_row(jobs[j], j, msg);
+    } else if (msg.word == "result") {
+      finish(w, j, sweep_result(msg));
+    } else if (msg.word == "failed") {
+      std::string why;
+      for (const std::string &v : msg.values)
+        why += (why.empty() ? "" : " ") + v;
+      fail(w, j, why);
+    } else {
+      throw std::runtime_error("bad message " + msg.word);
+    }
+  }
 
-    int prev_dist = -1;
-    if (target_type != NONE) {
-      prev_dist = std::abs(agent_pos - target_pos);
+  // Rows arrive in tick order per copy; copies and resumed runs repeat
+  // rows, which only the first one keeps
+  void keep_row(Job &job, int j, const SweepMessage &msg) {
+    if (!metrics || job.state == JOB_DONE || job.state == JOB_FAILED)
+      return;
+    if (msg.values.size() != MET_COUNT)
+      throw std::runtime_error("bad metrics message");
+    int64_t row[MET_COUNT];
+    double confidence;
+    try {
+      for (int c = 0; c < MET_COUNT; ++c)
+        row[c] = c == MET_MEAN_CONFIDENCE ? 0 : std::stoll(msg.values[c]);
+      confidence = std::stod(msg.values[MET_MEAN_CONFIDENCE]);
+    } catch (const std::exception &) {
+      throw std::runtime_error("bad metrics message");
     }
+    if (row[MET_TICK] <= job.metrics_tick)
+      return;
+    job.metrics_tick = row[MET_TICK];
+    if (!job.rows)
+      job.rows = metrics->take(j);
+    for (int c = 0; c < MET_COUNT; ++c)
+      if (c == MET_MEAN_CONFIDENCE)
+        job.rows->set(MET_MEAN_CONFIDENCE, confidence);
+      else
+        job.rows->set(static_cast<MetricColumn>(c), row[c]);
+    if (++job.rows->rows == METRICS_BLOCK_ROWS)
+      metrics->push(std::move(job.rows));
+  }
 
-    if (move_left)
-      agent_pos--;
-    if (move_right)
-      agent_pos++;
+  void keep_rows(Job &job) {
+    if (metrics && job.rows && job.rows->rows > 0)
+      metrics->push(std::move(job.rows));
+  }
 
-    // Teleport to center if out of bounds
-    if (agent_pos < 0 || agent_pos >= size) {
-      agent_pos = size / 2;
-      // If it was teleported, we skip reward/penalty for this specific frame
-      // to avoid weird distance jumps.
-      return {false, false};
+  void finish(Worker &w, int j, const SweepResult &result) {
+    Job &job = jobs[j];
+    if (job.state == JOB_DONE || job.state == JOB_FAILED)
+      return;
+    job.state = JOB_DONE;
+    job.result = result;
+    ++finished;
+    keep_rows(job);
+    results << sweep_result_text(j, result) << std::flush;
+    if (!results)
+      disk_error("cannot write " + results_path());
+    for (int id : job.copies)
+      if (id != w.id)
+        for (auto &other : workers)
+          if (other->id == id) {
+            other->out += "cancel job=" + std::to_string(j) + "\n";
+            release(*other, j);
+          }
+    release(w, j);
+    job.copies.clear();
+    std::remove(checkpoint_path(j).c_str());
+    log_to_file("Sweep job " + std::to_string(j) + " done by " + w.name +
+                " (" + std::to_string(finished) + "/" +
+                std::to_string(sweep.jobs()) + ")");
+  }
+
+  void fail(Worker &w, int j, const std::string &why) {
+    Job &job = jobs[j];
+    release(w, j);
+    leave(job, j, w.id);
+    if (job.state == JOB_DONE || job.state == JOB_FAILED)
+      return;
+    LOG_AT(LOG_ERROR, "Sweep job " + std::to_string(j) + " failed on " +
+                          w.name + ": " + why);
+    std::cerr << "[CPP] Sweep: job " << j << " failed on " << w.name << ": "
+              << why << std::endl;
+    if (++job.failures >= SWEEP_MAX_FAILURES && job.copies.empty()) {
+      job.state = JOB_FAILED;
+      ++finished;
+      ++failed;
     }
+  }
 
-    WorldUpdateResult res = {false, false};
-    if (target_type != NONE) {
-      int curr_dist = std::abs(agent_pos - target_pos);
-      int mode = g_reward_mode;
+  // The sweep goes on; the results stay in memory for the summary
+  void disk_error(const std::string &what) {
+    LOG_AT(LOG_ERROR, "Sweep: " + what);
+    if (disk_ok)
+      std::cerr << "[CPP] Sweep: " << what << std::endl;
+    disk_ok = false;
+  }
 
-      // Determine if current target is "Edible" or "Hazardous" based on mode
-      bool is_hazardous = false;
-      if (target_type == FOOD) {
-        if (mode == 1 || mode == 2)
-          is_hazardous = true;
-      } else if (target_type == DANGER) {
-        if (mode == 0 || mode == 2)
-          is_hazardous = true;
+  void release(Worker &w, int j) {
+    w.jobs.erase(std::remove(w.jobs.begin(), w.jobs.end(), j), w.jobs.end());
+  }
+
+  // Takes worker id off job j, queueing the job again if no copy is left
+  void leave(Job &job, int j, int id) {
+    job.copies.erase(std::remove(job.copies.begin(), job.copies.end(), id),
+                     job.copies.end());
+    if (job.state == JOB_RUNNING && job.copies.empty()) {
+      job.state = JOB_PENDING;
+      queue.push_front(j);
+    }
+  }
+
+  void drop_silent() {
+    const auto now = std::chrono::steady_clock::now();
+    for (size_t k = workers.size(); k-- > 0;)
+      if (now - workers[k]->heard >
+          std::chrono::seconds(SWEEP_TIMEOUT_SECONDS)) {
+        workers[k]->why = "silent for " +
+                          std::to_string(SWEEP_TIMEOUT_SECONDS) + " s";
+        remove_worker(k);
       }
+  }
 
-      if (is_hazardous) {
-        // Hazardous logic: avvicinarsi è male, allontanarsi è bene
-        if (curr_dist > prev_dist)
-          res.reward = true;
-        else if (curr_dist < prev_dist)
-          res.penalty = true;
-      } else {
-        // Edible logic: avvicinarsi è bene, allontanarsi è male
-        if (curr_dist < prev_dist)
-          res.reward = true;
-        else if (curr_dist > prev_dist)
-          res.penalty = true;
+  void remove_worker(size_t k) {
+    Worker &w = *workers[k];
+    for (int j : w.jobs)
+      leave(jobs[j], j, w.id);
+    if (!w.why.empty() && !ending) {
+      LOG_AT(LOG_WARN, "Sweep worker " + w.name + " lost (" + w.why +
+                           "), " + std::to_string(w.jobs.size()) +
+                           " jobs queued again");
+      std::cerr << "[CPP] Sweep: lost worker " << w.name << " (" << w.why
+                << "), " << w.jobs.size() << " jobs queued again"
+                << std::endl;
+    }
+    close_socket(w.fd);
+    workers.erase(workers.begin() + k);
+  }
+
+  // Fills free slots from the queue, then with backup copies
+  void assign() {
+    for (auto &wp : workers) {
+      Worker &w = *wp;
+      while (w.slots > static_cast<int>(w.jobs.size())) {
+        int j = -1;
+        while (j < 0 && !queue.empty()) {
+          j = queue.front();
+          queue.pop_front();
+          if (jobs[j].state != JOB_PENDING)
+            j = -1;
+        }
+        if (j < 0)
+          j = backup_for(w);
+        if (j < 0)
+          break;
+        start(w, j);
       }
+    }
+  }
 
-      if (curr_dist == 0) {
-        if (!is_hazardous) {
-          food_eaten++;
-          res.reward = true;
-          res.penalty = false;
-        } else {
-          danger_hit++;
-          res.penalty = true;
-          res.reward = false;
+  // The job that has run longest on one other worker, if it is overdue
+  int backup_for(const Worker &w) const {
+    const auto due = std::chrono::steady_clock::now() -
+                     std::chrono::seconds(SWEEP_BACKUP_SECONDS);
+    int best = -1;
+    for (int j = 0; j < sweep.jobs(); ++j) {
+      const Job &job = jobs[j];
+      if (job.state == JOB_RUNNING && job.copies.size() == 1 &&
+          job.copies[0] != w.id && job.started < due &&
+          (best < 0 || job.started < jobs[best].started))
+        best = j;
+    }
+    return best;
+  }
+
+  void start(Worker &w, int j) {
+    Job &job = jobs[j];
+    std::string resume;
+    try {
+      if (job.checkpoint_tick >= 0)
+        resume = read_file(checkpoint_path(j));
+    } catch (const std::exception &e) {
+      disk_error(e.what()); // It starts over instead
+      job.checkpoint_tick = -1;
+      job.checkpoint_secs = 0;
+    }
+    const long long window = metrics ? opts.metrics_window : 0;
+    w.out += "job job=" + std::to_string(j) +
+             " seed=" + std::to_string(sweep.seed(j)) + " " +
+             sweep_config_text(sweep.config(j)) +
+             " metrics_window=" + std::to_string(window) +
+             " checkpoint_seconds=" + std::to_string(opts.checkpoint_seconds) +
+             " seconds=" + std::to_string(resume.empty() ? 0.0
+                                                         : job.checkpoint_secs) +
+             " bytes=" + std::to_string(resume.size()) + "\n" + resume;
+    if (job.state == JOB_PENDING) {
+      job.state = JOB_RUNNING;
+      job.started = std::chrono::steady_clock::now();
+    } else {
+      log_to_file("Sweep job " + std::to_string(j) + " backed up on " +
+                  w.name);
+    }
+    job.copies.push_back(w.id);
+    w.jobs.push_back(j);
+  }
+
+  void print_setting(int config, const std::string &name) const {
+    const std::string v = sweep_setting(sweep.configs[config], name);
+    const bool text = name == "engine" || name == "rng";
+    std::cout << ",\"" << name << "\":" << (text ? "\"" : "") << v
+              << (text ? "\"" : "");
+  }
+
+  // One line per job, one per config with the spread across its seeds
+  // and a last one for the sweep
+  void print_summary(double secs) const {
+    for (int j = 0; j < sweep.jobs(); ++j) {
+      const Job &job = jobs[j];
+      std::cout << "{\"job\":" << j << ",\"config\":" << j / sweep.seeds.size()
+                << ",\"seed\":" << sweep.seed(j);
+      if (job.state == JOB_DONE)
+        std::cout << ",\"food_eaten\":" << job.result.food_eaten
+                  << ",\"danger_hit\":" << job.result.danger_hit
+                  << ",\"reward_sum\":" << job.result.reward_sum
+                  << ",\"penalty_sum\":" << job.result.penalty_sum
+                  << ",\"seconds\":" << job.result.seconds << "}" << std::endl;
+      else
+        std::cout << ",\"failed\":true}" << std::endl;
+    }
+    const int seeds = static_cast<int>(sweep.seeds.size());
+    for (int c = 0; c < static_cast<int>(sweep.configs.size()); ++c) {
+      int done = 0, food_min = 0, food_max = 0, danger_min = 0,
+          danger_max = 0;
+      double food = 0, danger = 0, reward = 0, penalty = 0;
+      for (int j = c * seeds; j < (c + 1) * seeds; ++j) {
+        const Job &job = jobs[j];
+        if (job.state != JOB_DONE)
+          continue;
+        const SweepResult &r = job.result;
+        food_min = done ? std::min(food_min, r.food_eaten) : r.food_eaten;
+        food_max = done ? std::max(food_max, r.food_eaten) : r.food_eaten;
+        danger_min = done ? std::min(danger_min, r.danger_hit) : r.danger_hit;
+        danger_max = done ? std::max(danger_max, r.danger_hit) : r.danger_hit;
+        food += r.food_eaten;
+        danger += r.danger_hit;
+        reward += r.reward_sum;
+        penalty += r.penalty_sum;
+        ++done;
+      }
+      std::cout << "{\"config\":" << c;
+      for (const std::string &name : sweep.settings)
+        print_setting(c, name);
+      std::cout << ",\"runs\":" << done;
+      if (done > 0)
+        std::cout << ",\"food_eaten\":{\"mean\":" << food / done
+                  << ",\"min\":" << food_min << ",\"max\":" << food_max
+                  << "},\"danger_hit\":{\"mean\":" << danger / done
+                  << ",\"min\":" << danger_min << ",\"max\":" << danger_max
+                  << "},\"reward_sum\":" << reward / done
+                  << ",\"penalty_sum\":" << penalty / done;
+      std::cout << "}" << std::endl;
+    }
+    std::cout << "{\"sweep\":\"" << sweep.id
+              << "\",\"configs\":" << sweep.configs.size()
+              << ",\"seeds\":" << seeds << ",\"jobs\":" << sweep.jobs()
+              << ",\"done\":" << finished - failed << ",\"failed\":" << failed
+              << ",\"workers\":" << joined << ",\"seconds\":" << secs << "}"
+              << std::endl;
+  }
+
+  const Options &opts;
+  const Sweep &sweep;
+  std::vector<Job> jobs;
+  std::deque<int> queue; // Pending jobs, those of lost workers in front
+  std::vector<std::unique_ptr<Worker>> workers;
+  socket_t listener;
+  std::ofstream results;
+  std::unique_ptr<MetricsWriter> metrics;
+  int next_worker;
+  int joined;   // Workers that said hello
+  int finished; // Jobs done or failed
+  int failed;
+  bool ending; // The sweep is over: workers leaving are not lost
+  bool disk_ok;
+};
+
+class SweepWorker {
+public:
+  explicit SweepWorker(const Options &_opts)
+      : opts(_opts), fd(NO_SOCKET), tag(std::random_device()()), lost(false),
+        done(false) {}
+
+  // Runs jobs until the coordinator is done; exit status
+  int run() {
+    const size_t colon = opts.worker_address.rfind(':');
+    const std::string host = opts.worker_address.substr(0, colon),
+                      port = opts.worker_address.substr(colon + 1);
+    std::filesystem::create_directories(opts.sweep_dir);
+    sockets_begin();
+    const auto give_up = std::chrono::steady_clock::now() +
+                         std::chrono::seconds(SWEEP_CONNECT_SECONDS);
+    while ((fd = connect_to(host, port)) == NO_SOCKET) {
+      if (!g_running || std::chrono::steady_clock::now() > give_up) {
+        sockets_end();
+        throw std::runtime_error("sweep: cannot reach " +
+                                 opts.worker_address);
+      }
+      std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+    const int cores = static_cast<int>(std::thread::hardware_concurrency());
+    const int slots = opts.threads > 0 ? opts.threads : std::max(1, cores);
+    log_to_file("Sweep worker connected to " + opts.worker_address);
+    std::cerr << "[CPP] Sweep: connected to " << opts.worker_address << " ("
+              << slots << " slots)" << std::endl;
+    send("hello slots=" + std::to_string(slots) + "\n");
+    std::thread pinger(&SweepWorker::ping_loop, this);
+
+    SweepStream in;
+    SweepMessage msg;
+    char buf[65536];
+    while (!done && !lost && g_running) {
+      const int n = static_cast<int>(recv(fd, buf, sizeof(buf), 0));
+      if (n <= 0)
+        break;
+      in.append(buf, n);
+      try {
+        while (in.next(msg))
+          handle(msg);
+      } catch (const std::exception &e) {
+        LOG_AT(LOG_ERROR, "Sweep: " + std::string(e.what()));
+        break;
+      }
+      reap(false);
+    }
+    if (!done) {
+      LOG_AT(LOG_ERROR, "Sweep: lost the coordinator");
+      std::cerr << "[CPP] Sweep: lost the coordinator" << std::endl;
+    }
+    lost = true;
+    for (auto &t : tasks)
+      t->cancel = true;
+    reap(true);
+    pinger.join();
+    close_socket(fd);
+    sockets_end();
+    return done ? 0 : 1;
+  }
+
+  // MetricsRecorder's sink: blocks go out as metrics lines
+  class MetricsLines {
+  public:
+    explicit MetricsLines(SweepWorker &_worker) : worker(_worker) {}
+
+    std::unique_ptr<MetricsBlock> take(int agent) {
+      std::unique_ptr<MetricsBlock> block =
+          spare ? std::move(spare) : std::unique_ptr<MetricsBlock>(
+                                         new MetricsBlock());
+      block->agent = agent;
+      block->rows = 0;
+      return block;
+    }
+
+    void push(std::unique_ptr<MetricsBlock> block) {
+      std::string text;
+      for (int r = 0; r < block->rows; ++r) {
+        text += "metrics job=" + std::to_string(block->agent);
+        for (int c = 0; c < MET_COUNT; ++c) {
+          const int64_t v = block->cells[c * METRICS_BLOCK_ROWS + r];
+          double d;
+          std::memcpy(&d, &v, sizeof(d));
+          text += " " + (c == MET_MEAN_CONFIDENCE ? exact_text(d)
+                                                  : std::to_string(v));
         }
-        // Reset agent to center without removing target
-        agent_pos = size / 2;
+        text += "\n";
       }
+      worker.send(text);
+      spare = std::move(block);
     }
 
-    if (target_timer > 0) {
-      target_timer--;
-      if (target_timer <= 0)
-        target_type = NONE;
+  private:
+    SweepWorker &worker;
+    std::unique_ptr<MetricsBlock> spare;
+  };
+
+private:
+  struct Task {
+    int job;
+    unsigned int seed;
+    SweepConfig config;
+    long long metrics_window; // 0: no metrics
+    int checkpoint_seconds;
+    std::string resume;  // Checkpoint bytes, may be empty
+    double resumed_secs; // Run time up to the checkpoint
+    std::atomic<bool> cancel;
+    std::atomic<bool> ended;
+    std::thread thread;
+  };
+
+  static socket_t connect_to(const std::string &host,
+                             const std::string &port) {
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *found = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0)
+      return NO_SOCKET;
+    socket_t s = NO_SOCKET;
+    for (addrinfo *a = found; a && s == NO_SOCKET; a = a->ai_next) {
+      s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+      if (s != NO_SOCKET &&
+          connect(s, a->ai_addr, static_cast<int>(a->ai_addrlen)) != 0) {
+        close_socket(s);
+        s = NO_SOCKET;
+      }
     }
+    freeaddrinfo(found);
+    return s;
+  }
 
-    return res;
+  // Any thread; a whole message at a time
+  void send(const std::string &text) {
+    std::lock_guard<std::mutex> lock(send_mutex);
+    size_t sent = 0;
+    while (!lost && sent < text.size()) {
+      const int n = static_cast<int>(::send(
+          fd, text.data() + sent, static_cast<int>(text.size() - sent), 0));
+      if (n > 0)
+        sent += n;
+      else if (n < 0 && errno == EINTR)
+        continue;
+      else
+        lost = true;
+    }
+  }
+
+  void ping_loop() {
+    auto next = std::chrono::steady_clock::now();
+    while (!lost && !done) {
+      if (std::chrono::steady_clock::now() >= next) {
+        send("ping\n");
+        next += std::chrono::seconds(SWEEP_PING_SECONDS);
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+  }
+
+  void handle(const SweepMessage &msg) {
+    if (msg.word == "done") {
+      done = true;
+    } else if (msg.word == "cancel") {
+      for (auto &t : tasks)
+        if (t->job == msg.number("job"))
+          t->cancel = true;
+    } else if (msg.word == "job") {
+      std::unique_ptr<Task> t(new Task());
+      t->job = static_cast<int>(msg.number("job"));
+      t->seed = static_cast<unsigned int>(msg.number("seed"));
+      t->config = SweepConfig{DEFAULT_PARAMS, BRAIN_SIZE, CONNECTION_DENSITY,
+                              0, DENSE, RNG_MT19937, 0};
+      for (const auto &kv : msg.fields)
+        set_sweep_setting(t->config, kv.first, kv.second);
+      t->metrics_window = msg.number("metrics_window");
+      t->checkpoint_seconds =
+          static_cast<int>(msg.number("checkpoint_seconds"));
+      t->resume = msg.payload;
+      t->resumed_secs = t->resume.empty() ? 0.0 : msg.real("seconds");
+      t->cancel = false;
+      t->ended = false;
+      if (!sweep_config_valid(t->config))
+        throw std::runtime_error("bad job " + std::to_string(t->job));
+      log_to_file("Sweep job " + std::to_string(t->job) + ": seed " +
+                  std::to_string(t->seed) + ", " +
+                  sweep_config_text(t->config) +
+                  (t->resume.empty() ? "" : ", from a checkpoint"));
+      Task &task = *t;
+      tasks.push_back(std::move(t));
+      task.thread = std::thread(&SweepWorker::run_task, this, std::ref(task));
+    } else {
+      throw std::runtime_error("bad message " + msg.word);
+    }
+  }
+
+  // Joins the tasks that ended, or all of them
+  void reap(bool all) {
+    for (size_t k = tasks.size(); k-- > 0;)
+      if (all || tasks[k]->ended) {
+        tasks[k]->thread.join();
+        tasks.erase(tasks.begin() + k);
+      }
+  }
+
+  void run_task(Task &t) {
+    try {
+      const SweepConfig &c = t.config;
+      typedef FixedTopology<BRAIN_SIZE> Fixed;
+      const bool fixed =
+          c.neurons == BRAIN_SIZE && c.density == CONNECTION_DENSITY;
+      SweepResult result;
+      const int completed = dispatch_rules(c.params, [&](auto rules) {
+        typedef decltype(rules) Rules;
+        if (fixed)
+          return run_job<SpikingNet<Fixed, NoTrace, Rules>>(t, Fixed(), rules,
+                                                            result);
+        return run_job<SpikingNet<DynamicTopology, NoTrace, Rules>>(
+            t, DynamicTopology(c.neurons, c.density), rules, result);
+      });
+      if (completed)
+        send(sweep_result_text(t.job, result));
+    } catch (const std::exception &e) {
+      std::string why = e.what();
+      std::replace(why.begin(), why.end(), '\n', ' ');
+      LOG_AT(LOG_ERROR, "Sweep job " + std::to_string(t.job) + ": " + why);
+      send("failed job=" + std::to_string(t.job) + " " + why + "\n");
+    }
+    t.ended = true;
+  }
+
+  // 1 when the job ran to the end, 0 if it was cancelled
+  template <class Net>
+  int run_job(Task &t, const typename Net::topology_type &topo,
+              const typename Net::rules_type &rules, SweepResult &result) {
+    // Unique to this worker: the directory may be shared, or be the
+    // coordinator's
+    const std::string scratch = opts.sweep_dir + "/worker" +
+                                std::to_string(tag) + "-job" +
+                                std::to_string(t.job) + ".ck";
+    Simulation<Net> sim(t.seed, t.config.mode, topo, rules, t.config.rng);
+    sim.brain.set_engine(static_cast<Engine>(t.config.engine));
+    if (!t.resume.empty()) {
+      write_file(scratch, t.resume);
+      t.resume = std::string();
+      load_checkpoint(sim, scratch);
+    }
+    MetricsLines lines(*this);
+    std::unique_ptr<MetricsRecorder<Net, MetricsLines>> recorder;
+    if (t.metrics_window > 0)
+      recorder.reset(new MetricsRecorder<Net, MetricsLines>(
+          lines, t.job, t.metrics_window, sim));
+    // Checkpoints fall on whole metrics windows, so the rows of a resumed
+    // run line up with those sent before
+    const long long w = t.metrics_window > 0 ? t.metrics_window : 1;
+    const long long chunk = (SWEEP_CHUNK + w - 1) / w * w;
+    auto start = std::chrono::steady_clock::now(), saved = start;
+    while (sim.t < t.config.ticks) {
+      if (t.cancel || lost) {
+        std::remove(scratch.c_str());
+        return 0;
+      }
+      const long long end = std::min<long long>(sim.t + chunk, t.config.ticks);
+      if (recorder) {
+        while (sim.t < end) {
+          sim.tick();
+          recorder->tick(sim);
+        }
+      } else {
+        while (sim.t < end)
+          sim.tick();
+      }
+      const auto now = std::chrono::steady_clock::now();
+      if (sim.t < t.config.ticks &&
+          now - saved >= std::chrono::seconds(t.checkpoint_seconds)) {
+        if (recorder)
+          recorder->flush();
+        save_checkpoint(sim, scratch);
+        const std::string bytes = read_file(scratch);
+        const std::chrono::duration<double> ran = now - start;
+        send("checkpoint job=" + std::to_string(t.job) +
+             " tick=" + std::to_string(sim.t) +
+             " seconds=" + std::to_string(t.resumed_secs + ran.count()) +
+             " bytes=" + std::to_string(bytes.size()) + "\n" + bytes);
+        saved = now;
+      }
+    }
+    if (recorder)
+      recorder->finish(sim);
+    std::remove(scratch.c_str());
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    result.food_eaten = sim.world.food_eaten;
+    result.danger_hit = sim.world.danger_hit;
+    result.reward_sum = sim.reward_sum;
+    result.penalty_sum = sim.penalty_sum;
+    result.seconds = t.resumed_secs + elapsed.count();
+    return 1;
   }
+
+  const Options &opts;
+  socket_t fd;
+  unsigned int tag; // Names the scratch checkpoints
+  std::mutex send_mutex;
+  std::atomic<bool> lost; // Connection gone: stop everything
+  std::atomic<bool> done;
+  std::vector<std::unique_ptr<Task>> tasks; // Receiving thread only
 };
 
-void input_listener() {
-  std::string cmd;
-  while (std::cin >> cmd) {
-    log_to_file("Received command: " + cmd);
-    std::cerr << "[CPP] Received command: " << cmd << std::endl;
-    if (cmd == "stop") {
-      g_running = false;
-      break;
-    } else if (cmd == "pause") {
-      g_paused = true;
-    } else if (cmd == "resume" || cmd == "start") {
-      g_paused = false;
-    } else if (cmd == "reset") {
-      g_reset = true;
-    } else if (cmd == "speed") {
-      int val;
-      if (std::cin >> val) {
-        log_to_file("Speed value received: " + std::to_string(val));
-        std::cerr << "[CPP] Speed value: " << val << std::endl;
-        if (val < 0)
-          val = 0;
-        g_delay_ms = val;
-      }
-    } else if (cmd == "mode") {
-      int val;
-      if (std::cin >> val) {
-        log_to_file("Reward mode received: " + std::to_string(val));
-        std::cerr << "[CPP] Reward mode: " << val << std::endl;
-        if (val < 0)
-          val = 0;
-        if (val > 3)
-          val = 3;
-        g_reward_mode = val;
-      }
-    }
-  }
-}
-
-void print_json_state(const SpikingNet &net, const World &world, int tick,
-                      bool reward, bool penalty, int reward_sum,
-                      int penalty_sum, int food_time, int danger_time) {
-  std::cout << "{";
-  std::cout << "\"reward\":" << (reward ? "true" : "false") << ",";
-  std::cout << "\"penalty\":" << (penalty ? "true" : "false") << ",";
-  std::cout << "\"reward_sum\":" << reward_sum << ",";
-  std::cout << "\"penalty_sum\":" << penalty_sum << ",";
-  std::cout << "\"food_time\":" << food_time << ",";
-  std::cout << "\"danger_time\":" << danger_time << ",";
-  std::cout << "\"t\":" << tick << ",";
-
-  std::cout << "\"world\":{";
-  std::cout << "\"agent\":" << world.agent_pos << ",";
-  std::cout << "\"target\":" << world.target_pos << ",";
-  std::cout << "\"type\":" << world.target_type << ",";
-  std::cout << "\"food\":" << world.food_eaten << ",";
-  std::cout << "\"danger\":" << world.danger_hit << ",";
-  std::cout << "\"dist\":"
-            << ((world.target_type != NONE)
-                    ? std::abs(world.agent_pos - world.target_pos)
-                    : 0);
-  std::cout << "},";
-
-  std::cout << "\"neurons\":[";
-  for (size_t i = 0; i < net.neurons.size(); ++i) {
-    const auto &n = net.neurons[i];
-    std::cout << "{\"id\":" << n.id << ",\"v\":" << n.voltage
-              << ",\"s\":" << (n.spiked_this_step ? "true" : "false") << "}";
-    if (i < net.neurons.size() - 1)
-      std::cout << ",";
-  }
-  std::cout << "],";
-
-  std::cout << "\"synapses\":[";
-  bool first = true;
-  for (size_t i = 0; i < net.connections.size(); ++i) {
-    for (const auto &syn : net.connections[i]) {
-      if (!first)
-        std::cout << ",";
-      std::cout << "{\"s\":" << i << ",\"t\":" << syn.target_neuron_idx
-                << ",\"c\":" << syn.confidence
-                << ",\"a\":" << (syn.active ? "true" : "false")
-                << ",\"b\":" << (syn.highlighted ? "1" : "0") << "}";
-      first = false;
-    }
-  }
-  std::cout << "]";
-  std::cout << "}" << std::endl;
+int run_coordinator(const Options &opts) {
+  SweepConfig base{opts.params,      opts.neurons,       opts.density,
+                   opts.reward_mode, opts.engine,        opts.rng,
+                   opts.ticks};
+  const Sweep sweep =
+      read_sweep(opts.sweep_path, base, opts.has_seed ? opts.seed : 1);
+  return SweepCoordinator(opts, sweep).run();
 }
 
-int main() {
+int run_worker(const Options &opts) { return SweepWorker(opts).run(); }
+
+// binary_rstdp_bench.cpp includes this file with BINARY_RSTDP_NO_MAIN
+#ifndef BINARY_RSTDP_NO_MAIN
+int main(int argc, char **argv) {
   try {
     log_to_file("Process started");
 
+    Options opts;
+    if (!parse_args(argc, argv, opts)) {
+      print_usage();
+      return 2;
+    }
+    g_engine = opts.engine;
+    g_reward_mode = opts.reward_mode;
+    if (opts.neuron_kernel >= 0)
+      set_neuron_kernel(NeuronKernel(opts.neuron_kernel));
+    log_to_file(std::string("Neuron kernel: ") +
+                NEURON_KERNEL_NAMES[g_neuron_kernel]);
+    std::unique_ptr<Simulation<>> replayed;
+    if (!opts.replay_path.empty()) {
+      auto start = std::chrono::steady_clock::now();
+      replayed = replay_recording(opts.replay_path, opts.replay_run, opts.seek);
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start;
+      log_to_file("Replayed run " + std::to_string(opts.replay_run) + " of " +
+                  opts.replay_path + " to tick " +
+                  std::to_string(replayed->t));
+      if (opts.headless) {
+        std::cout << "{\"replay\":" << opts.replay_run
+                  << ",\"tick\":" << replayed->t << ",";
+        print_score(*replayed);
+        std::cout << ",\"seconds\":" << elapsed.count() << "}" << std::endl;
+        return 0;
+      }
+      // The session goes on with the settings the recording had
+      g_reward_mode = replayed->world.reward_mode;
+      g_engine = replayed->brain.engine;
+    }
+    if (opts.coordinator_port > 0)
+      return run_coordinator(opts);
+    if (!opts.worker_address.empty())
+      return run_worker(opts);
+    typedef FixedTopology<BRAIN_SIZE> Fixed;
+    const bool fixed =
+        opts.neurons == BRAIN_SIZE && opts.density == CONNECTION_DENSITY;
+    const DynamicTopology dynamic =
+        fixed ? DynamicTopology() : DynamicTopology(opts.neurons, opts.density);
+    if (opts.batch > 0 || opts.population > 1 || opts.headless)
+      return dispatch_rules(opts.params, [&](auto rules) {
+        typedef decltype(rules) Rules;
+        if (opts.batch > 0 && fixed)
+          return run_batch(opts, Fixed(), rules);
+        if (opts.batch > 0)
+          return run_batch(opts, dynamic, rules);
+        if (opts.population > 1 && fixed)
+          return run_population<SpikingNet<Fixed, NoTrace, Rules>>(
+              opts, Fixed(), rules);
+        if (opts.population > 1)
+          return run_population<SpikingNet<DynamicTopology, NoTrace, Rules>>(
+              opts, dynamic, rules);
+        if (fixed)
+          return run_headless<SpikingNet<Fixed, NoTrace, Rules>>(
+              opts, Fixed(), rules);
+        return run_headless<SpikingNet<DynamicTopology, NoTrace, Rules>>(
+            opts, dynamic, rules);
+      });
+
+    if (opts.binary && opts.serve_port == 0) {
+#ifdef _WIN32
+      // No CRLF translation of frame bytes
+      _setmode(_fileno(stdout), _O_BINARY);
+#endif
+      log_to_file("Writing binary state frames");
+    }
+
     // Launch input listener thread
     std::thread input_thread(input_listener);
     input_thread.detach();
 
+    std::unique_ptr<FrameServer> server;
+    if (opts.serve_port > 0) {
+      server.reset(new FrameServer(opts.bind_address, opts.serve_port,
+                                   opts.www, opts.delta));
+      log_to_file("Serving " + opts.www + " on " + opts.bind_address + ":" +
+                  std::to_string(opts.serve_port));
+      std::cerr << "[CPP] Serving on http://" << opts.bind_address << ":"
+                << opts.serve_port << std::endl;
+    }
+
+    SnapshotExchange exchange;
+    std::thread publisher(publisher_loop, std::ref(exchange), opts.binary,
+                          opts.delta, opts.keyframe_interval, server.get());
+
+    std::unique_ptr<Recorder> recorder;
+    if (!opts.record_path.empty())
+      recorder.reset(new Recorder(opts.record_path));
+
+    bool first_run = true;
+    int run = 0;
     while (g_running) {
       log_to_file("Entering simulation loop");
 
       // --- Initialization ---
-      SpikingNet brain(BRAIN_SIZE);
-      std::mt19937 rng(static_cast<unsigned int>(
-          std::chrono::system_clock::now().time_since_epoch().count()));
-      brain.connect_randomly(CONNECTION_DENSITY, rng);
-      World world;
+      // A fixed --seed applies to the first run; resets draw a fresh one.
+      // A replay hands over its simulation as the first run.
+      unsigned int seed =
+          first_run && opts.has_seed ? opts.seed : clock_seed();
+      std::unique_ptr<Simulation<>> owned(
+          first_run && replayed ? replayed.release()
+                                : new Simulation<>(seed, g_reward_mode));
+      Simulation<> &sim = *owned;
+      sim.brain.set_threads(opts.net_threads);
+      sim.brain.set_change_tracking(opts.delta);
+      ++run;
 
-      // Reset flag cleared
-      g_reset = false;
-
-      // Reward/Penalty logic state
-      bool current_reward = true; // Initially true during constant duration
-      bool current_penalty = false;
-      int reward_sum = 0;
-      int penalty_sum = 0;
-      int food_time = 0;
-      int danger_time = 0;
+      // What the recording last saw applied, and where it was indexed
+      int recorded_mode = sim.world.reward_mode;
+      int recorded_engine = sim.brain.engine;
+      int indexed_tick = sim.t;
+      if (recorder) {
+        recorder->write(REC_RUN, 0, seed);
+        recorder->write(REC_MODE, 0, recorded_mode);
+        recorder->write(REC_ENGINE, 0, recorded_engine);
+      }
 
-      // --- Simulation Loop ---
-      for (int t = 0; g_running && !g_reset; ++t) {
-        // Output state FIRST (so we see initial state or current state)
-        print_json_state(brain, world, t, current_reward, current_penalty,
-                         reward_sum, penalty_sum, food_time, danger_time);
-
-        // Wait if paused or for speed control
-        int delay = g_delay_ms;
-        if (g_paused) {
-          while (g_paused && g_running && !g_reset) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      // Checkpoint I/O errors are reported and the run goes on
+      auto checkpoint = [&](bool save, const std::string &path) {
+        try {
+          if (save)
+            save_checkpoint(sim, path);
+          else {
+            const int tick = sim.t;
+            load_checkpoint(sim, path);
+            ++run; // The publisher starts over with a keyframe
+            if (recorder) {
+              recorder->write(REC_LOAD, tick, 0, path);
+              indexed_tick = sim.t;
+            }
           }
-          delay = 0;
+          log_to_file(std::string(save ? "Saved " : "Loaded ") + path);
+        } catch (const std::exception &e) {
+          LOG_AT(LOG_ERROR, e.what());
+          std::cerr << "[CPP ERROR] " << e.what() << std::endl;
         }
-        if (delay > 0)
-          std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+      };
+      if (first_run && !opts.load_path.empty())
+        checkpoint(false, opts.load_path);
+      first_run = false;
 
-        if (!g_running || g_reset)
-          break;
+      // Reset flag cleared, with any steps left of the old run
+      g_reset = false;
+      g_step_ticks = 0;
 
-        // 1. Sensors
-        auto sensors = world.get_sensors();
-        std::vector<int> net_input(BRAIN_SIZE, 0);
-        for (int i = 0; i < 4; ++i) {
-          net_input[i] = sensors[i];
+      // Runs pending save/load commands, then hands the publisher the
+      // current state if it is waiting for one, with a stats report when
+      // one is due
+      int frames_since_stats = 0;
+      auto serve_snapshot = [&]() {
+        if (g_checkpoint_request.exchange(false)) {
+          std::string save_path, load_path;
+          {
+            std::lock_guard<std::mutex> lock(g_checkpoint_mutex);
+            save_path.swap(g_save_path);
+            load_path.swap(g_load_path);
+          }
+          if (!save_path.empty())
+            checkpoint(true, save_path);
+          if (!load_path.empty())
+            checkpoint(false, load_path);
         }
-
-        // 1.5. Random wandering activity
-        if (RANDOM_ACTIVITY_PERIOD > 0 && t % RANDOM_ACTIVITY_PERIOD == 0) {
-          std::uniform_int_distribution<int> rand_neuron_dist(6,
-                                                              BRAIN_SIZE - 1);
-          for (int i = 0; i < RANDOM_ACTIVITY_COUNT; ++i) {
-            int rand_idx = rand_neuron_dist(rng);
-            net_input[rand_idx]++;
+        if (exchange.wanted()) {
+          StateSnapshot &snap = exchange.back();
+          capture_snapshot(snap, sim, run);
+          const bool requested = g_stats_request.exchange(false);
+          if (requested || (opts.stats_interval > 0 &&
+                            ++frames_since_stats >= opts.stats_interval)) {
+            snap.stats = format_stats(sim.brain.stats);
+            sim.brain.stats.clear();
+            frames_since_stats = 0;
+            if (requested) {
+              log_to_file("Stats: " + snap.stats);
+              std::cerr << "[CPP] Stats: " << snap.stats << std::endl;
+            }
           }
+          exchange.publish();
         }
+      };
 
-        // 5. Brain Step
-        bool force_reward = false;
-        brain.step(net_input, force_reward || current_reward,
-                   (!force_reward) && current_penalty, rng);
-
-        // 3. Motors
-        bool m_left = brain.neurons[4].spiked_this_step;
-        bool m_right = brain.neurons[5].spiked_this_step;
-        if (m_left && m_right) {
-          m_left = false;
-          m_right = false;
+      // --- Simulation Loop ---
+      typedef std::chrono::steady_clock Clock;
+      Clock::time_point next_tick = Clock::now();
+      int paced_delay = g_delay_ms;
+      while (g_running && !g_reset) {
+        if (recorder && opts.record_interval > 0 &&
+            sim.t - indexed_tick >= opts.record_interval) {
+          const std::string path = recorder->checkpoint_path(sim.t);
+          checkpoint(true, path);
+          recorder->write(REC_CHECKPOINT, sim.t, 0, path);
+          indexed_tick = sim.t;
+        }
+        // Block until a tick is due. Control events wake the wait, so
+        // commands and frame requests are served at once; the loop then
+        // comes back here with the deadline unchanged.
+        const uint64_t seen = g_control.generation();
+        serve_snapshot();
+        if (!g_running || g_reset)
+          break;
+        const bool stepping = g_step_ticks > 0;
+        if (g_paused && !stepping) {
+          g_control.wait(seen);
+          next_tick = Clock::now();
+          continue;
+        }
+        const int delay = g_delay_ms;
+        if (delay != paced_delay) {
+          next_tick += std::chrono::milliseconds(delay - paced_delay);
+          paced_delay = delay;
+        }
+        if (!stepping && delay > 0 && Clock::now() < next_tick) {
+          g_control.wait_until(seen, next_tick);
+          continue;
         }
 
-        // 4. World Update
-        auto res = world.update(m_left, m_right);
+        sim.brain.set_engine(static_cast<Engine>(g_engine.load()));
+        sim.brain.set_tracing(g_trace);
+        sim.world.reward_mode = g_reward_mode;
+        if (recorder && sim.world.reward_mode != recorded_mode) {
+          recorded_mode = sim.world.reward_mode;
+          recorder->write(REC_MODE, sim.t, recorded_mode);
+        }
+        if (recorder && sim.brain.engine != recorded_engine) {
+          recorded_engine = sim.brain.engine;
+          recorder->write(REC_ENGINE, sim.t, recorded_engine);
+        }
+        sim.tick();
 
-        // 5. Update Reward/Penalty for NEXT step
-        current_reward = res.reward;
-        current_penalty = res.penalty;
-        if (current_reward)
-          reward_sum++;
-        if (current_penalty)
-          penalty_sum++;
-        if (world.target_type == FOOD)
-          food_time++;
-        else if (world.target_type == DANGER)
-          danger_time++;
+        // Single steps run unpaced; paced ticks are due delay apart from
+        // the previous deadline, so tick and frame cost do not add up to
+        // drift. A loop that fell behind starts over rather than bursting.
+        if (stepping) {
+          --g_step_ticks;
+          next_tick = Clock::now();
+        } else {
+          next_tick += std::chrono::milliseconds(delay);
+          const Clock::time_point now = Clock::now();
+          if (next_tick < now)
+            next_tick = now;
+        }
       }
 
       if (g_reset) {
         log_to_file("Simulation reset triggered");
       }
+      if (!g_running && !opts.save_path.empty())
+        checkpoint(true, opts.save_path);
     }
+    publisher.join();
+    server.reset();
     log_to_file("Process exiting normally");
   } catch (const std::exception &e) {
-    log_to_file("CRITICAL ERROR: " + std::string(e.what()));
+    LOG_AT(LOG_ERROR, "CRITICAL ERROR: " + std::string(e.what()));
     std::cerr << "[CPP ERROR] " << e.what() << std::endl;
     return 1;
   } catch (...) {
-    log_to_file("CRITICAL ERROR: Unknown exception");
+    LOG_AT(LOG_ERROR, "CRITICAL ERROR: Unknown exception");
     std::cerr << "[CPP ERROR] Unknown exception" << std::endl;
     return 1;
   }
   return 0;
 }
+#endif // BINARY_RSTDP_NO_MAIN
@@ -0,0 +1,499 @@
+// Microbenchmarks for the simulation core: SpikingNet::step() across neuron
+// counts, densities, input spike rates and engines, plus connect_randomly(),
+// pruning, trace_causal_chain(), print_json_state() and the batch engine.
+// One result per line, as JSON (default) or CSV, so two builds can be
+// compared case by case:
+//   binary_rstdp_bench [--csv] [--quick] [--filter TEXT] [--min-time SEC]
+// Ticks must not allocate once warmed up: the step, tick and batch cases
+// count heap allocations while measured and the run fails if any did.
+#define BINARY_RSTDP_NO_MAIN
+#include "binary_rstdp.cpp"
+
+#include <cstdlib>
+#include <new>
+
+// Every heap allocation of the process goes through here. GCC flags free()
+// on a pointer from operator new once both are inlined; here they pair up.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+std::atomic<long long> g_allocations(0);
+
+void *operator new(std::size_t size) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+namespace bench {
+
+typedef SpikingNet<DynamicTopology, NoTrace> StepNet;
+typedef SpikingNet<DynamicTopology> TraceNet;
+
+struct Options {
+  bool csv = false;
+  bool quick = false;
+  std::string filter;
+  double min_time = 0.5; // Seconds measured per case
+};
+
+struct Result {
+  std::string name;
+  std::string engine; // "-" where it doesn't apply
+  int neurons;
+  double density;
+  double input_rate; // Fraction of neurons driven per tick
+  int synapses;
+  long long ops; // Ticks, or calls of the benchmarked function
+  double seconds;
+  double syn_work;        // Synapses updated, created or serialized
+  double spikes_per_tick; // Step cases only
+  long long allocations;  // While measured
+  bool steady;            // Must not allocate
+};
+
+int allocating_cases = 0; // Steady cases that allocated
+int failed_kernels = 0;   // Neuron kernels that disagree with scalar
+
+double elapsed(std::chrono::steady_clock::time_point since) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       since)
+      .count();
+}
+
+// Runs batch(n) with growing n until one batch takes min_time; batch returns
+// the synapse work it did
+template <class Batch> void measure(Result &r, double min_time, Batch batch) {
+  const long long allocations = g_allocations;
+  for (long long n = 1;; n *= 2) {
+    auto t0 = std::chrono::steady_clock::now();
+    double work = batch(n);
+    double secs = elapsed(t0);
+    if (secs >= min_time || n >= (1LL << 40)) {
+      r.ops = n;
+      r.seconds = secs;
+      r.syn_work = work;
+      r.allocations = g_allocations - allocations;
+      return;
+    }
+  }
+}
+
+void print_header(const Options &opts) {
+  if (opts.csv)
+    std::cout << "name,engine,neurons,density,input_rate,synapses,ops,"
+                 "seconds,ns_per_op,synapse_updates_per_sec,spikes_per_tick,"
+                 "allocations"
+              << std::endl;
+}
+
+void print_result(const Options &opts, const Result &r) {
+  const double ns = r.ops > 0 ? r.seconds * 1e9 / r.ops : 0.0;
+  const double rate = r.seconds > 0 ? r.syn_work / r.seconds : 0.0;
+  if (opts.csv) {
+    std::cout << r.name << "," << r.engine << "," << r.neurons << ","
+              << r.density << "," << r.input_rate << "," << r.synapses << ","
+              << r.ops << "," << r.seconds << "," << ns << "," << rate << ","
+              << r.spikes_per_tick << "," << r.allocations << std::endl;
+  } else {
+    std::cout << "{\"name\":\"" << r.name << "\",\"engine\":\"" << r.engine
+              << "\",\"neurons\":" << r.neurons
+              << ",\"density\":" << r.density
+              << ",\"input_rate\":" << r.input_rate
+              << ",\"synapses\":" << r.synapses << ",\"ops\":" << r.ops
+              << ",\"seconds\":" << r.seconds << ",\"ns_per_op\":" << ns
+              << ",\"synapse_updates_per_sec\":" << rate
+              << ",\"spikes_per_tick\":" << r.spikes_per_tick
+              << ",\"allocations\":" << r.allocations << "}" << std::endl;
+  }
+  if (r.steady && r.allocations > 0) {
+    std::cerr << "[BENCH] " << r.name << " (" << r.engine << ", "
+              << r.neurons << " neurons) allocated " << r.allocations
+              << " times after warm-up" << std::endl;
+    ++allocating_cases;
+  }
+}
+
+bool selected(const Options &opts, const std::string &name) {
+  return opts.filter.empty() || name.find(opts.filter) != std::string::npos;
+}
+
+Result make_result(const std::string &name, const std::string &engine,
+                   int neurons, double density, double input_rate) {
+  Result r;
+  r.name = name;
+  r.engine = engine;
+  r.neurons = neurons;
+  r.density = density;
+  r.input_rate = input_rate;
+  r.synapses = 0;
+  r.ops = 0;
+  r.seconds = 0;
+  r.syn_work = 0;
+  r.spikes_per_tick = 0;
+  r.allocations = 0;
+  r.steady = false;
+  return r;
+}
+
+// Drives input_rate * N random hidden neurons per tick, with reward and
+// penalty windows so that plasticity and pruning do real work
+template <class Net> class Driver {
+public:
+  Driver(Net &_net, double input_rate, unsigned seed)
+      : net(_net), rng(seed), input(net.topo.size(), 0),
+        pick(net.topo.hidden_begin(), net.topo.size() - 1),
+        per_tick(std::max(1, static_cast<int>(input_rate * net.topo.size()))),
+        spikes(0) {}
+
+  // Returns the synapse updates done by the ticks
+  double run(long long ticks) {
+    double work = 0;
+    for (long long t = 0; t < ticks; ++t) {
+      std::fill(input.begin(), input.end(), 0);
+      for (int k = 0; k < per_tick; ++k)
+        input[pick(rng)]++;
+      const int phase = net.global_tick % 20;
+      net.step(input, phase < 3, phase == 10, rng);
+      work += net.engine == EVENT ? net.touched.size() : net.synapses.size();
+      spikes += net.spiked.size();
+    }
+    return work;
+  }
+
+  Net &net;
+  AgentRng rng;
+  std::vector<int> input;
+  std::uniform_int_distribution<int> pick;
+  int per_tick;
+  long long spikes;
+};
+
+void bench_step(const Options &opts) {
+  std::vector<int> sizes = {100, 1000, 10000};
+  std::vector<double> densities = {0.01, 0.05};
+  std::vector<double> rates = {0.001, 0.01};
+  if (opts.quick) {
+    sizes = {100, 1000};
+    densities = {0.05};
+    rates = {0.01};
+  }
+  const Engine engines[] = {DENSE, EVENT};
+  for (int n : sizes) {
+    for (double density : densities) {
+      for (double rate : rates) {
+        for (Engine e : engines) {
+          const char *engine = e == EVENT ? "event" : "dense";
+          if (!selected(opts, "step") && !selected(opts, engine))
+            continue;
+          StepNet net{DynamicTopology(n, density)};
+          AgentRng rng(1);
+          net.connect_randomly(rng);
+          net.set_engine(e);
+          Driver<StepNet> driver(net, rate, 2);
+          driver.run(200); // Warm up the event index and trace windows
+
+          Result r = make_result("step", engine, n, density, rate);
+          r.synapses = net.synapses.size();
+          r.steady = true;
+          long long spikes_before = 0;
+          measure(r, opts.min_time, [&](long long ticks) {
+            spikes_before = driver.spikes;
+            return driver.run(ticks);
+          });
+          r.spikes_per_tick =
+              static_cast<double>(driver.spikes - spikes_before) / r.ops;
+          print_result(opts, r);
+        }
+      }
+    }
+  }
+}
+
+// Whole agent ticks (sensors, step, world) of the default brain, as the
+// population runner (untraced) and the interactive loop (traced) run them
+template <class Net> void bench_tick(const Options &opts, const char *name) {
+  const Engine engines[] = {DENSE, EVENT};
+  for (Engine e : engines) {
+    const char *engine = e == EVENT ? "event" : "dense";
+    if (!selected(opts, name) && !selected(opts, engine))
+      continue;
+    Simulation<Net> sim(1);
+    sim.brain.set_engine(e);
+    for (int t = 0; t < 2000; ++t) // Past the first prunings
+      sim.tick();
+
+    Result r = make_result(name, engine, sim.brain.topo.size(),
+                           CONNECTION_DENSITY, 0);
+    r.synapses = sim.brain.synapses.size();
+    r.steady = true;
+    measure(r, opts.min_time, [&](long long ticks) {
+      for (long long t = 0; t < ticks; ++t)
+        sim.tick();
+      return static_cast<double>(ticks) * r.synapses;
+    });
+    print_result(opts, r);
+  }
+}
+
+void bench_connect(const Options &opts) {
+  if (!selected(opts, "connect_randomly"))
+    return;
+  std::vector<int> sizes = {1000, 10000};
+  if (opts.quick)
+    sizes = {1000};
+  for (int n : sizes) {
+    const double density = 0.01;
+    StepNet net{DynamicTopology(n, density)};
+    AgentRng rng(1);
+    Result r = make_result("connect_randomly", "-", n, density, 0);
+    measure(r, opts.min_time, [&](long long calls) {
+      double work = 0;
+      for (long long c = 0; c < calls; ++c) {
+        net.connect_randomly(rng);
+        work += net.synapses.size();
+      }
+      return work;
+    });
+    r.synapses = net.synapses.size();
+    print_result(opts, r);
+  }
+}
+
+// One pruning decision plus rewire, as the event engine makes it every
+// pruning_period ticks
+void bench_prune(const Options &opts) {
+  if (!selected(opts, "prune"))
+    return;
+  std::vector<int> sizes = {1000, 10000};
+  if (opts.quick)
+    sizes = {1000};
+  for (int n : sizes) {
+    const double density = 0.01;
+    StepNet net{DynamicTopology(n, density)};
+    AgentRng rng(1);
+    net.connect_randomly(rng);
+    net.set_engine(EVENT);
+    Driver<StepNet> driver(net, 0.01, 2);
+    driver.run(200);
+
+    Result r = make_result("prune", "event", n, density, 0);
+    r.synapses = net.synapses.size();
+    measure(r, opts.min_time, [&](long long calls) {
+      for (long long c = 0; c < calls; ++c) {
+        // A tick of its own for each decision, as in a run; only the clock
+        // moves, the net is not stepped
+        ++net.global_tick;
+        int s = net.oldest_ltp_synapse();
+        if (s >= 0)
+          net.rewire_synapse(s, rng);
+      }
+      return 0.0;
+    });
+    print_result(opts, r);
+  }
+}
+
+// Traces on a frozen tick in which a motor neuron fired
+void bench_trace(const Options &opts) {
+  if (!selected(opts, "trace_causal_chain"))
+    return;
+  std::vector<int> sizes = {BRAIN_SIZE, 1000};
+  for (int n : sizes) {
+    const double density = CONNECTION_DENSITY;
+    TraceNet net{DynamicTopology(n, density)};
+    AgentRng rng(1);
+    net.connect_randomly(rng);
+    Driver<TraceNet> driver(net, 0.05, 2);
+    int motor = -1;
+    for (int t = 0; t < 100000 && motor < 0; ++t) {
+      driver.run(1);
+      for (int m = 0; m < net.topo.motors(); ++m) {
+        if (net.neurons.spiked(net.topo.motor_begin() + m) &&
+            !net.highlighted_syns.empty())
+          motor = net.topo.motor_begin() + m;
+      }
+    }
+    if (motor < 0) {
+      std::cerr << "[BENCH] trace_causal_chain: no motor spike at " << n
+                << " neurons, skipped" << std::endl;
+      continue;
+    }
+
+    Result r = make_result("trace_causal_chain", "-", n, density, 0.05);
+    r.synapses = net.synapses.size();
+    measure(r, opts.min_time, [&](long long calls) {
+      double work = 0;
+      for (long long c = 0; c < calls; ++c) {
+        net.clear_highlights();
+        net.trace_causal_chain(motor);
+        work += net.highlighted_syns.size();
+      }
+      return work;
+    });
+    print_result(opts, r);
+  }
+}
+
+// Discards what it is given, so print_json_state() is timed without I/O
+class NullBuffer : public std::streambuf {
+protected:
+  int overflow(int c) override { return c; }
+  std::streamsize xsputn(const char *, std::streamsize n) override {
+    return n;
+  }
+};
+
+void bench_json(const Options &opts) {
+  if (!selected(opts, "print_json_state"))
+    return;
+  Simulation<> sim(1);
+  for (int t = 0; t < 1000; ++t)
+    sim.tick();
+
+  Result r = make_result("print_json_state", "-", sim.brain.topo.size(),
+                         CONNECTION_DENSITY, 0);
+  r.synapses = sim.brain.synapses.size();
+  StateSnapshot snap;
+  NullBuffer null;
+  std::streambuf *old = std::cout.rdbuf(&null);
+  measure(r, opts.min_time, [&](long long calls) {
+    for (long long c = 0; c < calls; ++c) {
+      capture_snapshot(snap, sim, 1);
+      print_json_state(snap);
+    }
+    return static_cast<double>(calls) * sim.brain.synapses.size();
+  });
+  std::cout.rdbuf(old);
+  print_result(opts, r);
+}
+
+// The neuron phase alone, on every kernel this CPU runs: input_rate * N
+// neurons driven and as many receiving a spike per tick; ops are ticks. A
+// kernel that disagrees with the scalar one is reported, not timed.
+void bench_neurons(const Options &opts) {
+  std::vector<int> sizes = {1000, 10000, 100000};
+  if (opts.quick)
+    sizes = {10000};
+  const double rate = 0.01;
+  for (int k = 0; k < KERNEL_COUNT; ++k) {
+    const NeuronKernel kernel = static_cast<NeuronKernel>(k);
+    if (!neuron_kernel_supported(kernel) ||
+        (!selected(opts, "neurons") &&
+         !selected(opts, NEURON_KERNEL_NAMES[k])))
+      continue;
+    if (!neuron_kernel_agrees(kernel)) {
+      std::cerr << "[BENCH] neuron kernel " << NEURON_KERNEL_NAMES[k]
+                << " differs from scalar" << std::endl;
+      ++failed_kernels;
+      continue;
+    }
+    set_neuron_kernel(kernel);
+    for (int n : sizes) {
+      NeuronStore store(n, DEFAULT_PARAMS.membrane_decay_period);
+      std::vector<int> drive(n, 0);
+      const int per_tick = std::max(1, static_cast<int>(rate * n));
+      std::mt19937 rng(1);
+      for (int i = 0; i < per_tick; ++i)
+        drive[rng() % n] = 1;
+      std::vector<uint64_t> changed(frame_words_for(n));
+      long long tick = 0;
+      auto run = [&](long long ticks) {
+        for (long long t = 0; t < ticks; ++t, ++tick) {
+          for (int i = 0; i < per_tick; ++i)
+            store.input[(tick * per_tick + i) * 7919 % n]++;
+          update_neuron_words(store, 0, n, drive.data(), n,
+                              DEFAULT_PARAMS.v_thresh,
+                              DEFAULT_PARAMS.membrane_decay_period,
+                              changed.data());
+        }
+        return 0.0;
+      };
+      run(200);
+
+      Result r = make_result("neurons", NEURON_KERNEL_NAMES[k], n, 0, rate);
+      r.steady = true;
+      measure(r, opts.min_time, run);
+      print_result(opts, r);
+    }
+  }
+  set_neuron_kernel(best_neuron_kernel());
+}
+
+// The batch engine on lanes of the default brain, all ticks of a batch in
+// one launch; ops are lane ticks, comparable with HeadlessNet steps
+void bench_batch(const Options &opts) {
+  if (!selected(opts, "batch"))
+    return;
+  std::vector<int> sizes = {64, 1024};
+  if (opts.quick)
+    sizes = {64};
+  for (int lanes : sizes) {
+    AgentBatch<> batch(lanes);
+    long long synapses = 0;
+    for (int a = 0; a < lanes; ++a) {
+      Simulation<HeadlessNet> sim(a + 1);
+      batch.upload(a, sim);
+      synapses += sim.brain.synapses.size();
+    }
+    batch.run(200);
+
+    Result r = make_result("batch", "dense", BRAIN_SIZE, CONNECTION_DENSITY,
+                           0);
+    r.synapses = static_cast<int>(synapses);
+    r.steady = true;
+    measure(r, opts.min_time, [&](long long ticks) {
+      batch.run(static_cast<int>(ticks));
+      return static_cast<double>(ticks) * synapses;
+    });
+    r.ops *= lanes;
+    print_result(opts, r);
+  }
+}
+
+bool parse_args(int argc, char **argv, Options &opts) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--csv") {
+      opts.csv = true;
+    } else if (arg == "--json") {
+      opts.csv = false;
+    } else if (arg == "--quick") {
+      opts.quick = true;
+      opts.min_time = 0.1;
+    } else if (arg == "--filter" && i + 1 < argc) {
+      opts.filter = argv[++i];
+    } else if (arg == "--min-time" && i + 1 < argc) {
+      opts.min_time = std::atof(argv[++i]);
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace bench
+
+int main(int argc, char **argv) {
+  bench::Options opts;
+  if (!bench::parse_args(argc, argv, opts)) {
+    std::cerr << "Usage: binary_rstdp_bench [--json|--csv] [--quick] "
+                 "[--filter TEXT] [--min-time SEC]"
+              << std::endl;
+    return 1;
+  }
+  bench::print_header(opts);
+  bench::bench_step(opts);
+  bench::bench_tick<HeadlessNet>(opts, "tick");
+  bench::bench_tick<DefaultNet>(opts, "tick_traced");
+  bench::bench_connect(opts);
+  bench::bench_prune(opts);
+  bench::bench_trace(opts);
+  bench::bench_json(opts);
+  bench::bench_batch(opts);
+  bench::bench_neurons(opts);
+  return bench::allocating_cases > 0 || bench::failed_kernels > 0 ? 1 : 0;
+}
@@ -1,9 +1,10 @@
-const socket = new WebSocket('ws://' + window.location.host);
+// ?sim=NAME in the page URL watches that shared simulation (see server.js)
+const socket = new WebSocket('ws://' + window.location.host + '/' + window.location.search);
+socket.binaryType = 'arraybuffer';
 
 const statusEl = document.getElementById('status');
 const neuronGrid = document.getElementById('neuronGrid');
 const synapseCanvas = document.getElementById('synapseCanvas');
-const ctx = synapseCanvas.getContext('2d');
 const tickEl = document.getElementById('tick');
 const foodEl = document.getElementById('food');
 const dangerEl = document.getElementById('danger');
@@ -28,7 +29,7 @@ let initializedCoords = false;
 
 // State
 let neurons = []; // { id, el, x, y, v }
-let connections = []; // { from, to, active, conf } - we'll update this from server
+let connections = { count: 0 }; // { count, src, dst, state } - see decodeFrame()
 let lastFoodEaten = 0;
 
 // Initialize Grid Layout
@@ -86,6 +87,7 @@ function updatePositions() {
 
     synapseCanvas.width = gridRect.width;
     synapseCanvas.height = gridRect.height;
+    synapseRenderer.resize(synapseCanvas.width, synapseCanvas.height);
 
     if (DEBUG_DRAWING) console.log(`[Pos] Canvas Resized to: ${synapseCanvas.width}x${synapseCanvas.height}`);
 
@@ -97,80 +99,477 @@ function updatePositions() {
         n.y = rect.top - gridRect.top + rect.height / 2;
     });
 
-    if (connections.length > 0) drawSynapses();
+    if (connections.count > 0) drawSynapses();
     return true;
 }
 
-// Draw Connections
-function drawSynapses() {
-    // if (DEBUG_DRAWING) console.log(`[Draw] Clearing canvas ${synapseCanvas.width}x${synapseCanvas.height}`);
-    ctx.clearRect(0, 0, synapseCanvas.width, synapseCanvas.height);
-
-    if (!connections || connections.length === 0) return;
+// --- Synapse rendering ---
+// The faint line of every synapse depends only on the topology and the
+// layout, so it is drawn once and reused; only the active and highlighted
+// synapses change from frame to frame. Frames mark what they changed
+// (markTopology / markRewired / markStates) and render() does nothing when
+// nothing did.
+// ?render=webgl draws all edges in one instanced WebGL2 call instead, with
+// the gradients as a color ramp in the fragment shader.
+
+// Canvas 2D: a cached layer of inactive lines, lit synapses drawn over it
+function createCanvasRenderer(canvas) {
+    const ctx = canvas.getContext('2d');
+    const layer = document.createElement('canvas');
+    const layerCtx = layer.getContext('2d');
+    const lit = new Set(); // Active or highlighted synapse indices
+    let gradients = new Map(); // index -> gradient, until the synapse moves
+    let topologyDirty = true;
+    let dirty = true;
+
+    function gradient(conns, index, from, to) {
+        let grad = gradients.get(index);
+        if (!grad || grad.from !== from) {
+            const source = neurons[conns.src[index]];
+            const target = neurons[conns.dst[index]];
+            grad = { from, style: ctx.createLinearGradient(source.x, source.y, target.x, target.y) };
+            grad.style.addColorStop(0, from);
+            grad.style.addColorStop(1, to);
+            gradients.set(index, grad);
+        }
+        return grad.style;
+    }
 
-    // if (DEBUG_DRAWING) console.log(`[Draw] Drawing ${connections.length} connections.`);
+    function drawLayer(conns) {
+        layerCtx.clearRect(0, 0, layer.width, layer.height);
+        lit.clear();
+        // One path: a stroke per synapse is what made large networks slow
+        layerCtx.beginPath();
+        for (let index = 0; index < conns.count; index++) {
+            const source = neurons[conns.src[index]];
+            const target = neurons[conns.dst[index]];
+            if (!source || !target) {
+                if (index === 0 && DEBUG_DRAWING) console.error('[Draw] Invalid neuron refs for conn 0', conns.src[0], conns.dst[0]);
+                continue;
+            }
+            layerCtx.moveTo(source.x, source.y);
+            layerCtx.lineTo(target.x, target.y);
+            if (conns.state[index] & (SYN_ACTIVE | SYN_HIGHLIGHTED)) lit.add(index);
+        }
+        layerCtx.strokeStyle = 'rgba(255, 255, 255, 0.1)';
+        layerCtx.lineWidth = 1;
+        layerCtx.stroke();
+        if (DEBUG_DRAWING) console.log(`[Draw] Static layer: ${conns.count} synapses, ${lit.size} lit`);
+    }
 
-    ctx.save();
-    connections.forEach((conn, index) => {
-        const source = neurons[conn.s];
-        const target = neurons[conn.t];
+    function strokeLit(conns, highlighted) {
+        for (const index of lit) {
+            const state = conns.state[index];
+            if (!!(state & SYN_HIGHLIGHTED) !== highlighted) continue;
+            const source = neurons[conns.src[index]];
+            const target = neurons[conns.dst[index]];
+            if (!source || !target) continue;
+            ctx.beginPath();
+            ctx.moveTo(source.x, source.y);
+            ctx.lineTo(target.x, target.y);
+            if (highlighted) {
+                // Causal Chain: Blue gradient, Thick
+                ctx.strokeStyle = gradient(conns, index, '#60a5fa', '#1d4ed8');
+                ctx.lineWidth = 18;
+            } else {
+                // Active: Yellow (Pre) to Red (Post)
+                ctx.strokeStyle = gradient(conns, index, '#facc15', '#ef4444');
+                ctx.lineWidth = 2.0;
+            }
+            ctx.stroke();
+        }
+    }
 
-        if (!source || !target) {
-            if (index === 0 && DEBUG_DRAWING) console.error('[Draw] Invalid neuron refs for conn 0', conn.s, conn.t);
-            return;
+    return {
+        resize(width, height) {
+            layer.width = width;
+            layer.height = height;
+            gradients = new Map();
+            topologyDirty = dirty = true;
+        },
+        markTopology() {
+            gradients = new Map();
+            topologyDirty = dirty = true;
+        },
+        // Synapses that changed target (delta frame)
+        markRewired(ids) {
+            for (let k = 0; k < ids.length; k++) gradients.delete(ids[k]);
+            topologyDirty = dirty = true;
+        },
+        // Synapses whose state bytes changed (delta frame)
+        markStates(ids, state) {
+            for (let k = 0; k < ids.length; k++) {
+                const index = ids[k];
+                if (state[index] & (SYN_ACTIVE | SYN_HIGHLIGHTED)) lit.add(index);
+                else lit.delete(index);
+            }
+            if (ids.length > 0) dirty = true;
+        },
+        render(conns) {
+            if (!dirty) return;
+            dirty = false;
+            if (topologyDirty) {
+                topologyDirty = false;
+                drawLayer(conns);
+            }
+            ctx.clearRect(0, 0, canvas.width, canvas.height);
+            ctx.drawImage(layer, 0, 0);
+            // Highlighted on top, as when every synapse was stroked in order
+            // over the inactive ones
+            strokeLit(conns, false);
+            strokeLit(conns, true);
         }
+    };
+}
 
-        // Debug first connection coordinates
-        if (index === 0 && DEBUG_DRAWING) {
-            console.log(`[Draw] Conn 0: (${source.x.toFixed(1)}, ${source.y.toFixed(1)}) -> (${target.x.toFixed(1)}, ${target.y.toFixed(1)}) Active: ${conn.a}`);
+// WebGL2: one quad instance per synapse. Endpoints are uploaded when the
+// topology or layout changes, the state bytes when any of them changed.
+const SYNAPSE_VERTEX_SHADER = `#version 300 es
+layout(location = 0) in vec2 corner; // x: 0 at the source, 1 at the target; y: side
+layout(location = 1) in vec4 ends;   // Source and target centers, px
+layout(location = 2) in float state; // SYN_* bits
+uniform vec2 viewport;
+out float along;
+flat out int kind; // 0 inactive, 1 active, 2 highlighted
+void main() {
+    int bits = int(state);
+    kind = (bits & 0x20) != 0 ? 2 : (bits & 0x10) != 0 ? 1 : 0;
+    float width = kind == 2 ? 18.0 : kind == 1 ? 2.0 : 1.0;
+    vec2 dir = ends.zw - ends.xy;
+    float len = length(dir);
+    vec2 normal = len > 0.0 ? vec2(-dir.y, dir.x) / len : vec2(0.0);
+    vec2 p = mix(ends.xy, ends.zw, corner.x) + normal * corner.y * width * 0.5;
+    along = corner.x;
+    gl_Position = vec4(p.x / viewport.x * 2.0 - 1.0, 1.0 - p.y / viewport.y * 2.0, 0.0, 1.0);
+}`;
+
+// The canvas renderer's gradients as ramps; premultiplied alpha
+const SYNAPSE_FRAGMENT_SHADER = `#version 300 es
+precision mediump float;
+in float along;
+flat in int kind;
+out vec4 color;
+void main() {
+    if (kind == 2) color = vec4(mix(vec3(0.376, 0.647, 0.980), vec3(0.114, 0.306, 0.847), along), 1.0);
+    else if (kind == 1) color = vec4(mix(vec3(0.980, 0.800, 0.082), vec3(0.937, 0.267, 0.267), along), 1.0);
+    else color = vec4(0.1);
+}`;
+
+// Returns null if WebGL2 is not available
+function createGlRenderer(canvas) {
+    const gl = canvas.getContext('webgl2', { antialias: true });
+    if (!gl) return null;
+
+    const compile = (type, source) => {
+        const shader = gl.createShader(type);
+        gl.shaderSource(shader, source);
+        gl.compileShader(shader);
+        if (!gl.getShaderParameter(shader, gl.COMPILE_STATUS)) throw new Error(gl.getShaderInfoLog(shader));
+        return shader;
+    };
+    const program = gl.createProgram();
+    gl.attachShader(program, compile(gl.VERTEX_SHADER, SYNAPSE_VERTEX_SHADER));
+    gl.attachShader(program, compile(gl.FRAGMENT_SHADER, SYNAPSE_FRAGMENT_SHADER));
+    gl.linkProgram(program);
+    if (!gl.getProgramParameter(program, gl.LINK_STATUS)) throw new Error(gl.getProgramInfoLog(program));
+    const viewportLoc = gl.getUniformLocation(program, 'viewport');
+
+    const vao = gl.createVertexArray();
+    gl.bindVertexArray(vao);
+    const cornerBuf = gl.createBuffer();
+    gl.bindBuffer(gl.ARRAY_BUFFER, cornerBuf);
+    gl.bufferData(gl.ARRAY_BUFFER, new Float32Array([0, -1, 0, 1, 1, -1, 1, 1]), gl.STATIC_DRAW);
+    gl.enableVertexAttribArray(0);
+    gl.vertexAttribPointer(0, 2, gl.FLOAT, false, 0, 0);
+    const endsBuf = gl.createBuffer();
+    gl.bindBuffer(gl.ARRAY_BUFFER, endsBuf);
+    gl.enableVertexAttribArray(1);
+    gl.vertexAttribPointer(1, 4, gl.FLOAT, false, 0, 0);
+    gl.vertexAttribDivisor(1, 1);
+    const stateBuf = gl.createBuffer();
+    gl.bindBuffer(gl.ARRAY_BUFFER, stateBuf);
+    gl.enableVertexAttribArray(2);
+    gl.vertexAttribPointer(2, 1, gl.UNSIGNED_BYTE, false, 0, 0);
+    gl.vertexAttribDivisor(2, 1);
+    gl.bindVertexArray(null);
+
+    gl.enable(gl.BLEND);
+    gl.blendFunc(gl.ONE, gl.ONE_MINUS_SRC_ALPHA);
+
+    let topologyDirty = true;
+    let statesDirty = true;
+    let instances = 0;
+    let ends = new Float32Array(0);
+
+    function uploadEnds(conns) {
+        if (ends.length < 4 * conns.count) ends = new Float32Array(4 * conns.count);
+        for (let index = 0; index < conns.count; index++) {
+            const source = neurons[conns.src[index]];
+            const target = neurons[conns.dst[index]];
+            // Off-grid neurons collapse to a zero-length (invisible) quad
+            const ok = source && target;
+            ends[4 * index] = ok ? source.x : 0;
+            ends[4 * index + 1] = ok ? source.y : 0;
+            ends[4 * index + 2] = ok ? target.x : 0;
+            ends[4 * index + 3] = ok ? target.y : 0;
         }
+        instances = conns.count;
+        gl.bindBuffer(gl.ARRAY_BUFFER, endsBuf);
+        gl.bufferData(gl.ARRAY_BUFFER, ends.subarray(0, 4 * instances), gl.DYNAMIC_DRAW);
+        gl.bindBuffer(gl.ARRAY_BUFFER, stateBuf);
+        gl.bufferData(gl.ARRAY_BUFFER, conns.state.byteLength, gl.DYNAMIC_DRAW);
+    }
 
-        ctx.beginPath();
-        ctx.moveTo(source.x, source.y);
-        ctx.lineTo(target.x, target.y);
-
-        if (conn.b) {
-            // Causal Chain: Blue gradient, Thick
-            const grad = ctx.createLinearGradient(source.x, source.y, target.x, target.y);
-            grad.addColorStop(0, '#60a5fa'); // Light Blue
-            grad.addColorStop(1, '#1d4ed8'); // Dark Blue
-            ctx.strokeStyle = grad;
-            ctx.lineWidth = 18;
-        } else if (conn.a) {
-            // Active: Yellow to Red gradient
-            const grad = ctx.createLinearGradient(source.x, source.y, target.x, target.y);
-            grad.addColorStop(0, '#facc15'); // Yellow (Pre)
-            grad.addColorStop(1, '#ef4444'); // Red (Post)
-            ctx.strokeStyle = grad;
-            ctx.lineWidth = 2.0;
-        } else {
-            // Inactive: White, subtle
-            ctx.strokeStyle = 'rgba(255, 255, 255, 0.1)';
-            ctx.lineWidth = 1;
+    return {
+        resize(width, height) {
+            gl.viewport(0, 0, width, height);
+            topologyDirty = true;
+        },
+        markTopology() {
+            topologyDirty = true;
+        },
+        markRewired() {
+            topologyDirty = true;
+        },
+        markStates(ids) {
+            if (ids.length > 0) statesDirty = true;
+        },
+        render(conns) {
+            if (!topologyDirty && !statesDirty) return;
+            if (topologyDirty) uploadEnds(conns);
+            // Every state byte at once: a synapse is one byte
+            gl.bindBuffer(gl.ARRAY_BUFFER, stateBuf);
+            gl.bufferSubData(gl.ARRAY_BUFFER, 0, conns.state);
+            topologyDirty = statesDirty = false;
+
+            gl.clearColor(0, 0, 0, 0);
+            gl.clear(gl.COLOR_BUFFER_BIT);
+            gl.useProgram(program);
+            gl.uniform2f(viewportLoc, canvas.width, canvas.height);
+            gl.bindVertexArray(vao);
+            // In synapse order, as the canvas once stroked them; a faint line
+            // drawn over a lit one is at 10% alpha
+            gl.drawArraysInstanced(gl.TRIANGLE_STRIP, 0, 4, instances);
+            gl.bindVertexArray(null);
         }
+    };
+}
+
+let synapseRenderer = null;
+if (new URLSearchParams(window.location.search).get('render') === 'webgl') {
+    synapseRenderer = createGlRenderer(synapseCanvas);
+    if (!synapseRenderer) console.warn('[Draw] WebGL2 not available, using canvas 2D');
+}
+if (!synapseRenderer) synapseRenderer = createCanvasRenderer(synapseCanvas);
+
+function drawSynapses() {
+    if (!connections || connections.count === 0) return;
+    synapseRenderer.render(connections);
+}
+
+// --- State frames ---
+// Both wire formats decode to one shape: header fields as in the JSON frame,
+// neurons as { count, v: Int16Array, spikes: bitmask Uint8Array } and
+// synapses as { count, src, dst, state } with state bits 0-3 confidence,
+// 4 active, 5 highlighted.
+const FRAME_MAGIC = 0x31545352; // "RST1"
+const FRAME_REWARD = 1, FRAME_PENALTY = 2, FRAME_WIDE_IDS = 4, FRAME_DELTA = 8, FRAME_STATS = 16;
+const SYN_CONFIDENCE = 0x0f, SYN_ACTIVE = 0x10, SYN_HIGHLIGHTED = 0x20;
+
+const align4 = (offset) => (offset + 3) & ~3;
+
+// Binary frame layout is documented at FrameWriter in binary_rstdp.cpp.
+// Arrays are viewed in place (little-endian hosts, like all browsers).
+function decodeHeader(dv) {
+    if (dv.getUint32(4, true) !== FRAME_MAGIC) throw new Error('bad frame magic');
+    const flags = dv.getUint32(16, true);
+    const i32 = (at) => dv.getInt32(at, true);
+    return {
+        t: dv.getUint32(12, true),
+        flags,
+        reward: !!(flags & FRAME_REWARD),
+        penalty: !!(flags & FRAME_PENALTY),
+        reward_sum: i32(20),
+        penalty_sum: i32(24),
+        food_time: i32(28),
+        danger_time: i32(32),
+        world: { agent: i32(36), target: i32(40), type: i32(44), food: i32(48), danger: i32(52), dist: i32(56) },
+        neuronCount: dv.getUint32(60, true),
+        synapseCount: dv.getUint32(64, true),
+        bodyOffset: dv.getUint16(10, true)
+    };
+}
+
+// Keyframe
+function decodeFrame(buf) {
+    const header = decodeHeader(new DataView(buf));
+    const n = header.neuronCount;
+    const m = header.synapseCount;
+    const Index = (header.flags & FRAME_WIDE_IDS) ? Uint32Array : Uint16Array;
+
+    let offset = header.bodyOffset;
+    const v = new Int16Array(buf, offset, n);
+    offset = align4(offset + 2 * n);
+    const spikes = new Uint8Array(buf, offset, (n + 7) >> 3);
+    offset = align4(offset + spikes.length);
+    const outDegree = new Index(buf, offset, n);
+    offset = align4(offset + Index.BYTES_PER_ELEMENT * n);
+    const dst = new Index(buf, offset, m);
+    offset = align4(offset + Index.BYTES_PER_ELEMENT * m);
+    const state = new Uint8Array(buf, offset, m);
+
+    // Synapses arrive row by row, so sources follow from the out-degrees
+    const src = new Uint32Array(m);
+    for (let i = 0, k = 0; i < n; i++) {
+        src.fill(i, k, k + outDegree[i]);
+        k += outDegree[i];
+    }
+
+    header.neurons = { count: n, v, spikes };
+    header.synapses = { count: m, src, dst, state };
+    return header;
+}
 
-        ctx.stroke();
+// Apply a delta frame to a decoded keyframe in place. Returns false if the
+// delta does not fit (a keyframe is needed first).
+function applyDelta(frame, buf) {
+    const dv = new DataView(buf);
+    const header = decodeHeader(dv);
+    if (!frame || !frame.neurons || !frame.synapses ||
+        header.neuronCount !== frame.neurons.count ||
+        header.synapseCount !== frame.synapses.count) return false;
+
+    let offset = header.bodyOffset;
+    const a = dv.getUint32(offset, true);
+    const b = dv.getUint32(offset + 4, true);
+    const r = dv.getUint32(offset + 8, true);
+    offset += 12;
+    const neuronIds = new Uint32Array(buf, offset, a);
+    offset += 4 * a;
+    const voltages = new Int16Array(buf, offset, a);
+    offset = align4(offset + 2 * a);
+    const spiked = new Uint8Array(buf, offset, a);
+    offset = align4(offset + a);
+    const synIds = new Uint32Array(buf, offset, b);
+    offset += 4 * b;
+    const states = new Uint8Array(buf, offset, b);
+    offset = align4(offset + b);
+    const rewiredIds = new Uint32Array(buf, offset, r);
+    const newTargets = new Uint32Array(buf, offset + 4 * r, r);
+
+    const { v, spikes } = frame.neurons;
+    for (let k = 0; k < a; k++) {
+        const id = neuronIds[k];
+        v[id] = voltages[k];
+        if (spiked[k]) spikes[id >> 3] |= 1 << (id & 7);
+        else spikes[id >> 3] &= ~(1 << (id & 7));
+    }
+    const { dst, state } = frame.synapses;
+    for (let k = 0; k < b; k++) state[synIds[k]] = states[k];
+    for (let k = 0; k < r; k++) dst[rewiredIds[k]] = newTargets[k];
+    synapseRenderer.markStates(synIds, state);
+    if (r > 0) synapseRenderer.markRewired(rewiredIds);
+
+    const { neurons, synapses } = frame;
+    Object.assign(frame, header, { neurons, synapses });
+    return true;
+}
+
+// Legacy JSON frame (FRAME_FORMAT=json on the server)
+function normalizeJsonFrame(data) {
+    if (data.neurons) {
+        const n = data.neurons.length;
+        const v = new Int16Array(n);
+        const spikes = new Uint8Array((n + 7) >> 3);
+        data.neurons.forEach(ns => {
+            v[ns.id] = ns.v;
+            if (ns.s) spikes[ns.id >> 3] |= 1 << (ns.id & 7);
+        });
+        data.neurons = { count: n, v, spikes };
+    }
+    if (data.synapses) {
+        const m = data.synapses.length;
+        const src = new Uint32Array(m), dst = new Uint32Array(m), state = new Uint8Array(m);
+        data.synapses.forEach((c, k) => {
+            src[k] = c.s;
+            dst[k] = c.t;
+            state[k] = (c.c & SYN_CONFIDENCE) | (c.a ? SYN_ACTIVE : 0) | (c.b ? SYN_HIGHLIGHTED : 0);
+        });
+        data.synapses = { count: m, src, dst, state };
+    }
+    return data;
+}
+
+
+// Latest state (last keyframe plus deltas); drawn at most once per
+// animation frame however fast frames arrive
+let current = null;
+let renderPending = false;
+let keyframeRequested = false;
+
+function scheduleRender() {
+    if (renderPending) return;
+    renderPending = true;
+    requestAnimationFrame(() => {
+        renderPending = false;
+        if (current) updateVisuals(current);
     });
-    ctx.restore();
 }
 
+function requestKeyframe() {
+    if (keyframeRequested || socket.readyState !== WebSocket.OPEN) return;
+    keyframeRequested = true;
+    socket.send('keyframe');
+}
+
+// Tick statistics report (FRAME_STATS): JSON text, padded, then its length
+function decodeStats(buf) {
+    const dv = new DataView(buf);
+    const length = dv.getUint32(buf.byteLength - 4, true);
+    const start = buf.byteLength - 4 - align4(length);
+    return JSON.parse(new TextDecoder().decode(new Uint8Array(buf, start, length)));
+}
+
+function showStats(stats) {
+    if (!stats.enabled) return;
+    const us = (ns) => (ns / 1000).toFixed(1);
+    document.getElementById('tickP99').textContent =
+        `${us(stats.tick_ns.p99)} µs (p50 ${us(stats.tick_ns.p50)})`;
+}
+
+function onBinaryFrame(buf) {
+    const flags = new DataView(buf).getUint32(16, true);
+    if (flags & FRAME_STATS) showStats(decodeStats(buf));
+    if (flags & FRAME_DELTA) {
+        if (!applyDelta(current, buf)) {
+            requestKeyframe();
+            return;
+        }
+    } else {
+        current = decodeFrame(buf);
+        keyframeRequested = false;
+        synapseRenderer.markTopology();
+    }
+    scheduleRender();
+}
 
 function updateVisuals(data) {
     // 1. Update Neurons
     if (data.neurons) {
-        data.neurons.forEach(nState => {
-            const n = neurons[nState.id];
+        const { count, v, spikes } = data.neurons;
+        for (let id = 0; id < count; id++) {
+            const n = neurons[id];
             if (n) {
-                if (nState.s) { // Spiked
+                if (spikes[id >> 3] & (1 << (id & 7))) { // Spiked
                     n.el.classList.add('spiked');
                     n.el.style.backgroundColor = ''; // Reset override
                 } else {
                     n.el.classList.remove('spiked');
-                    const intensity = Math.max(0, Math.min(1, nState.v / 10));
+                    const intensity = Math.max(0, Math.min(1, v[id] / 10));
                     n.el.style.backgroundColor = `rgb(${51 + (251 - 51) * intensity}, ${65 + (191 - 65) * intensity}, ${85 + (36 - 85) * intensity})`;
                 }
             }
-        });
+        }
     }
 
     // 2. Update Connections
@@ -261,10 +660,8 @@ socket.onopen = () => {
     statusEl.textContent = 'Connected';
     statusEl.classList.remove('disconnected');
     statusEl.classList.add('connected');
-
-    // Send initial speed
-    const val = document.getElementById('speedRange').value;
-    socket.send('speed ' + val);
+    // No initial speed: the simulation is shared, and opening a tab should
+    // neither change its speed nor take the controls (see server.js)
 };
 
 socket.onclose = (event) => {
@@ -281,11 +678,21 @@ socket.onerror = (error) => {
 
 socket.onmessage = (event) => {
     try {
+        if (event.data instanceof ArrayBuffer) {
+            onBinaryFrame(event.data);
+            return;
+        }
         const data = JSON.parse(event.data);
         if (data.log) {
             console.log(data.log);
+        } else if (data.status) {
+            // The shared backend stopped; Start brings it back
+            console.warn(`[WS] Backend ${data.status} (code ${data.code})`);
         } else {
-            updateVisuals(data);
+            if (data.stats) showStats(data.stats);
+            current = normalizeJsonFrame(data);
+            synapseRenderer.markTopology(); // JSON frames carry no deltas
+            scheduleRender();
         }
     } catch (e) {
         console.error('Parse error:', e);
@@ -302,6 +709,9 @@ document.getElementById('btnStop').addEventListener('click', () => {
 document.getElementById('btnPause').addEventListener('click', () => {
     socket.send('pause');
 });
+document.getElementById('btnStep').addEventListener('click', () => {
+    socket.send('step 1');
+});
 document.getElementById('btnReset').addEventListener('click', () => {
     socket.send('reset');
 });
@@ -24,91 +24,335 @@ fs.writeFileSync(LOG_FILE, `--- Server started at ${new Date().toISOString()} --
 // Serve static files from 'public' directory
 app.use(express.static(path.join(__dirname, 'public')));
 
-// Path to C++ executable
-const EXE_PATH = path.join(__dirname, '../x64/Debug/binary_rstdp.exe');
+// Path to C++ executable: BACKEND if set, else the first build that exists
+// (Visual Studio project, then CMake build directory)
+const EXE_CANDIDATES = [
+    '../x64/Debug/binary_rstdp.exe',
+    '../x64/Release/binary_rstdp.exe',
+    '../build/Release/binary_rstdp.exe',
+    '../build/binary_rstdp',
+].map(p => path.join(__dirname, p));
+const EXE_PATH = process.env.BACKEND ||
+    EXE_CANDIDATES.find(p => fs.existsSync(p)) || EXE_CANDIDATES[0];
 const CMD = EXE_PATH;
 
+// Binary state frames (see FrameWriter in binary_rstdp.cpp) are forwarded
+// as-is; set FRAME_FORMAT=json for the legacy JSON lines
+const BINARY_FRAMES = process.env.FRAME_FORMAT !== 'json';
+// Binary frames as deltas between keyframes (FRAME_DELTA=0 to disable)
+const DELTA_FRAMES = BINARY_FRAMES && process.env.FRAME_DELTA !== '0';
+const FRAME_MAGIC = 0x31545352; // "RST1"
+// Optional checkpoint file: loaded at spawn if present, saved when the
+// backend stops (see checkpointFor for named simulations)
+const CHECKPOINT = process.env.CHECKPOINT ? path.resolve(process.env.CHECKPOINT) : null;
+const FRAME_FLAG_DELTA = 8;
+// Frames between tick statistics reports in the stream (STATS_INTERVAL=0:
+// only on the 'stats' command)
+const STATS_INTERVAL = parseInt(process.env.STATS_INTERVAL || '300', 10) || 0;
+
 log(`Targeting executable: ${CMD}`);
+log(`Frame format: ${BINARY_FRAMES ? (DELTA_FRAMES ? 'binary delta' : 'binary') : 'json'}`);
 
-wss.on('connection', (ws) => {
-    log('Client connected (WebSocket)');
-    log('Spawning C++ process...');
+// Simulations are shared: one long-lived backend per name (?sim=NAME,
+// default 'default'), created on first use and kept running with no
+// viewers. Its output is framed once and fanned out to every viewer.
+const DEFAULT_SIM = 'default';
+const MAX_SIMULATIONS = parseInt(process.env.MAX_SIMULATIONS || '4', 10) || 1;
+// Commands from one viewer lock out the others until it has been quiet for
+// this long (or disconnects)
+const CONTROL_LEASE_MS = parseInt(process.env.CONTROL_LEASE_MS || '30000', 10);
+const BACKPRESSURE_LIMIT = 1024 * 1024; // Bytes queued per viewer
+const FRAME_INTERVAL = 33; // ~30 FPS per viewer, full frames only
+// Commands that change nothing another viewer sees
+const FREE_COMMANDS = new Set(['keyframe', 'stats']);
+// What a viewer may send, with the type of each argument: an integer or
+// one of a list of words. Checkpoint paths stay with the server
+// (CHECKPOINT), so 'save' and 'load' are not among them.
+const VIEWER_COMMANDS = {
+    start: [], resume: [], pause: [], stop: [], reset: [],
+    keyframe: [], stats: [],
+    speed: ['int'], mode: ['int'], fps: ['int'], trace: ['int'], step: ['int'],
+    engine: [['dense', 'event']]
+};
 
-    let buffer = '';
-    const process = spawn(CMD, [], {
-        cwd: path.join(__dirname, '../')
-    });
+// One command per message: returns { name, text } with the command as the
+// backend will get it, or null for anything else (other commands, missing
+// or extra arguments, control characters such as newlines)
+function parseCommand(msg) {
+    if (msg.length > 64 || /[\x00-\x1f\x7f]/.test(msg)) return null;
+    const words = msg.trim().split(/ +/);
+    const args = Object.prototype.hasOwnProperty.call(VIEWER_COMMANDS, words[0])
+        ? VIEWER_COMMANDS[words[0]] : null;
+    if (!args || words.length !== args.length + 1) return null;
+    const values = [];
+    for (let k = 0; k < args.length; ++k) {
+        const word = words[k + 1];
+        if (args[k] === 'int') {
+            if (!/^-?\d{1,9}$/.test(word)) return null;
+            values.push(String(parseInt(word, 10)));
+        } else {
+            if (!args[k].includes(word)) return null;
+            values.push(word);
+        }
+    }
+    return { name: words[0], text: [words[0], ...values].join(' ') };
+}
+
+const simulations = new Map();
+let nextViewerId = 1;
+
+// Checkpoint of a named simulation: CHECKPOINT itself for the default one,
+// else with the name before the extension (trained.ck -> trained.NAME.ck)
+function checkpointFor(name) {
+    if (!CHECKPOINT || name === DEFAULT_SIM) return CHECKPOINT;
+    const ext = path.extname(CHECKPOINT);
+    return CHECKPOINT.slice(0, CHECKPOINT.length - ext.length) + '.' + name + ext;
+}
+
+class Viewer {
+    constructor(ws) {
+        this.ws = ws;
+        this.id = nextViewerId++;
+        this.lastFrameTime = 0;
+        // Deltas only make sense on top of every earlier delta, so a
+        // viewer that joins or drops one waits for the next keyframe
+        this.awaitingKeyframe = DELTA_FRAMES;
+    }
+
+    sendText(text) {
+        if (this.ws.readyState === WebSocket.OPEN) this.ws.send(text);
+    }
+
+    // Frames are dropped while this viewer is backed up, and full frames
+    // are throttled. Returns false while it waits for a keyframe it could
+    // take now (a backed-up viewer asks only once it has drained).
+    offer(frame, isDelta, binary) {
+        if (this.ws.readyState !== WebSocket.OPEN) return true;
+        const backedUp = this.ws.bufferedAmount >= BACKPRESSURE_LIMIT;
+        if (DELTA_FRAMES) {
+            if (backedUp) {
+                this.awaitingKeyframe = true;
+                return true;
+            }
+            if (isDelta && this.awaitingKeyframe) return false;
+            this.ws.send(frame, { binary });
+            if (!isDelta) this.awaitingKeyframe = false;
+            return true;
+        }
+        const now = Date.now();
+        if (now - this.lastFrameTime >= FRAME_INTERVAL && !backedUp) {
+            this.ws.send(frame, { binary });
+            this.lastFrameTime = now;
+        }
+        return true;
+    }
+}
+
+class Simulation {
+    constructor(name) {
+        this.name = name;
+        this.checkpoint = checkpointFor(name);
+        this.viewers = new Set();
+        this.proc = null;
+        this.keyframeRequested = false;
+        this.controller = null; // Viewer holding the controls
+        this.controlUntil = 0;
+    }
+
+    log(message) {
+        log(`[SIM ${this.name}] ${message}`);
+    }
 
-    let lastFrameTime = 0;
-    const FRAME_INTERVAL = 33; // ~30 FPS
-
-    process.stdout.on('data', (data) => {
-        const rawData = data.toString();
-        buffer += rawData;
-
-        let boundary = buffer.indexOf('\n');
-        while (boundary !== -1) {
-            const line = buffer.substring(0, boundary).trim();
-            buffer = buffer.substring(boundary + 1);
-
-            if (line.startsWith('{') && line.endsWith('}')) {
-                const now = Date.now();
-                if (now - lastFrameTime >= FRAME_INTERVAL) {
-                    if (ws.readyState === WebSocket.OPEN) {
-                        // Check backpressure
-                        if (ws.bufferedAmount < 1024 * 1024) { // 1MB limit
-                            ws.send(line);
-                            lastFrameTime = now;
-                        } else {
-                            // Drop frame if buffer is too full
-                        }
-                    }
+    start() {
+        if (this.proc) return;
+        const args = DELTA_FRAMES ? ['--delta'] : (BINARY_FRAMES ? ['--binary'] : []);
+        if (STATS_INTERVAL > 0) args.push('--stats-interval', String(STATS_INTERVAL));
+        if (this.checkpoint) {
+            if (fs.existsSync(this.checkpoint)) args.push('--load', this.checkpoint);
+            args.push('--save', this.checkpoint);
+        }
+        this.log(`Spawning C++ process: ${args.join(' ')}`);
+        const proc = spawn(CMD, args, { cwd: path.join(__dirname, '../') });
+        this.proc = proc;
+        this.keyframeRequested = false;
+        let buffer = '';
+        let pending = Buffer.alloc(0);
+
+        // Frames are a u32 length followed by that many bytes; only the
+        // frame header is read here, the browser decodes the rest
+        const onBinaryData = (data) => {
+            pending = pending.length ? Buffer.concat([pending, data]) : data;
+            let offset = 0;
+            while (pending.length - offset >= 8) {
+                if (pending.readUInt32LE(offset + 4) !== FRAME_MAGIC) {
+                    this.log('[CPP STDOUT] Lost frame sync, dropping buffered output');
+                    offset = pending.length;
+                    break;
                 }
-            } else if (line.length > 0) {
-                log(`[CPP STDOUT] ${line}`);
-                if (ws.readyState === WebSocket.OPEN) {
-                    ws.send(JSON.stringify({ log: line }));
+                const end = offset + 4 + pending.readUInt32LE(offset);
+                if (end > pending.length) break;
+                const frame = pending.subarray(offset, end);
+                const isDelta = (frame.readUInt32LE(16) & FRAME_FLAG_DELTA) !== 0;
+                this.broadcast(frame, isDelta, true);
+                offset = end;
+            }
+            // Copied out, so a slow socket never pins the whole chunk
+            pending = Buffer.from(pending.subarray(offset));
+        };
+
+        const onJsonData = (data) => {
+            buffer += data.toString();
+            let boundary = buffer.indexOf('\n');
+            while (boundary !== -1) {
+                const line = buffer.substring(0, boundary).trim();
+                buffer = buffer.substring(boundary + 1);
+                if (line.startsWith('{') && line.endsWith('}')) {
+                    // Encoded once for every viewer
+                    this.broadcast(Buffer.from(line), false, false);
+                } else if (line.length > 0) {
+                    this.log(`[CPP STDOUT] ${line}`);
+                    const text = JSON.stringify({ log: line });
+                    for (const viewer of this.viewers) viewer.sendText(text);
                 }
+                boundary = buffer.indexOf('\n');
             }
+        };
 
-            boundary = buffer.indexOf('\n');
-        }
-    });
+        proc.stdout.on('data', BINARY_FRAMES ? onBinaryData : onJsonData);
+        proc.stderr.on('data', (data) => {
+            this.log(`[CPP STDERR] ${data.toString().trim()}`);
+        });
+        proc.on('error', (err) => {
+            this.log(`[CPP ERROR] Failed to start process: ${err.message}`);
+        });
+        proc.on('exit', (code, signal) => {
+            this.log(`[CPP EXIT] Process exited with code ${code}, signal ${signal}`);
+        });
+        proc.on('close', (code) => {
+            this.log(`[CPP CLOSE] Process closed with code ${code}`);
+            if (this.proc === proc) this.proc = null;
+            const text = JSON.stringify({ status: 'stopped', code });
+            for (const viewer of this.viewers) viewer.sendText(text);
+        });
+    }
 
+    // Resolves once the backend is gone; with a checkpoint it is asked to
+    // stop so that it writes it first
+    stop() {
+        const proc = this.proc;
+        if (!proc) return Promise.resolve();
+        return new Promise((resolve) => {
+            proc.on('close', resolve);
+            if (!this.checkpoint) {
+                proc.kill();
+                return;
+            }
+            proc.stdin.write('stop\n');
+            const timer = setTimeout(() => proc.kill(), 5000);
+            proc.on('exit', () => clearTimeout(timer));
+        });
+    }
 
-    process.stderr.on('data', (data) => {
-        log(`[CPP STDERR] ${data.toString().trim()}`);
-    });
+    write(command) {
+        if (!this.proc) return;
+        this.log(`[CPP STDIN] Writing: ${command}`);
+        this.proc.stdin.write(command + '\n');
+    }
 
-    process.on('error', (err) => {
-        log(`[CPP ERROR] Failed to start process: ${err.message}`);
-    });
+    // One keyframe serves every viewer waiting for one
+    requestKeyframe() {
+        if (this.keyframeRequested) return;
+        this.keyframeRequested = true;
+        this.write('keyframe');
+    }
 
-    process.on('exit', (code, signal) => {
-        log(`[CPP EXIT] Process exited with code ${code}, signal ${signal}`);
-    });
+    broadcast(frame, isDelta, binary) {
+        if (!isDelta) this.keyframeRequested = false;
+        let needKeyframe = false;
+        for (const viewer of this.viewers) {
+            if (!viewer.offer(frame, isDelta, binary)) needKeyframe = true;
+        }
+        if (needKeyframe) this.requestKeyframe();
+    }
 
-    process.on('close', (code) => {
-        log(`[CPP CLOSE] Process closed with code ${code}`);
-        if (ws.readyState === WebSocket.OPEN) {
-            ws.send(JSON.stringify({ status: 'stopped', code }));
+    subscribe(viewer) {
+        this.viewers.add(viewer);
+        this.start();
+        if (DELTA_FRAMES) this.requestKeyframe();
+        this.log(`Viewer ${viewer.id} joined (${this.viewers.size} watching)`);
+    }
+
+    unsubscribe(viewer) {
+        this.viewers.delete(viewer);
+        if (this.controller === viewer) this.controller = null;
+        this.log(`Viewer ${viewer.id} left (${this.viewers.size} watching)`);
+    }
+
+    // One viewer at a time drives the run: the first to send a command
+    // holds the controls until it has been quiet for CONTROL_LEASE_MS.
+    // 'start' also restarts a backend that has stopped.
+    command(viewer, msg) {
+        const command = parseCommand(msg);
+        if (!command) {
+            this.log(`Viewer ${viewer.id}: ${JSON.stringify(msg)} refused, not a viewer command`);
+            viewer.sendText(JSON.stringify({ log: 'Unknown command' }));
+            return;
         }
-    });
+        const name = command.name;
+        if (name === 'keyframe') {
+            viewer.awaitingKeyframe = DELTA_FRAMES;
+            this.requestKeyframe();
+            return;
+        }
+        if (!FREE_COMMANDS.has(name)) {
+            const now = Date.now();
+            if (this.controller && this.controller !== viewer && now < this.controlUntil) {
+                const seconds = Math.ceil((this.controlUntil - now) / 1000);
+                this.log(`Viewer ${viewer.id}: '${command.text}' refused, viewer ${this.controller.id} has the controls`);
+                viewer.sendText(JSON.stringify({
+                    log: `Viewer ${this.controller.id} has the controls; try again in ${seconds} s`
+                }));
+                return;
+            }
+            this.controller = viewer;
+            this.controlUntil = now + CONTROL_LEASE_MS;
+        }
+        if (name === 'start' || name === 'resume') this.start();
+        this.write(command.text);
+    }
+}
+
+function simulationFor(name) {
+    let sim = simulations.get(name);
+    if (!sim && simulations.size < MAX_SIMULATIONS) {
+        sim = new Simulation(name);
+        simulations.set(name, sim);
+    }
+    return sim;
+}
+
+wss.on('connection', (ws, req) => {
+    const query = new URL(req.url, 'http://localhost').searchParams;
+    const name = query.get('sim') || DEFAULT_SIM;
+    const sim = /^[\w-]{1,32}$/.test(name) ? simulationFor(name) : null;
+    if (!sim) {
+        log(`Client refused: no simulation '${name}' (at most ${MAX_SIMULATIONS})`);
+        ws.close(1013, 'No such simulation');
+        return;
+    }
+    const viewer = new Viewer(ws);
+    log(`Client connected (WebSocket), viewer ${viewer.id} of '${name}'`);
+    sim.subscribe(viewer);
 
     ws.on('message', (message) => {
         const msg = message.toString();
-        log(`[WS MESSAGE] Received: ${msg}`);
-        if (process.stdin) {
-            log(`[CPP STDIN] Writing: ${msg}`);
-            process.stdin.write(msg + '\n');
-        } else {
-            log('[CPP STDIN] Error: stdin not available');
-        }
+        log(`[WS MESSAGE] Viewer ${viewer.id}: ${JSON.stringify(msg)}`);
+        sim.command(viewer, msg);
     });
 
     ws.on('close', () => {
-        log('Client disconnected (WebSocket), killing C++ process');
-        process.kill();
+        log(`Client disconnected (WebSocket), viewer ${viewer.id}`);
+        sim.unsubscribe(viewer);
     });
 
     ws.on('error', (err) => {
@@ -116,6 +360,21 @@ wss.on('connection', (ws) => {
     });
 });
 
+// The default simulation runs from startup, watched or not
+simulationFor(DEFAULT_SIM).start();
+
+// Backends write their checkpoints before the server goes away
+let shuttingDown = false;
+function shutdown(signal) {
+    if (shuttingDown) return;
+    shuttingDown = true;
+    log(`${signal} received, stopping ${simulations.size} simulation(s)`);
+    Promise.all([...simulations.values()].map(sim => sim.stop()))
+        .then(() => process.exit(0));
+}
+process.on('SIGINT', () => shutdown('SIGINT'));
+process.on('SIGTERM', () => shutdown('SIGTERM'));
+
 const PORT = 8080;
 server.listen(PORT, () => {
     log(`Server listening on http://localhost:${PORT}`);